@@ -0,0 +1,218 @@
+#!mruby
+#
+# mruby-zstd のベンチマーク
+#
+# usage: mruby bench/bench.rb [sizes=100,1k,64k,1m,16m] [levels=1,3,9,19]
+#                             [chunks=64,4k,64k,1m] [stream_size=16m]
+#                             [mintime=0.5] [tmpdir=/tmp]
+#
+# 結果は 1 行 1 レコードの JSON として標準出力へ書き出されます。
+# 同じ条件を bench/driver.c (libzstd を直接呼び出す) でも計測できるため、
+# 差を取ることでバインディング自体のオーバーヘッドが分かります。
+#
+
+module ZstdBench
+  WORDS = %w(
+    the of and to in is was that for on are with as by at from this be have
+    zstd mruby compress decompress stream frame block window dictionary level
+    0 1 2 3 4 5 6 7 8 9 10 16 32 64 128 256 1024 4096 65536
+    alpha bravo charlie delta echo foxtrot golf hotel india juliet kilo lima
+  )
+
+  # 圧縮率が極端にならないよう、単語を疑似乱数で並べたテキストを作る。
+  # bench/driver.c と同一の手順なので、同じ入力データとなる。
+  # 1 MiB を超える大きさは、この 1 MiB のコーパスを繰り返したものとなる。
+  def self.corpus
+    @corpus ||= begin
+      x = 1
+      n = 0
+      buf = ""
+      while buf.bytesize < 1 << 20
+        x = (x * 75 + 74) % 65537
+        buf << WORDS[x % WORDS.size]
+        n += 1
+        buf << (n % 12 == 0 ? "\n" : " ")
+      end
+      buf.byteslice(0, 1 << 20)
+    end
+  end
+
+  def self.payload(size)
+    base = corpus
+    if size <= base.bytesize
+      base.byteslice(0, size)
+    else
+      s = base * (size / base.bytesize)
+      s << base.byteslice(0, size % base.bytesize)
+    end
+  end
+
+  # mruby は既定で正規表現を持たないため、文字列操作のみで処理する
+  def self.parse_size(s)
+    unit = { "k" => 1 << 10, "m" => 1 << 20, "g" => 1 << 30 }[s[-1].downcase]
+    n = unit ? s[0...-1] : s
+    raise ArgumentError, "wrong size - #{s}" if n.empty? || n.bytes.any? { |c| c < 0x30 || c > 0x39 }
+    n.to_i * (unit || 1)
+  end
+
+  # 最大常駐メモリ量 (VmHWM) を現在の値に戻す。
+  # 戻せない環境では、それまでの最大値が以降の計測に混ざるため、peak_rss は nil を返す。
+  def self.reset_peak_rss
+    File.open("/proc/self/clear_refs", "w") { |f| f.write "5" }
+    @peak_rss_resettable = true
+  rescue
+    @peak_rss_resettable = false
+  end
+
+  # 直前の reset_peak_rss からの最大常駐メモリ量 (KiB)
+  def self.peak_rss
+    return nil unless @peak_rss_resettable
+    File.open("/proc/self/status", "r") do |f|
+      f.read.each_line { |l| return l.split(":", 2)[1].strip.to_i if l.start_with?("VmHWM:") }
+    end
+    nil
+  rescue
+    nil
+  end
+
+  def self.now
+    Time.now.to_f
+  end
+
+  # 最低 mintime 秒かつ最低 5 回 (最大 100000 回) 繰り返し、各回の経過時間を記録する
+  # (peak_rss_kb はこの計測中の最大値となる)
+  def self.measure(mintime)
+    reset_peak_rss
+    laps = []
+    total = 0.0
+    while laps.size < 5 || (total < mintime && laps.size < 100000)
+      t = now
+      yield
+      t = now - t
+      laps << t
+      total += t
+    end
+    [laps, total]
+  end
+
+  def self.report(entry, size, laps, total)
+    laps = laps.sort
+    p50 = laps[(laps.size - 1) * 50 / 100]
+    p99 = laps[(laps.size - 1) * 99 / 100]
+    total = 1e-9 if total <= 0
+    entry = entry.merge(
+      size: size,
+      iterations: laps.size,
+      mb_per_s: size * laps.size / total / 1e6,
+      ops_per_s: laps.size / total,
+      p50_us: p50 * 1e6,
+      p99_us: p99 * 1e6,
+      peak_rss_kb: peak_rss)
+    puts "{" + entry.map { |k, v| %("#{k}":#{json(v)}) }.join(",") + "}"
+  end
+
+  def self.json(v)
+    case v
+    when nil then "null"
+    when String, Symbol then %("#{v}")
+    when Float then format("%.3f", v)
+    else v.to_s
+    end
+  end
+
+  def self.oneshot(conf)
+    conf[:sizes].each do |size|
+      src = payload(size)
+      conf[:levels].each do |level|
+        [false, true].each do |withdict|
+          # 辞書が効果を持つのは小さなデータに限られるため、大きなデータでは省く
+          next if withdict && size > 1 << 20
+          dict = withdict ? Zstd::Dictionary.new(corpus.byteslice(0, 16384), level: level) : nil
+          opts = { level: level, dict: dict }
+          dest = Zstd.encode(src, opts)
+          base = { impl: "mruby", bench: "oneshot", level: level, dict: withdict, port: "string", chunk: nil }
+
+          laps, total = measure(conf[:mintime]) { Zstd.encode(src, opts) }
+          report(base.merge(op: "encode", ratio: dest.bytesize.to_f / size), size, laps, total)
+
+          laps, total = measure(conf[:mintime]) { Zstd.decode(dest, dict: dict) }
+          report(base.merge(op: "decode", ratio: dest.bytesize.to_f / size), size, laps, total)
+        end
+      end
+    end
+  end
+
+  def self.streaming(conf)
+    size = conf[:stream_size]
+    src = payload(size)
+    path = File.join(conf[:tmpdir], "mruby-zstd-bench.zst")
+    level = 3
+
+    begin
+      conf[:chunks].each do |chunk|
+        pieces = []
+        off = 0
+        while off < size
+          pieces << src.byteslice(off, chunk)
+          off += chunk
+        end
+
+        %w(string io).each do |port|
+          base = { impl: "mruby", bench: "stream", level: level, dict: false, port: port, chunk: chunk }
+
+          laps, total = measure(conf[:mintime]) {
+            if port == "string"
+              Zstd::Encoder.wrap("", level: level) { |z| pieces.each { |s| z << s } }
+            else
+              File.open(path, "wb") { |f| Zstd::Encoder.wrap(f, level: level) { |z| pieces.each { |s| z << s } } }
+            end
+          }
+          report(base.merge(op: "encode"), size, laps, total)
+
+          dest = Zstd.encode(src, level: level)
+          File.open(path, "wb") { |f| f << dest } if port == "io"
+          buf = ""
+          laps, total = measure(conf[:mintime]) {
+            if port == "string"
+              Zstd::Decoder.wrap(dest) { |z| nil while z.read(chunk, buf) }
+            else
+              File.open(path, "rb") { |f| Zstd::Decoder.wrap(f) { |z| nil while z.read(chunk, buf) } }
+            end
+          }
+          report(base.merge(op: "decode"), size, laps, total)
+        end
+      end
+    ensure
+      File.unlink(path) rescue nil
+    end
+  end
+
+  def self.main(argv)
+    conf = {
+      sizes: %w(100 1k 64k 1m 16m),
+      levels: %w(1 3 9 19),
+      chunks: %w(64 4k 64k 1m),
+      stream_size: "16m",
+      mintime: "0.5",
+      tmpdir: "/tmp",
+    }
+
+    argv.each do |a|
+      k, v = a.split("=", 2)
+      k = k.sub("--", "").to_sym
+      raise ArgumentError, "unknown option - #{a}" unless conf.key?(k) && v
+      conf[k] = conf[k].is_a?(Array) ? v.split(",") : v
+    end
+
+    conf[:sizes] = conf[:sizes].map { |s| parse_size(s) }
+    conf[:levels] = conf[:levels].map(&:to_i)
+    conf[:chunks] = conf[:chunks].map { |s| parse_size(s) }
+    conf[:stream_size] = parse_size(conf[:stream_size])
+    conf[:mintime] = conf[:mintime].to_f
+
+    oneshot(conf)
+    streaming(conf)
+  end
+end
+
+ZstdBench.main(ARGV)
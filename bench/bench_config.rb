@@ -0,0 +1,17 @@
+MRuby::Lockfile.disable rescue nil
+
+MRuby::Build.new("host-bench") do |conf|
+  toolchain :gcc
+
+  conf.build_dir = conf.name
+
+  cc.defines << "MRB_INT64"
+  cc.flags << "-O2"
+
+  gem core: "mruby-print"
+  gem core: "mruby-sprintf"
+  gem core: "mruby-time"
+  gem core: "mruby-io"
+  gem core: "mruby-bin-mruby"
+  gem File.dirname(File.dirname(File.expand_path(__FILE__)))
+end
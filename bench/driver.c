@@ -0,0 +1,463 @@
+/*
+ * libzstd を直接呼び出すベンチマークドライバ
+ *
+ * bench/bench.rb と同じ入力データ・同じ条件で計測し、同じ形式 (JSON Lines) で出力する。
+ * 両者の差がバインディングのオーバーヘッドとなる。
+ *
+ * usage: zstd-bench-driver [sizes=100,1k,64k,1m,16m] [levels=1,3,9,19]
+ *                          [chunks=64,4k,64k,1m] [stream_size=16m]
+ *                          [mintime=0.5] [tmpdir=/tmp]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define ZSTD_STATIC_LINKING_ONLY 1
+#include <zstd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#define CORPUS_SIZE     ((size_t)1 << 20)
+#define DICT_SIZE       16384
+#define MAX_LIST        16
+#define MAX_LAPS        100000
+
+static const char *const words[] = {
+    "the", "of", "and", "to", "in", "is", "was", "that", "for", "on", "are", "with", "as", "by", "at", "from", "this", "be", "have",
+    "zstd", "mruby", "compress", "decompress", "stream", "frame", "block", "window", "dictionary", "level",
+    "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "16", "32", "64", "128", "256", "1024", "4096", "65536",
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel", "india", "juliet", "kilo", "lima",
+};
+
+struct list
+{
+    int num;
+    size_t v[MAX_LIST];
+};
+
+struct conf
+{
+    struct list sizes, levels, chunks;
+    size_t stream_size;
+    double mintime;
+    const char *tmpdir;
+};
+
+static void
+die(const char *mesg, size_t code)
+{
+    if (code != 0 && ZSTD_isError(code)) {
+        fprintf(stderr, "%s: %s\n", mesg, ZSTD_getErrorName(code));
+    } else {
+        fprintf(stderr, "%s\n", mesg);
+    }
+    exit(1);
+}
+
+static void *
+xmalloc(size_t size)
+{
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == NULL) { die("out of memory", 0); }
+    return p;
+}
+
+static size_t
+check(const char *mesg, size_t code)
+{
+    if (ZSTD_isError(code)) { die(mesg, code); }
+    return code;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int peak_rss_resettable = 0;
+
+/*
+ * 最大常駐メモリ量 (VmHWM) を現在の値に戻す。
+ * getrusage(2) の ru_maxrss はプロセスの生存期間を通じた最大値で戻せないため、/proc を用いる。
+ */
+static void
+reset_peak_rss(void)
+{
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+
+    peak_rss_resettable = (fp != NULL && fputs("5", fp) >= 0);
+    if (fp != NULL && fclose(fp) != 0) { peak_rss_resettable = 0; }
+}
+
+/* 直前の reset_peak_rss() からの最大常駐メモリ量 (KiB)。戻せない環境では -1 */
+static long
+peak_rss(void)
+{
+    char line[256];
+    long rss = -1;
+    FILE *fp;
+
+    if (!peak_rss_resettable) { return -1; }
+    fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) { return -1; }
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            rss = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+
+    return rss;
+}
+
+/* bench.rb の ZstdBench.corpus と同一 */
+static char *
+make_corpus(void)
+{
+    char *buf = xmalloc(CORPUS_SIZE + 32);
+    size_t len = 0;
+    int x = 1, n = 0;
+    const int nwords = sizeof(words) / sizeof(words[0]);
+
+    while (len < CORPUS_SIZE) {
+        const char *w;
+        x = (x * 75 + 74) % 65537;
+        w = words[x % nwords];
+        memcpy(buf + len, w, strlen(w));
+        len += strlen(w);
+        n ++;
+        buf[len ++] = (n % 12 == 0 ? '\n' : ' ');
+    }
+
+    return buf;
+}
+
+static char *
+make_payload(const char *corpus, size_t size)
+{
+    char *p = xmalloc(size);
+    size_t off;
+
+    for (off = 0; off < size; off += CORPUS_SIZE) {
+        size_t n = size - off;
+        memcpy(p + off, corpus, n < CORPUS_SIZE ? n : CORPUS_SIZE);
+    }
+
+    return p;
+}
+
+static size_t
+parse_size(const char *s)
+{
+    char *end;
+    size_t n = strtoull(s, &end, 10);
+
+    if (end == s) { die("wrong size", 0); }
+    switch (tolower((unsigned char)*end)) {
+    case 'k': n <<= 10; end ++; break;
+    case 'm': n <<= 20; end ++; break;
+    case 'g': n <<= 30; end ++; break;
+    }
+    if (*end != '\0') { die("wrong size", 0); }
+
+    return n;
+}
+
+static void
+parse_list(struct list *list, const char *s, int issize)
+{
+    char buf[64];
+
+    list->num = 0;
+    while (*s != '\0' && list->num < MAX_LIST) {
+        size_t n = strcspn(s, ",");
+        if (n >= sizeof(buf)) { die("too long list item", 0); }
+        memcpy(buf, s, n);
+        buf[n] = '\0';
+        list->v[list->num ++] = issize ? parse_size(buf) : (size_t)strtol(buf, NULL, 10);
+        s += n + (s[n] == ',');
+    }
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+struct laps
+{
+    int num;
+    double total;
+    double v[MAX_LAPS];
+};
+
+static void
+report(const char *bench, const char *op, const char *port, int level, int dict,
+       size_t chunk, double ratio, size_t size, struct laps *laps)
+{
+    double total = laps->total > 0 ? laps->total : 1e-9;
+    char chunkbuf[32], ratiobuf[32], rssbuf[32];
+    long rss = peak_rss();
+
+    qsort(laps->v, laps->num, sizeof(laps->v[0]), cmp_double);
+
+    if (chunk > 0) { snprintf(chunkbuf, sizeof(chunkbuf), "%zu", chunk); } else { strcpy(chunkbuf, "null"); }
+    if (ratio >= 0) { snprintf(ratiobuf, sizeof(ratiobuf), ",\"ratio\":%.3f", ratio); } else { ratiobuf[0] = '\0'; }
+    if (rss >= 0) { snprintf(rssbuf, sizeof(rssbuf), "%ld", rss); } else { strcpy(rssbuf, "null"); }
+
+    printf("{\"impl\":\"libzstd\",\"bench\":\"%s\",\"level\":%d,\"dict\":%s,\"port\":\"%s\",\"chunk\":%s,"
+           "\"op\":\"%s\"%s,\"size\":%zu,\"iterations\":%d,\"mb_per_s\":%.3f,\"ops_per_s\":%.3f,"
+           "\"p50_us\":%.3f,\"p99_us\":%.3f,\"peak_rss_kb\":%s}\n",
+           bench, level, dict ? "true" : "false", port, chunkbuf,
+           op, ratiobuf, size, laps->num, (double)size * laps->num / total / 1e6, laps->num / total,
+           laps->v[(laps->num - 1) * 50 / 100] * 1e6, laps->v[(laps->num - 1) * 99 / 100] * 1e6,
+           rssbuf);
+    fflush(stdout);
+}
+
+/*
+ * bench.rb の ZstdBench.measure と同じく、最低 mintime 秒かつ最低 5 回繰り返す
+ * (peak_rss_kb はこの計測中の最大値となる)
+ */
+#define MEASURE(laps, mintime, ...)                                             \
+    do {                                                                        \
+        reset_peak_rss();                                                       \
+        (laps)->num = 0;                                                        \
+        (laps)->total = 0;                                                      \
+        while ((laps)->num < 5 ||                                               \
+               ((laps)->total < (mintime) && (laps)->num < MAX_LAPS)) {         \
+            double t_ = now();                                                  \
+            __VA_ARGS__;                                                        \
+            t_ = now() - t_;                                                    \
+            (laps)->v[(laps)->num ++] = t_;                                     \
+            (laps)->total += t_;                                                \
+        }                                                                       \
+    } while (0)
+
+static void
+bench_oneshot(const struct conf *conf, const char *corpus, struct laps *laps)
+{
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_DDict *ddict = ZSTD_createDDict(corpus, DICT_SIZE);
+    int i, j, withdict;
+
+    for (i = 0; i < conf->sizes.num; i ++) {
+        size_t size = conf->sizes.v[i];
+        char *src = make_payload(corpus, size);
+        size_t destcap = ZSTD_compressBound(size);
+        char *dest = xmalloc(destcap);
+        char *back = xmalloc(size);
+
+        for (j = 0; j < conf->levels.num; j ++) {
+            int level = (int)conf->levels.v[j];
+
+            for (withdict = 0; withdict < 2; withdict ++) {
+                ZSTD_CDict *cdict = NULL;
+                size_t destsize;
+
+                if (withdict && size > CORPUS_SIZE) { continue; }
+
+                ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+                if (withdict) {
+                    cdict = ZSTD_createCDict(corpus, DICT_SIZE, level);
+                    check("ZSTD_CCtx_refCDict", ZSTD_CCtx_refCDict(cctx, cdict));
+                } else {
+                    check("ZSTD_CCtx_setParameter", ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level));
+                }
+
+                destsize = check("ZSTD_compress2", ZSTD_compress2(cctx, dest, destcap, src, size));
+                MEASURE(laps, conf->mintime, check("ZSTD_compress2", ZSTD_compress2(cctx, dest, destcap, src, size)));
+                report("oneshot", "encode", "string", level, withdict, 0, (double)destsize / size, size, laps);
+
+                if (withdict) {
+                    MEASURE(laps, conf->mintime, check("ZSTD_decompress_usingDDict", ZSTD_decompress_usingDDict(dctx, back, size, dest, destsize, ddict)));
+                } else {
+                    MEASURE(laps, conf->mintime, check("ZSTD_decompressDCtx", ZSTD_decompressDCtx(dctx, back, size, dest, destsize)));
+                }
+                report("oneshot", "decode", "string", level, withdict, 0, (double)destsize / size, size, laps);
+
+                ZSTD_freeCDict(cdict);
+            }
+        }
+
+        free(back);
+        free(dest);
+        free(src);
+    }
+
+    ZSTD_freeDDict(ddict);
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeCCtx(cctx);
+}
+
+/* io == NULL であれば、mruby の String ポートと同様に伸長するメモリ上のバッファへ書き出す */
+static size_t
+stream_encode(ZSTD_CCtx *cctx, const char *src, size_t size, size_t chunk,
+              char *dest, size_t destcap, FILE *io)
+{
+    size_t off, destlen = 0;
+    char outbuf[1 << 17];
+
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+    for (off = 0; off <= size; off += chunk) {
+        size_t n = size - off < chunk ? size - off : chunk;
+        ZSTD_inBuffer in = { src + off, n, 0 };
+        ZSTD_EndDirective end = (off + n >= size) ? ZSTD_e_end : ZSTD_e_continue;
+        size_t remain;
+
+        do {
+            ZSTD_outBuffer out = { outbuf, sizeof(outbuf), 0 };
+            remain = check("ZSTD_compressStream2", ZSTD_compressStream2(cctx, &out, &in, end));
+            if (io) {
+                fwrite(outbuf, 1, out.pos, io);
+            } else {
+                if (destlen + out.pos > destcap) { die("destination too small", 0); }
+                memcpy(dest + destlen, outbuf, out.pos);
+                destlen += out.pos;
+            }
+        } while (in.pos < in.size || (end == ZSTD_e_end && remain > 0));
+
+        if (end == ZSTD_e_end) { break; }
+    }
+
+    return destlen;
+}
+
+/* io == NULL であれば src から、それ以外は io から読み込んで chunk 単位で取り出す */
+static void
+stream_decode(ZSTD_DCtx *dctx, const char *src, size_t srcsize, FILE *io, char *chunkbuf, size_t chunk)
+{
+    char inbuf[1 << 17];
+    ZSTD_inBuffer in = { io ? inbuf : src, io ? 0 : srcsize, 0 };
+    size_t ret = 1;
+
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    for (;;) {
+        ZSTD_outBuffer out = { chunkbuf, chunk, 0 };
+
+        if (io && in.pos >= in.size) {
+            in.size = fread(inbuf, 1, sizeof(inbuf), io);
+            in.pos = 0;
+            if (in.size == 0) { break; }
+        }
+
+        ret = check("ZSTD_decompressStream", ZSTD_decompressStream(dctx, &out, &in));
+        if (ret == 0 && in.pos >= in.size && (!io || feof(io))) { break; }
+        if (!io && out.pos == 0 && in.pos >= in.size) { break; }
+    }
+}
+
+static void
+bench_stream(const struct conf *conf, const char *corpus, struct laps *laps)
+{
+    const int level = 3;
+    size_t size = conf->stream_size;
+    char *src = make_payload(corpus, size);
+    size_t destcap = ZSTD_compressBound(size);
+    char *dest = xmalloc(destcap);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    char path[4096];
+    int i, isio;
+
+    snprintf(path, sizeof(path), "%s/zstd-bench-driver.zst", conf->tmpdir);
+    check("ZSTD_CCtx_setParameter", ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level));
+
+    for (i = 0; i < conf->chunks.num; i ++) {
+        size_t chunk = conf->chunks.v[i];
+        char *chunkbuf = xmalloc(chunk);
+
+        for (isio = 0; isio < 2; isio ++) {
+            const char *port = isio ? "io" : "string";
+            size_t destsize;
+            FILE *io;
+
+            if (isio) {
+                MEASURE(laps, conf->mintime, {
+                    io = fopen(path, "wb");
+                    if (io == NULL) { die("fopen failed", 0); }
+                    stream_encode(cctx, src, size, chunk, NULL, 0, io);
+                    fclose(io);
+                });
+            } else {
+                MEASURE(laps, conf->mintime, stream_encode(cctx, src, size, chunk, dest, destcap, NULL));
+            }
+            report("stream", "encode", port, level, 0, chunk, -1, size, laps);
+
+            destsize = stream_encode(cctx, src, size, size > 0 ? size : 1, dest, destcap, NULL);
+            if (isio) {
+                io = fopen(path, "wb");
+                if (io == NULL) { die("fopen failed", 0); }
+                fwrite(dest, 1, destsize, io);
+                fclose(io);
+                MEASURE(laps, conf->mintime, {
+                    io = fopen(path, "rb");
+                    if (io == NULL) { die("fopen failed", 0); }
+                    stream_decode(dctx, NULL, 0, io, chunkbuf, chunk);
+                    fclose(io);
+                });
+            } else {
+                MEASURE(laps, conf->mintime, stream_decode(dctx, dest, destsize, NULL, chunkbuf, chunk));
+            }
+            report("stream", "decode", port, level, 0, chunk, -1, size, laps);
+        }
+
+        free(chunkbuf);
+    }
+
+    remove(path);
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeCCtx(cctx);
+    free(dest);
+    free(src);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct conf conf;
+    struct laps *laps = xmalloc(sizeof(struct laps));
+    char *corpus;
+    int i;
+
+    parse_list(&conf.sizes, "100,1k,64k,1m,16m", 1);
+    parse_list(&conf.levels, "1,3,9,19", 0);
+    parse_list(&conf.chunks, "64,4k,64k,1m", 1);
+    conf.stream_size = parse_size("16m");
+    conf.mintime = 0.5;
+    conf.tmpdir = "/tmp";
+
+    for (i = 1; i < argc; i ++) {
+        const char *a = argv[i];
+        const char *v = strchr(a, '=');
+        size_t klen;
+
+        while (*a == '-') { a ++; }
+        if (v == NULL) { die("wrong option", 0); }
+        klen = v ++ - a;
+        if (klen == 5 && strncmp(a, "sizes", 5) == 0) { parse_list(&conf.sizes, v, 1); }
+        else if (klen == 6 && strncmp(a, "levels", 6) == 0) { parse_list(&conf.levels, v, 0); }
+        else if (klen == 6 && strncmp(a, "chunks", 6) == 0) { parse_list(&conf.chunks, v, 1); }
+        else if (klen == 11 && strncmp(a, "stream_size", 11) == 0) { conf.stream_size = parse_size(v); }
+        else if (klen == 7 && strncmp(a, "mintime", 7) == 0) { conf.mintime = strtod(v, NULL); }
+        else if (klen == 6 && strncmp(a, "tmpdir", 6) == 0) { conf.tmpdir = v; }
+        else { die("unknown option", 0); }
+    }
+
+    corpus = make_corpus();
+    bench_oneshot(&conf, corpus, laps);
+    bench_stream(&conf, corpus, laps);
+
+    free(corpus);
+    free(laps);
+
+    return 0;
+}
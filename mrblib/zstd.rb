@@ -11,6 +11,7 @@ module Zstd
   # [output_stream (any object)]
   #   Output port for Zstd stream.
   #   Need +.<<+ method.
+  #   If it has +.fileno+ method (e.g. File), written to the file descriptor directly.
   #
   # [level (nil or 1..22)]
   #
@@ -18,20 +19,48 @@ module Zstd
   #
   #   level (integer OR nil):: compression level (range is 1..22)
   #
-  #   dict (string OR nil):: compression with dictionary
+  #   dict (string, Zstd::Dictionary OR nil):: compression with dictionary
   #
   #   windowlog, chainlog, hashlog, searchlog, minmatch, targetlength, strategy (integer OR nil)::
-  #     see https://github.com/facebook/zstd/blob/v1.3.8/lib/zstd.h#L403
+  #     see https://github.com/facebook/zstd/blob/v1.4.8/lib/zstd.h#L265
   #
-  #   nocontentsize, nochecksum, nodictid (true, false OR nil)::
-  #     see https://github.com/facebook/zstd/blob/v1.3.8/lib/zstd.h#L428
+  #   contentsize, checksum, nodictid (true, false OR nil)::
+  #     see https://github.com/facebook/zstd/blob/v1.4.8/lib/zstd.h#L343
   #
-  #   estimatedsize (integer OR nil)::
-  #     (streaming compression only) used as hint
+  #   workers, jobsize, overlaplog (integer OR nil)::
+  #     multithreaded compression (need ZSTD_MULTITHREAD for build_config.rb).
+  #     Ignored if Zstd::MULTITHREAD_SUPPORTED is false.
+  #
+  #   ldm (true, false OR nil), ldm_hashlog, ldm_minmatch, ldm_bucketsizelog, ldm_hashratelog (integer OR nil)::
+  #     long distance matching.
+  #     see https://github.com/facebook/zstd/blob/v1.4.8/lib/zstd.h#L309
+  #
+  #   target_cblock_size (integer OR nil)::
+  #     try to fit compressed blocks into this size (for low latency streaming).
+  #
+  #   srcsize_hint (integer OR nil)::
+  #     (streaming compression only) used as hint.
+  #     estimatedsize is the old name.
   #
   #   pledgedsize (integer OR nil)::
   #     (streaming compression only) used as source size
   #
+  #   frames, frame_size (integer OR nil)::
+  #     (one step compression only) split the input into independent frames
+  #     of frame_size bytes (or into the number of frames).
+  #     The frames are compressed on native threads (need ZSTD_MULTITHREAD).
+  #
+  #   threads (integer OR nil)::
+  #     (with frames or frame_size) number of threads.
+  #     Default is the number of online processors.
+  #
+  #   fd (integer, false OR nil)::
+  #     (streaming compression only) file descriptor for output by write(2).
+  #     If false, always use +output_stream << data+.
+  #
+  #   outbuf_size (integer OR nil), coalesce (true OR false), outbuf_mode (:reuse, :double OR :donate)::
+  #     (streaming compression only) output buffering. See Zstd::Encoder#initialize.
+  #
   def Zstd.encode(port, *args, &block)
     if port.is_a?(String)
       Zstd::Encoder.encode(port, *args)
@@ -55,7 +84,21 @@ module Zstd
   #
   # [opts (Hash)]
   #
-  #   dict (string OR nil):: decompression with dictionary
+  #   dict (string, Zstd::Dictionary OR nil):: decompression with dictionary
+  #
+  #   threads (integer OR nil)::
+  #     (one step decompression only) decompress the concatenated frames on native threads
+  #     (need ZSTD_MULTITHREAD). All frames must have the content size.
+  #
+  #   fd (integer, true OR nil)::
+  #     (streaming decompression only) file descriptor for input by read(2)
+  #     (regular files are mapped by mmap).
+  #     If true, use +input_stream.fileno+.
+  #     Data already buffered by +input_stream+ is not seen.
+  #
+  #   readsize, readahead (integer OR nil), read_thread (true OR false)::
+  #     (streaming decompression only) input chunking and read-ahead.
+  #     See Zstd::Decoder#initialize.
   #
   def Zstd.decode(port, *args, &block)
     if port.is_a?(String)
@@ -65,6 +108,16 @@ module Zstd
     end
   end
 
+  #
+  # call-seq:
+  #   train_dictionary(samples, opts = {}) -> instance of Zstd::Dictionary
+  #
+  # Same as Zstd::Dictionary.train.
+  #
+  def Zstd.train_dictionary(samples, *args)
+    Zstd::Dictionary.train(samples, *args)
+  end
+
   module StreamWrapper
     def wrap(*args)
       zstd = new(*args)
@@ -82,6 +135,7 @@ module Zstd
 
   Encoder.extend StreamWrapper
   Decoder.extend StreamWrapper
+  SeekableEncoder.extend StreamWrapper
 
   #
   # <em>REQUIRED mruby-gems: mruby-io</em>
@@ -93,13 +147,14 @@ module Zstd
   #   opts = { ... }
   #   Zstd.write(filename, data, opts) # => nil
   #
+  # See also Zstd.compress_file.
+  #
   def Zstd.write(file, data, *args)
     File.open(file, "wb") do |fd|
-      Zstd::Encoder.open(fo, *args) do |zstd|
-        buf = ""
-        zstd << buf while fd.read(16384, buf)
-      end
+      fd << Zstd.encode(data, *args)
     end
+
+    nil
   end
 
   #
@@ -110,11 +165,12 @@ module Zstd
   #   filename = "sample/data.zst"
   #   Zstd.read(filename) # => data as string
   #
-  def Zstd.read(file)
-    File.open(file, "rb") do |fo|
-      Zstd::Decoder.open(fo, *args) do |zstd|
-        zstd.read
-      end
+  # See also Zstd.decompress_file.
+  #
+  def Zstd.read(file, *args)
+    File.open(file, "rb") do |fd|
+      Zstd.copy_stream(fd, dest = "", :decode, *args)
+      dest
     end
   end
 
@@ -122,14 +178,6 @@ module Zstd
   end
 
   class Decoder
-    def getc
-      read(1)
-    end
-
-    def getbyte
-      ch = getc
-      ch ? ch.ord : nil
-    end
   end
 
   Compressor = Encoder
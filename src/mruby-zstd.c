@@ -1,5 +1,6 @@
 #include <mruby.h>
 #include <mruby/class.h>
+#include <mruby/array.h>
 #include <mruby/hash.h>
 #include <mruby/string.h>
 #include <mruby/value.h>
@@ -7,13 +8,36 @@
 #include <mruby/variable.h>
 #include <mruby/error.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef _WIN32
+#   include <io.h>
+#else
+#   include <unistd.h>
+#   include <poll.h>
+#   include <sys/stat.h>
+#   include <sys/mman.h>
+#endif
 #include <mruby-aux.h>
 #include <mruby-aux/scanhash.h>
 
 #define ZSTD_STATIC_LINKING_ONLY 1
 #include <zstd.h>
 #include <common/zstd_errors.h>
+#define ZDICT_STATIC_LINKING_ONLY 1
+#include <zdict.h>
+#define XXH_STATIC_LINKING_ONLY 1
+#include <common/xxhash.h>
+
+#if defined(ZSTD_MULTITHREAD) && !defined(_WIN32)
+#   include <pthread.h>
+#   define MRUBY_ZSTD_BATCH_THREADS 1
+#endif
 
 #ifndef MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE
 #   ifdef MRB_INT16
@@ -25,9 +49,38 @@
 #   endif
 #endif
 
+#ifndef MRUBY_ZSTD_CONTEXT_POOL_SIZE
+#   ifdef MRB_INT16
+#       define MRUBY_ZSTD_CONTEXT_POOL_SIZE     1
+#   else
+#       define MRUBY_ZSTD_CONTEXT_POOL_SIZE     4
+#   endif
+#endif
+
+#ifndef MRUBY_ZSTD_DICTIONARY_CACHE_SIZE
+#   define MRUBY_ZSTD_DICTIONARY_CACHE_SIZE 4
+#endif
+
+#ifndef MRUBY_ZSTD_BATCH_MAX_THREADS
+#   define MRUBY_ZSTD_BATCH_MAX_THREADS     64
+#endif
+
+#ifndef MRUBY_ZSTD_STATS
+#   define MRUBY_ZSTD_STATS 0
+#endif
+
+#ifndef MRUBY_ZSTD_ADAPT_INTERVAL
+                                                 /* 1 MiB */
+#   define MRUBY_ZSTD_ADAPT_INTERVAL        (1 << 20)
+#endif
+
 #define AUX_MALLOC_MAX (MRB_INT_MAX - 1)
 
 #define CLAMP_MAX(n, max) ((n) > (max) ? (max) : (n))
+#define CLAMP_MIN(n, min) ((n) < (min) ? (min) : (n))
+
+/* ZSTD_isError() が真となるエラーコードを作る */
+#define AUX_ZSTD_ERROR(name) ((size_t)-(int)ZSTD_error_ ## name)
 
 #define ID_op_lshift mrb_intern_lit(mrb, "<<")
 #define ID_read mrb_intern_lit(mrb, "read")
@@ -42,6 +95,10 @@
 #define id_btultra  (mrb_intern_lit(mrb, "btultra"))
 #define id_btultra2 (mrb_intern_lit(mrb, "btultra2"))
 
+#define id_fastcover (mrb_intern_lit(mrb, "fastcover"))
+#define id_cover     (mrb_intern_lit(mrb, "cover"))
+#define id_legacy    (mrb_intern_lit(mrb, "legacy"))
+
 static ZSTD_strategy
 aux_to_strategy(MRB, VALUE astrategy)
 {
@@ -98,813 +155,6851 @@ aux_check_error(MRB, size_t status, const char *mesg)
     aux_zstd_error(mrb, status, mesg);
 }
 
-static ZSTD_customMem
-aux_zstd_allocator(MRB)
+/*
+ * 倍々に拡張したバッファサイズを返す (ただし最低でも MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE だけ拡張する)。
+ * AUX_MALLOC_MAX に達している場合は例外を発生させる。
+ */
+static size_t
+aux_grow_size(MRB, size_t size, const char *mesg)
 {
-    const ZSTD_customMem a = {
-        .customAlloc = (void *(*)(void *, unsigned long))mrb_malloc_simple,
-        .customFree = (void (*)(void *, void *))mrb_free,
-        .opaque = mrb,
-    };
+    if (size >= AUX_MALLOC_MAX) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(dstSize_tooSmall), mesg);
+    }
 
-    return a;
-}
+    size_t incr = CLAMP_MIN(size, MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE);
 
+    if (incr > AUX_MALLOC_MAX - size) {
+        return AUX_MALLOC_MAX;
+    } else {
+        return size + incr;
+    }
+}
 
 /*
- * class Zstd::Encoder
+ * mrb_int に収まらない場合は浮動小数点数として返す。
  */
-
-static void
-encode_kwargs(MRB, VALUE opts, VALUE src, ZSTD_parameters *params, mrb_int *pledgedsize, VALUE *dict)
+static VALUE
+aux_size_value(MRB, unsigned long long size)
 {
-    if (NIL_P(opts)) {
-        if (NIL_P(src)) {
-            *pledgedsize = ZSTD_CONTENTSIZE_UNKNOWN;
-        } else {
-            *pledgedsize = RSTRING_LEN(src);
-        }
-
-        *params = ZSTD_getParams(0, *pledgedsize, 0);
-        *dict = Qnil;
-    } else {
-        uint64_t estimatedsize;
-        VALUE level, contentsize, checksum, nodictid, anestimatedsize, apledgedsize,
-              windowlog, chainlog, hashlog, searchlog, minmatch, targetlength, strategy;
-        struct mrbx_scanhash_arg args[] = {
-            MRBX_SCANHASH_ARGS("level",         &level,             Qnil),
-            MRBX_SCANHASH_ARGS("dict",          dict,               Qnil),
-            MRBX_SCANHASH_ARGS("windowlog",     &windowlog,         Qnil),
-            MRBX_SCANHASH_ARGS("chainlog",      &chainlog,          Qnil),
-            MRBX_SCANHASH_ARGS("hashlog",       &hashlog,           Qnil),
-            MRBX_SCANHASH_ARGS("searchlog",     &searchlog,         Qnil),
-            MRBX_SCANHASH_ARGS("minmatch",      &minmatch,          Qnil),
-            MRBX_SCANHASH_ARGS("targetlength",  &targetlength,      Qnil),
-            MRBX_SCANHASH_ARGS("strategy",      &strategy,          Qnil),
-            MRBX_SCANHASH_ARGS("contentsize",   &contentsize,       Qnil),
-            MRBX_SCANHASH_ARGS("checksum",      &checksum,          Qnil),
-            MRBX_SCANHASH_ARGS("nodictid",      &nodictid,          Qnil),
-            MRBX_SCANHASH_ARGS("estimatedsize", &anestimatedsize,   Qnil),
-            MRBX_SCANHASH_ARGS("pledgedsize",   &apledgedsize,      Qnil),
-        };
-
-        if (NIL_P(src)) {
-            mrbx_scanhash(mrb, opts, Qnil, ELEMENTOF(args), args);
-            *pledgedsize = (NIL_P(apledgedsize) ? ZSTD_CONTENTSIZE_UNKNOWN : mrb_int(mrb, apledgedsize));
-            estimatedsize = (NIL_P(anestimatedsize) ? ZSTD_CONTENTSIZE_UNKNOWN : mrb_int(mrb, anestimatedsize));
-            if (*pledgedsize != ZSTD_CONTENTSIZE_UNKNOWN && estimatedsize > *pledgedsize) {
-                estimatedsize = *pledgedsize;
-            }
-        } else {
-            /* NOTE: ELEMENTOF(args) - 2 によって estimatedsize と pledgedsize をないものと扱う */
-            mrbx_scanhash(mrb, opts, Qnil, ELEMENTOF(args) - 2, args);
-
-            *pledgedsize = estimatedsize = RSTRING_LEN(src);
-        }
+    if (size <= (unsigned long long)MRB_INT_MAX) {
+        return mrb_fixnum_value((mrb_int)size);
+    }
 
-        if (!NIL_P(*dict)) { mrb_check_type(mrb, *dict, MRB_TT_STRING); }
+#ifdef MRB_WITHOUT_FLOAT
+    return mrb_fixnum_value(MRB_INT_MAX);
+#else
+    return mrb_float_value(mrb, (mrb_float)size);
+#endif
+}
 
-        *params = ZSTD_getParams(
-                (NIL_P(level) ? 0 : mrb_int(mrb, level)),
-                estimatedsize,
-                (NIL_P(*dict) ? 0 : RSTRING_LEN(*dict)));
+/*
+ * 文字列の末尾に少なくとも want バイトの空きを確保する (倍々に拡張する)。
+ * 書き込む前に呼ぶこと (mrb_str_modify() も行う)。
+ * 拡張した場合は真を返す。
+ */
+static mrb_bool
+aux_str_reserve_tail(MRB, struct RString *str, size_t want, const char *mesg)
+{
+    mrb_str_modify(mrb, str);
+    size_t len = RSTR_LEN(str);
 
-        if (!NIL_P(windowlog)) { params->cParams.windowLog = mrb_int(mrb, windowlog); }
-        if (!NIL_P(chainlog)) { params->cParams.chainLog = mrb_int(mrb, chainlog); }
-        if (!NIL_P(hashlog)) { params->cParams.hashLog = mrb_int(mrb, hashlog); }
-        if (!NIL_P(searchlog)) { params->cParams.searchLog = mrb_int(mrb, searchlog); }
-        if (!NIL_P(minmatch)) { params->cParams.minMatch = mrb_int(mrb, minmatch); }
-        if (!NIL_P(targetlength)) { params->cParams.targetLength = mrb_int(mrb, targetlength); }
-        if (!NIL_P(strategy)) { params->cParams.strategy = aux_to_strategy(mrb, strategy); }
+    if ((size_t)RSTR_CAPA(str) - len < want) {
+        size_t capa = aux_grow_size(mrb, RSTR_CAPA(str), mesg);
+        capa = CLAMP_MIN(capa, len + want);
+        capa = CLAMP_MAX(capa, AUX_MALLOC_MAX);
+        mrbx_str_reserve(mrb, str, capa);
 
-        if (!NIL_P(contentsize)) { params->fParams.contentSizeFlag = (mrb_bool(contentsize) ? 1 : 0); }
-        if (!NIL_P(checksum)) { params->fParams.checksumFlag = (mrb_bool(checksum) ? 1 : 0); }
-        if (!NIL_P(nodictid)) { params->fParams.noDictIDFlag = (mrb_bool(nodictid) ? 1 : 0); }
+        return TRUE;
     }
+
+    return FALSE;
 }
 
+/*
+ * 文字列の長さを len にして、終端文字を置く。
+ */
 static void
-enc_s_encode_args(MRB, VALUE *src, VALUE *dest, mrb_int *maxdest, ZSTD_parameters *params, mrb_int *pledgedsize, VALUE *dict)
+aux_str_set_len(struct RString *str, size_t len)
 {
-    VALUE *argv;
-    mrb_int argc;
-    mrb_get_args(mrb, "*", &argv, &argc);
-    VALUE opts;
+    RSTR_SET_LEN(str, len);
+    RSTR_PTR(str)[len] = '\0';
+}
 
-    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-        opts = argv[argc - 1];
-        argc --;
-    } else {
-        opts = Qnil;
-    }
+/*
+ * write(2) で全て書き出す。部分的な書き込みと EINTR の場合は続きを書き込み、
+ * ノンブロッキングな記述子で EAGAIN となった場合は書き込めるようになるまで待つ。
+ */
+static void
+aux_fd_write(MRB, int fd, const char *buf, size_t size)
+{
+    while (size > 0) {
+#ifdef _WIN32
+        int n = _write(fd, buf, (unsigned int)CLAMP_MAX(size, INT_MAX));
+#else
+        ssize_t n = write(fd, buf, CLAMP_MAX(size, SSIZE_MAX));
+#endif
 
-    switch (argc) {
-    case 1:
-        *src = argv[0];
-        *maxdest = -1;
-        *dest = Qnil;
-        break;
-    case 2:
-        *src = argv[0];
-        if (mrb_string_p(argv[1])) {
-            *maxdest = -1;
-            *dest = argv[1];
-        } else {
-            *maxdest = (NIL_P(argv[1]) ? -1 : mrb_int(mrb, argv[1]));
-            *dest = Qnil;
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+#ifndef _WIN32
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+#endif
+            mrb_sys_fail(mrb, "write");
         }
-        break;
-    case 3:
-        *src = argv[0];
-        *maxdest = (NIL_P(argv[1]) ? -1 : mrb_int(mrb, argv[1]));
-        *dest = argv[2];
-        break;
-    default:
-        mrb_raisef(mrb,
-                   E_ARGUMENT_ERROR,
-                   "wrong number of arguments (given %S, expect 1..3 with optional keywords)",
-                   mrb_fixnum_value(argc));
-        break;
-    }
-
-    mrb_check_type(mrb, *src, MRB_TT_STRING);
-
-    if (*maxdest < 0) {
-        *maxdest = ZSTD_compressBound(RSTRING_LEN(*src));
-    }
 
-    if (NIL_P(*dest)) {
-        *dest = mrb_str_buf_new(mrb, *maxdest);
-    } else {
-        mrb_check_type(mrb, *dest, MRB_TT_STRING);
-        mrb_str_resize(mrb, *dest, *maxdest);
+        buf += n;
+        size -= n;
     }
+}
 
-    RSTR_SET_LEN(RSTRING(*dest), 0);
+/*
+ * read(2) で最大 size バイトを読み込み、読み込んだバイト数を返す (0 は終端)。
+ * EINTR の場合は読み直し、ノンブロッキングな記述子で EAGAIN となった場合は読めるようになるまで待つ。
+ */
+static size_t
+aux_fd_read(MRB, int fd, char *buf, size_t size)
+{
+    for (;;) {
+#ifdef _WIN32
+        int n = _read(fd, buf, (unsigned int)CLAMP_MAX(size, INT_MAX));
+#else
+        ssize_t n = read(fd, buf, CLAMP_MAX(size, SSIZE_MAX));
+#endif
 
-    encode_kwargs(mrb, opts, *src, params, pledgedsize, dict);
+        if (n >= 0) { return (size_t)n; }
+        if (errno == EINTR) { continue; }
+#ifndef _WIN32
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+#endif
+        mrb_sys_fail(mrb, "read");
+    }
 }
 
-static VALUE
-enc_s_encode_main_body(MRB, VALUE args)
+#ifndef _WIN32
+/*
+ * 通常ファイルであれば現在位置から終端までを読み込み専用で mmap する。
+ * 通常ファイルでないか mmap できない場合は偽を返す。
+ *
+ * *map は munmap() に渡す領域で、データは *map + *head から始まる。
+ * 空の場合は *map を NULL とする。
+ */
+static mrb_bool
+aux_fd_map(int fd, void **map, size_t *mapsize, size_t *head)
 {
-    struct args
-    {
-        ZSTD_CStream *zstd;
-        VALUE src, dest;
-        mrb_int maxdest;
-        ZSTD_parameters *params;
-        mrb_int pledgedsize;
-        VALUE dict;
-    } *p = (struct args *)mrb_cptr(args);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return FALSE; }
 
-    size_t s = ZSTD_initCStream_advanced(p->zstd,
-            (NIL_P(p->dict) ? NULL : RSTRING_PTR(p->dict)),
-            (NIL_P(p->dict) ? 0 : RSTRING_LEN(p->dict)),
-            *p->params, p->pledgedsize);
-    aux_check_error(mrb, s, "ZSTD_initCStream_advanced");
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (off < 0) { return FALSE; }
 
-    ZSTD_inBuffer input = {
-        .src = RSTRING_PTR(p->src),
-        .size = RSTRING_LEN(p->src),
-        .pos = 0,
-    };
-    ZSTD_outBuffer output = {
-        .dst = RSTRING_PTR(p->dest),
-        .size = (p->maxdest < 0 ? RSTRING_CAPA(p->dest) : p->maxdest),
-        .pos = 0,
-    };
+    if (st.st_size <= off) {
+        *map = NULL;
+        *mapsize = *head = 0;
+        return TRUE;
+    }
 
-    for (;;) {
-        size_t s = ZSTD_compressStream(p->zstd, &output, &input);
-        if (input.pos >= input.size) { break; }
-        aux_check_error(mrb, s, "ZSTD_compressStream");
-        if (p->maxdest >= 0) {
-            aux_zstd_error(mrb,
-                    ZSTD_error_dstSize_tooSmall,
-                    "ZSTD_compressStream");
-        }
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t pad = (pagesize > 0 ? off % pagesize : 0);
 
-        /* expand dest */
-        s = RSTRING_CAPA(p->dest);
-        if (s >= AUX_MALLOC_MAX) {
-            aux_zstd_error(mrb,
-                    ZSTD_error_dstSize_tooSmall,
-                    "ZSTD_compressStream");
-        }
-        s += MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE;
-        s = CLAMP_MAX(s, AUX_MALLOC_MAX);
-        mrb_str_resize(mrb, p->dest, s);
-        output.dst = RSTRING_PTR(p->dest);
-        output.size = RSTRING_CAPA(p->dest);
-    }
+    if ((unsigned long long)(st.st_size - off + pad) > SIZE_MAX) { return FALSE; }
 
-    for (;;) {
-        size_t s = ZSTD_endStream(p->zstd, &output); /* 's' is Status */
-        if (s == 0) { break; }
-        aux_check_error(mrb, s, "ZSTD_endStream");
-        if (p->maxdest >= 0) {
-            aux_zstd_error(mrb,
-                    ZSTD_error_dstSize_tooSmall,
-                    "ZSTD_endStream");
-        }
+    size_t size = (size_t)(st.st_size - off + pad);
+    void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, off - pad);
+    if (ptr == MAP_FAILED) { return FALSE; }
 
-        /* expand dest */
-        s = RSTRING_CAPA(p->dest); /* 's' is Size */
-        if (s >= AUX_MALLOC_MAX) {
-            aux_zstd_error(mrb,
-                    ZSTD_error_dstSize_tooSmall,
-                    "ZSTD_endStream");
-        }
-        s += MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE;
-        s = CLAMP_MAX(s, AUX_MALLOC_MAX);
-        mrb_str_resize(mrb, p->dest, s);
-        output.dst = RSTRING_PTR(p->dest);
-        output.size = RSTRING_CAPA(p->dest);
-    }
+#ifdef POSIX_MADV_SEQUENTIAL
+    posix_madvise(ptr, size, POSIX_MADV_SEQUENTIAL);
+#endif
 
-    RSTR_SET_LEN(RSTRING(p->dest), output.pos);
+    *map = ptr;
+    *mapsize = size;
+    *head = (size_t)pad;
 
-    return Qnil;
+    return TRUE;
 }
+#endif
 
-static VALUE
-enc_s_encode_cleanup(MRB, VALUE args)
+/*
+ * fd: の指定、または port の fileno から入出力先のファイル記述子を求める。
+ * 直接書き込まない場合は -1 を返す。
+ *
+ * fd: に false を与えた場合は fileno を調べない。
+ */
+static int
+aux_port_fd(MRB, VALUE port, VALUE fd)
 {
-    struct args
-    {
-        ZSTD_CStream *zstd;
-        VALUE src, dest;
-        mrb_int maxdest;
-        ZSTD_parameters *params;
-        mrb_int pledgedsize;
-        VALUE dict;
-    } *p = (struct args *)mrb_cptr(args);
+    if (mrb_fixnum_p(fd)) {
+        if (mrb_fixnum(fd) < 0 || mrb_fixnum(fd) > INT_MAX) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong file descriptor (given %S)", fd);
+        }
+        return (int)mrb_fixnum(fd);
+    }
 
-    ZSTD_freeCStream(p->zstd);
+    if (!NIL_P(fd) && !mrb_bool(fd)) { return -1; }
+    if (NIL_P(port) || !mrb_respond_to(mrb, port, mrb_intern_lit(mrb, "fileno"))) { return -1; }
 
-    return Qnil;
+    fd = FUNCALL(mrb, port, mrb_intern_lit(mrb, "fileno"));
+    if (!mrb_fixnum_p(fd) || mrb_fixnum(fd) < 0 || mrb_fixnum(fd) > INT_MAX) { return -1; }
+
+    return (int)mrb_fixnum(fd);
 }
 
-static void
-enc_s_encode_main(MRB, VALUE src, VALUE dest, mrb_int maxdest, ZSTD_parameters *params, mrb_int pledgedsize, VALUE dict)
+/*
+ * ZSTD_CCtx_setParameter() に与える値。
+ * 0 は既定値を意味する (ただし contentsize, checksum, nodictid は -1 が既定値)。
+ */
+struct encode_params
 {
-    ZSTD_customMem allocator = aux_zstd_allocator(mrb);
-    ZSTD_CStream *zstd = ZSTD_createCStream_advanced(allocator);
-    if (!zstd) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_initCStream_advanced failed"); }
+    int level;
+    int windowlog;
+    int chainlog;
+    int hashlog;
+    int searchlog;
+    int minmatch;
+    int targetlength;
+    int strategy;
+    int contentsize;
+    int checksum;
+    int nodictid;
+    int workers;
+    int jobsize;
+    int overlaplog;
+    int ldm;
+    int ldm_hashlog;
+    int ldm_minmatch;
+    int ldm_bucketsizelog;
+    int ldm_hashratelog;
+    int targetcblocksize;
+    int srcsizehint;
+};
 
-    struct args
-    {
-        ZSTD_CStream *zstd;
-        VALUE src, dest;
-        mrb_int maxdest;
-        ZSTD_parameters *params;
-        mrb_int pledgedsize;
-        VALUE dict;
-    } p = { zstd, src, dest, maxdest, params, pledgedsize, dict };
+/*
+ * instrumentation counters
+ *
+ * MRUBY_ZSTD_STATS が 0 でなければ、Zstd::Encoder / Zstd::Decoder ごとの値と、
+ * mrb_state ごとの全体の値 (Zstd モジュールに隠しインスタンス変数として持たせる) を数える。
+ * 全体の値は libzstd のワーカースレッドからも加算されるため、不可分操作で読み書きする。
+ */
 
-    VALUE argsp = mrb_cptr_value(mrb, &p);
-    mrb_ensure(mrb, enc_s_encode_main_body, argsp, enc_s_encode_cleanup, argsp);
-}
+struct stats
+{
+    mrb_state *mrb;         /* stats_alloc のため */
+    struct stats *global;   /* 同時に加算する全体の値 (全体の値そのものであれば NULL) */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t zstd_calls;    /* ZSTD_compressStream2 / ZSTD_decompressStream */
+    uint64_t zstd_nsec;     /* ZSTD_compressStream2 / ZSTD_decompressStream の中で経過した時間 */
+    uint64_t port_calls;    /* outport << / inport.read */
+    uint64_t reallocs;      /* 出力先や内部バッファを拡張した回数 */
+    uint64_t alloc_bytes_total; /* zstd のコンテキストが確保した量の累計 (解放した量は差し引かない) */
+};
 
+#if MRUBY_ZSTD_STATS
 /*
- * call-seq:
- *  encode(source, buffer = "", opts = {}) -> buffer for zstd'd string
- *  encode(source, maxsize, buffer = "", opts = {}) -> buffer for zstd'd string
- *
- * [source (string)]
- *  Input data.
- *
- * [buffer (string OR nil)]
- *  Output buffer. Must give a string object.
- *
- * [maxsize (positive integer OR nil)]
- *  Maximum output buffer size.
- *
- *  Raise exception, if encoded data is over this size.
- *
- * [opts (hash)]
- *  level:: zstd compression level (1 .. 22)
+ * 全体の値を保持する構造体。
+ * mrb_close() ではオブジェクトの解放順序が決まっていないため、
+ * このアロケータで確保した領域が残っている間は、オブジェクトが解放されても構造体を残しておく。
  */
-static VALUE
-enc_s_encode(MRB, VALUE self)
+struct stats_root
 {
-    ZSTD_parameters params;
-    mrb_int pledgedsize;
-    VALUE src, dest, dict;
-    mrb_int maxdest;
-    enc_s_encode_args(mrb, &src, &dest, &maxdest, &params, &pledgedsize, &dict);
+    struct stats stats;
+    size_t nlive;           /* 確保したまま解放されていない領域の数 */
+    mrb_bool detached;      /* オブジェクトが解放された */
+};
 
-    enc_s_encode_main(mrb, src, dest, maxdest, &params, pledgedsize, dict);
+#   if defined(__GNUC__) || defined(__clang__)
+#       define STATS_ATOMIC_ADD(var, n) ((void)__atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED))
+#       define STATS_ATOMIC_SUB_FETCH(var, n) __atomic_sub_fetch(&(var), (n), __ATOMIC_ACQ_REL)
+#       define STATS_ATOMIC_LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#       define STATS_ATOMIC_STORE(var, n) __atomic_store_n(&(var), (n), __ATOMIC_RELAXED)
+#   else
+#       define STATS_ATOMIC_ADD(var, n) ((void)((var) += (n)))
+#       define STATS_ATOMIC_SUB_FETCH(var, n) ((var) -= (n))
+#       define STATS_ATOMIC_LOAD(var) (var)
+#       define STATS_ATOMIC_STORE(var, n) ((void)((var) = (n)))
+#   endif
 
-    return dest;
-}
+#   define STATS_ADD(st, field, n)                                         \
+        do {                                                            \
+            struct stats *stats_add_st_ = (st);                         \
+            if (stats_add_st_->global) {                                \
+                stats_add_st_->field += (n);                            \
+                STATS_ATOMIC_ADD(stats_add_st_->global->field, (n));    \
+            } else {                                                    \
+                STATS_ATOMIC_ADD(stats_add_st_->field, (n));            \
+            }                                                           \
+        } while (0)
 
-struct encoder
+static void
+stats_root_free(MRB, struct stats_root *p)
 {
-    struct {
-        ZSTD_CStream *context;
-        ZSTD_customMem allocator;
-        ZSTD_inBuffer bufin;
-    } zstd;
+    p->detached = TRUE;
+    if (STATS_ATOMIC_LOAD(p->nlive) == 0) { mrb_free(mrb, p); }
+}
 
-    VALUE io;
-    VALUE outbuf;
-    size_t outbufsize;
+static const mrb_data_type stats_root_type = {
+    .struct_name = "mruby_zstd.stats",
+    .dfree = (void (*)(mrb_state *, void *))stats_root_free,
 };
 
-static void
-encoder_free(MRB, struct encoder *p)
+static struct stats *
+get_stats_global(MRB)
 {
-    if (p->zstd.context) {
-        ZSTD_freeCStream(p->zstd.context);
+    VALUE mod = mrb_obj_value(mrb_module_get(mrb, "Zstd"));
+    VALUE root = mrb_iv_get(mrb, mod, mrb_intern_lit(mrb, "mruby-zstd.stats"));
+    struct stats_root *p;
+    Data_Get_Struct(mrb, root, &stats_root_type, p);
+    return &p->stats;
+}
+
+static void *
+stats_alloc(void *opaque, size_t size)
+{
+    struct stats *st = (struct stats *)opaque;
+    STATS_ADD(st, alloc_bytes_total, size);
+    return mrb_malloc_simple(st->mrb, size);
+}
+
+static void
+stats_free(void *opaque, void *ptr)
+{
+    mrb_free(((struct stats *)opaque)->mrb, ptr);
+}
+
+static void *
+stats_root_alloc(void *opaque, size_t size)
+{
+    struct stats_root *p = (struct stats_root *)opaque;
+    void *ptr = mrb_malloc_simple(p->stats.mrb, size);
+    if (ptr) {
+        STATS_ATOMIC_ADD(p->nlive, 1);
+        STATS_ATOMIC_ADD(p->stats.alloc_bytes_total, size);
+    }
+    return ptr;
+}
+
+static void
+stats_root_dealloc(void *opaque, void *ptr)
+{
+    struct stats_root *p = (struct stats_root *)opaque;
+    mrb_state *mrb = p->stats.mrb;
+    mrb_free(mrb, ptr);
+    if (STATS_ATOMIC_SUB_FETCH(p->nlive, 1) == 0 && p->detached) { mrb_free(mrb, p); }
+}
+
+static VALUE
+stats_to_hash(MRB, const struct stats *st)
+{
+    VALUE hash = mrb_hash_new_capa(mrb, 7);
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "bytes_in")), aux_size_value(mrb, st->bytes_in));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "bytes_out")), aux_size_value(mrb, st->bytes_out));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "zstd_calls")), aux_size_value(mrb, st->zstd_calls));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "zstd_nsec")), aux_size_value(mrb, st->zstd_nsec));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "port_calls")), aux_size_value(mrb, st->port_calls));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "reallocs")), aux_size_value(mrb, st->reallocs));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "alloc_bytes_total")), aux_size_value(mrb, st->alloc_bytes_total));
+
+    return hash;
+}
+#else
+#   define STATS_ADD(st, field, n) ((void)0)
+#   define get_stats_global(mrb) ((struct stats *)NULL)
+#endif /* MRUBY_ZSTD_STATS */
+
+/* 単調増加時計 (ナノ秒) */
+static uint64_t
+aux_clock_nsec(void)
+{
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+stats_clock(void)
+{
+#if MRUBY_ZSTD_STATS
+    return aux_clock_nsec();
+#else
+    return 0;
+#endif
+}
+
+static ZSTD_customMem
+aux_zstd_allocator(MRB)
+{
+#if MRUBY_ZSTD_STATS
+    const ZSTD_customMem a = {
+        .customAlloc = stats_root_alloc,
+        .customFree = stats_root_dealloc,
+        .opaque = get_stats_global(mrb), /* struct stats_root の先頭 */
+    };
+#else
+    const ZSTD_customMem a = {
+        .customAlloc = (void *(*)(void *, unsigned long))mrb_malloc_simple,
+        .customFree = (void (*)(void *, void *))mrb_free,
+        .opaque = mrb,
+    };
+#endif
+
+    return a;
+}
+
+/*
+ * st に確保した量を数えるアロケータ。
+ */
+static ZSTD_customMem
+aux_stats_allocator(MRB, struct stats *st)
+{
+#if MRUBY_ZSTD_STATS
+    st->mrb = mrb;
+    st->global = get_stats_global(mrb);
+    const ZSTD_customMem a = {
+        .customAlloc = stats_alloc,
+        .customFree = stats_free,
+        .opaque = st,
+    };
+
+    return a;
+#else
+    return aux_zstd_allocator(mrb);
+#endif
+}
+
+/*
+ * libzstd の呼び出し 1 回分を数える (start は stats_clock() で得た開始時刻)。
+ * st が全体の値 (get_stats_global()) の場合は、それだけを数える。
+ */
+static void
+stats_count(struct stats *st, uint64_t start, size_t insize, size_t outsize)
+{
+#if MRUBY_ZSTD_STATS
+    uint64_t t = stats_clock() - start;
+
+    STATS_ADD(st, zstd_calls, 1);
+    STATS_ADD(st, zstd_nsec, t);
+    STATS_ADD(st, bytes_in, insize);
+    STATS_ADD(st, bytes_out, outsize);
+#else
+    (void)st;
+    (void)start;
+    (void)insize;
+    (void)outsize;
+#endif
+}
+
+static size_t
+aux_compress_stream(struct stats *st, ZSTD_CCtx *cctx, ZSTD_outBuffer *output, ZSTD_inBuffer *input, ZSTD_EndDirective end)
+{
+    size_t inpos = input->pos, outpos = output->pos;
+    uint64_t start = stats_clock();
+    size_t s = ZSTD_compressStream2(cctx, output, input, end);
+    stats_count(st, start, input->pos - inpos, output->pos - outpos);
+
+    return s;
+}
+
+static size_t
+aux_decompress_stream(struct stats *st, ZSTD_DCtx *dctx, ZSTD_outBuffer *output, ZSTD_inBuffer *input)
+{
+    size_t inpos = input->pos, outpos = output->pos;
+    uint64_t start = stats_clock();
+    size_t s = ZSTD_decompressStream(dctx, output, input);
+    stats_count(st, start, input->pos - inpos, output->pos - outpos);
+
+    return s;
+}
+
+
+/*
+ * context pool (mrb_state ごと)
+ *
+ * 一括処理の Zstd.encode / Zstd.decode は、呼び出しごとにコンテキストを確保しないようにここから借りる。
+ */
+
+struct context_pool
+{
+    size_t limit;
+    size_t ncctx;
+    size_t ndctx;
+    ZSTD_CCtx **cctx;
+    ZSTD_DCtx **dctx;
+};
+
+static void
+context_pool_trim(struct context_pool *p, size_t keep)
+{
+    while (p->ncctx > keep) {
+        p->ncctx --;
+        ZSTD_freeCCtx(p->cctx[p->ncctx]);
+        p->cctx[p->ncctx] = NULL;
+    }
+
+    while (p->ndctx > keep) {
+        p->ndctx --;
+        ZSTD_freeDCtx(p->dctx[p->ndctx]);
+        p->dctx[p->ndctx] = NULL;
+    }
+}
+
+static void
+context_pool_free(MRB, struct context_pool *p)
+{
+    context_pool_trim(p, 0);
+    mrb_free(mrb, p->cctx);
+    mrb_free(mrb, p->dctx);
+    mrb_free(mrb, p);
+}
+
+static const mrb_data_type context_pool_type = {
+    .struct_name = "mruby_zstd.context_pool",
+    .dfree = (void (*)(mrb_state *, void *))context_pool_free,
+};
+
+static void
+context_pool_set_limit(MRB, struct context_pool *p, size_t limit)
+{
+    context_pool_trim(p, limit);
+
+    if (limit > 0) {
+        p->cctx = (ZSTD_CCtx **)mrb_realloc(mrb, p->cctx, sizeof(p->cctx[0]) * limit);
+        p->dctx = (ZSTD_DCtx **)mrb_realloc(mrb, p->dctx, sizeof(p->dctx[0]) * limit);
+    }
+
+    p->limit = limit;
+}
+
+static struct context_pool *
+get_context_pool(MRB)
+{
+    VALUE mod = mrb_obj_value(mrb_module_get(mrb, "Zstd"));
+    VALUE pool = mrb_iv_get(mrb, mod, mrb_intern_lit(mrb, "mruby-zstd.context-pool"));
+    struct context_pool *p;
+    Data_Get_Struct(mrb, pool, &context_pool_type, p);
+    return p;
+}
+
+static ZSTD_CCtx *
+context_pool_acquire_cctx(MRB)
+{
+    struct context_pool *p = get_context_pool(mrb);
+
+    if (p->ncctx > 0) {
+        p->ncctx --;
+        ZSTD_CCtx *cctx = p->cctx[p->ncctx];
+        p->cctx[p->ncctx] = NULL;
+        return cctx;
+    }
+
+    ZSTD_CCtx *cctx = ZSTD_createCCtx_advanced(aux_zstd_allocator(mrb));
+    if (!cctx) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createCCtx_advanced failed"); }
+
+    return cctx;
+}
+
+static void
+context_pool_release_cctx(MRB, ZSTD_CCtx *cctx)
+{
+    struct context_pool *p = get_context_pool(mrb);
+
+    if (p->ncctx < p->limit) {
+        ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+        p->cctx[p->ncctx ++] = cctx;
+    } else {
+        ZSTD_freeCCtx(cctx);
+    }
+}
+
+static ZSTD_DCtx *
+context_pool_acquire_dctx(MRB)
+{
+    struct context_pool *p = get_context_pool(mrb);
+
+    if (p->ndctx > 0) {
+        p->ndctx --;
+        ZSTD_DCtx *dctx = p->dctx[p->ndctx];
+        p->dctx[p->ndctx] = NULL;
+        return dctx;
+    }
+
+    ZSTD_DCtx *dctx = ZSTD_createDCtx_advanced(aux_zstd_allocator(mrb));
+    if (!dctx) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createDCtx_advanced failed"); }
+
+    return dctx;
+}
+
+static void
+context_pool_release_dctx(MRB, ZSTD_DCtx *dctx)
+{
+    struct context_pool *p = get_context_pool(mrb);
+
+    if (p->ndctx < p->limit) {
+        ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+        p->dctx[p->ndctx ++] = dctx;
+    } else {
+        ZSTD_freeDCtx(dctx);
+    }
+}
+
+static void
+init_context_pool(MRB, struct RClass *mZstd)
+{
+    struct context_pool *p;
+    struct RData *rd;
+    Data_Make_Struct(mrb, mrb_cObject, struct context_pool, &context_pool_type, p, rd);
+    context_pool_set_limit(mrb, p, MRUBY_ZSTD_CONTEXT_POOL_SIZE);
+    mrb_iv_set(mrb, mrb_obj_value(mZstd), mrb_intern_lit(mrb, "mruby-zstd.context-pool"), mrb_obj_value(rd));
+}
+
+
+/*
+ * class Zstd::Dictionary
+ *
+ * 解析済みの ZSTD_CDict (圧縮パラメータごと) と ZSTD_DDict を保持する。
+ * 辞書の内容は凍結した文字列を参照する (ZSTD_dlm_byRef)。
+ */
+
+/*
+ * 圧縮パラメータごとの ZSTD_CDict。
+ * ZSTD_CCtx_refCDict したコンテキストが使い続けている間は、
+ * キャッシュから追い出されても (Zstd::Dictionary が解放されても) 解放しない。
+ */
+struct dictionary_cdict
+{
+    ZSTD_compressionParameters cparams;
+    ZSTD_CDict *cdict;
+    int refs;   /* キャッシュと、ZSTD_CCtx_refCDict したコンテキストからの参照の数 */
+};
+
+static void
+dictionary_cdict_release(MRB, struct dictionary_cdict *e)
+{
+    if (e && -- e->refs == 0) {
+        ZSTD_freeCDict(e->cdict);
+        mrb_free(mrb, e);
+    }
+}
+
+/*
+ * *ref が参照していた ZSTD_CDict を手放し、e に差し替える。
+ */
+static void
+dictionary_cdict_replace(MRB, struct dictionary_cdict **ref, struct dictionary_cdict *e)
+{
+    struct dictionary_cdict *old = *ref;
+    *ref = e;
+    dictionary_cdict_release(mrb, old);
+}
+
+struct dictionary
+{
+    VALUE source;
+    ZSTD_DDict *ddict;
+
+    /* 最近に使った順 (cdicts[0] が最新) に MRUBY_ZSTD_DICTIONARY_CACHE_SIZE 個まで保持する */
+    int ncdicts;
+    struct dictionary_cdict *cdicts[MRUBY_ZSTD_DICTIONARY_CACHE_SIZE];
+};
+
+static void
+dictionary_free(MRB, struct dictionary *p)
+{
+    for (int i = 0; i < p->ncdicts; i ++) {
+        dictionary_cdict_release(mrb, p->cdicts[i]);
+    }
+
+    if (p->ddict) {
+        ZSTD_freeDDict(p->ddict);
+    }
+
+    mrb_free(mrb, p);
+}
+
+static const mrb_data_type dictionary_type = {
+    .struct_name = "mruby_zstd.dictionary",
+    .dfree = (void (*)(mrb_state *, void *))dictionary_free,
+};
+
+static struct dictionary *
+getdictionary(MRB, VALUE self)
+{
+    struct dictionary *p;
+    Data_Get_Struct(mrb, self, &dictionary_type, p);
+    if (NIL_P(p->source)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized dictionary");
+    }
+    return p;
+}
+
+static struct dictionary *
+aux_dictionary_ptr(MRB, VALUE obj)
+{
+    if (mrb_type(obj) != MRB_TT_DATA) { return NULL; }
+    return (struct dictionary *)mrb_data_check_get_ptr(mrb, obj, &dictionary_type);
+}
+
+static int
+aux_cparams_equal(const ZSTD_compressionParameters *a, const ZSTD_compressionParameters *b)
+{
+    return a->windowLog == b->windowLog &&
+           a->chainLog == b->chainLog &&
+           a->hashLog == b->hashLog &&
+           a->searchLog == b->searchLog &&
+           a->minMatch == b->minMatch &&
+           a->targetLength == b->targetLength &&
+           a->strategy == b->strategy;
+}
+
+/*
+ * cparams に対応する ZSTD_CDict を返す。
+ * 戻り値の参照は呼び出し元のものとなるため、使い終わったら dictionary_cdict_release() すること。
+ */
+static struct dictionary_cdict *
+dictionary_acquire_cdict(MRB, struct dictionary *p, const ZSTD_compressionParameters *cparams)
+{
+    struct dictionary_cdict *e = NULL;
+    int i;
+
+    for (i = 0; i < p->ncdicts; i ++) {
+        if (aux_cparams_equal(&p->cdicts[i]->cparams, cparams)) {
+            e = p->cdicts[i];
+            break;
+        }
+    }
+
+    if (!e) {
+        e = (struct dictionary_cdict *)mrb_malloc(mrb, sizeof(*e));
+        e->cdict = ZSTD_createCDict_advanced(
+                RSTRING_PTR(p->source), RSTRING_LEN(p->source),
+                ZSTD_dlm_byRef, ZSTD_dct_auto, *cparams, aux_zstd_allocator(mrb));
+        if (!e->cdict) {
+            mrb_free(mrb, e);
+            mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createCDict_advanced failed");
+        }
+        e->cparams = *cparams;
+        e->refs = 1;
+
+        /* 最も古いものをキャッシュから追い出す */
+        if (p->ncdicts >= MRUBY_ZSTD_DICTIONARY_CACHE_SIZE) {
+            p->ncdicts --;
+            dictionary_cdict_release(mrb, p->cdicts[p->ncdicts]);
+        }
+        i = p->ncdicts ++;
+    }
+
+    /* 先頭へ移す */
+    memmove(p->cdicts + 1, p->cdicts, sizeof(p->cdicts[0]) * i);
+    p->cdicts[0] = e;
+
+    e->refs ++;
+
+    return e;
+}
+
+static const ZSTD_DDict *
+dictionary_get_ddict(MRB, struct dictionary *p)
+{
+    if (!p->ddict) {
+        p->ddict = ZSTD_createDDict_advanced(
+                RSTRING_PTR(p->source), RSTRING_LEN(p->source),
+                ZSTD_dlm_byRef, ZSTD_dct_auto, aux_zstd_allocator(mrb));
+        if (!p->ddict) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createDDict_advanced failed"); }
+    }
+
+    return p->ddict;
+}
+
+/*
+ * dict: に与えられたオブジェクトを確認する。nil, String または Zstd::Dictionary を受け付ける。
+ */
+static void
+aux_check_dict(MRB, VALUE dict)
+{
+    if (NIL_P(dict) || mrb_string_p(dict)) { return; }
+    if (aux_dictionary_ptr(mrb, dict)) {
+        getdictionary(mrb, dict);
+        return;
+    }
+
+    mrb_raisef(mrb, E_TYPE_ERROR,
+               "wrong dictionary type %S (expect nil, String or Zstd::Dictionary)",
+               mrb_inspect(mrb, dict));
+}
+
+static size_t
+aux_dict_size(MRB, VALUE dict)
+{
+    if (NIL_P(dict)) {
+        return 0;
+    } else if (mrb_string_p(dict)) {
+        return RSTRING_LEN(dict);
+    } else {
+        return RSTRING_LEN(getdictionary(mrb, dict)->source);
+    }
+}
+
+#define AUX_CCTX_SET(mrb, zstd, param, value, name)                         \
+    aux_check_error(mrb, ZSTD_CCtx_setParameter(zstd, param, value),        \
+                    "ZSTD_CCtx_setParameter (" name ")")
+
+/*
+ * 圧縮レベルと明示された値から圧縮パラメータを求める。
+ */
+static ZSTD_compressionParameters
+aux_encode_cparams(MRB, const struct encode_params *params, unsigned long long srcsize, size_t dictsize)
+{
+    ZSTD_compressionParameters cparams = ZSTD_getCParams(params->level, srcsize, dictsize);
+    if (params->windowlog != 0) { cparams.windowLog = params->windowlog; }
+    if (params->chainlog != 0) { cparams.chainLog = params->chainlog; }
+    if (params->hashlog != 0) { cparams.hashLog = params->hashlog; }
+    if (params->searchlog != 0) { cparams.searchLog = params->searchlog; }
+    if (params->minmatch != 0) { cparams.minMatch = params->minmatch; }
+    if (params->targetlength != 0) { cparams.targetLength = params->targetlength; }
+    if (params->strategy != 0) { cparams.strategy = (ZSTD_strategy)params->strategy; }
+    aux_check_error(mrb, ZSTD_checkCParams(cparams), "ZSTD_checkCParams");
+
+    return cparams;
+}
+
+/*
+ * dict が Zstd::Dictionary であれば、ZSTD_CCtx_refCDict した ZSTD_CDict の参照を返す。
+ * 呼び出し元はコンテキストがそれを使わなくなってから dictionary_cdict_release() すること。
+ */
+static struct dictionary_cdict *
+aux_init_cstream(MRB, ZSTD_CStream *zstd, VALUE dict, const struct encode_params *params, mrb_int pledgedsize)
+{
+    /* NOTE: 使い回されるコンテキストに以前の設定や辞書が残らないように、パラメータも初期化する */
+    aux_check_error(mrb, ZSTD_CCtx_reset(zstd, ZSTD_reset_session_and_parameters), "ZSTD_CCtx_reset");
+
+    if (params->level != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_compressionLevel, params->level, "level"); }
+    if (params->windowlog != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_windowLog, params->windowlog, "windowlog"); }
+    if (params->chainlog != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_chainLog, params->chainlog, "chainlog"); }
+    if (params->hashlog != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_hashLog, params->hashlog, "hashlog"); }
+    if (params->searchlog != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_searchLog, params->searchlog, "searchlog"); }
+    if (params->minmatch != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_minMatch, params->minmatch, "minmatch"); }
+    if (params->targetlength != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_targetLength, params->targetlength, "targetlength"); }
+    if (params->strategy != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_strategy, params->strategy, "strategy"); }
+    if (params->contentsize >= 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_contentSizeFlag, params->contentsize, "contentsize"); }
+    if (params->checksum >= 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_checksumFlag, params->checksum, "checksum"); }
+    if (params->nodictid >= 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_dictIDFlag, !params->nodictid, "nodictid"); }
+    if (params->workers != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_nbWorkers, params->workers, "workers"); }
+    if (params->jobsize != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_jobSize, params->jobsize, "jobsize"); }
+    if (params->overlaplog != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_overlapLog, params->overlaplog, "overlaplog"); }
+    if (params->ldm != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_enableLongDistanceMatching, params->ldm, "ldm"); }
+    if (params->ldm_hashlog != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_ldmHashLog, params->ldm_hashlog, "ldm_hashlog"); }
+    if (params->ldm_minmatch != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_ldmMinMatch, params->ldm_minmatch, "ldm_minmatch"); }
+    if (params->ldm_bucketsizelog != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_ldmBucketSizeLog, params->ldm_bucketsizelog, "ldm_bucketsizelog"); }
+    if (params->ldm_hashratelog != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_ldmHashRateLog, params->ldm_hashratelog, "ldm_hashratelog"); }
+    if (params->targetcblocksize != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_targetCBlockSize, params->targetcblocksize, "target_cblock_size"); }
+    if (params->srcsizehint != 0) { AUX_CCTX_SET(mrb, zstd, ZSTD_c_srcSizeHint, params->srcsizehint, "srcsize_hint"); }
+
+    aux_check_error(mrb,
+            ZSTD_CCtx_setPledgedSrcSize(zstd, (pledgedsize < 0 ? ZSTD_CONTENTSIZE_UNKNOWN : (unsigned long long)pledgedsize)),
+            "ZSTD_CCtx_setPledgedSrcSize");
+
+    struct dictionary *d = aux_dictionary_ptr(mrb, dict);
+
+    if (d) {
+        /*
+         * ZSTD_CDict の圧縮パラメータが優先されるため、圧縮レベルと明示された値から作成する。
+         * 入力の大きさによって CDict を作り直さないように、入力の大きさは考慮しない
+         * (ZSTD_CDict は使用時に入力の大きさに合わせてくれる)。
+         */
+        ZSTD_compressionParameters cparams = aux_encode_cparams(mrb, params, 0, RSTRING_LEN(d->source));
+
+        struct dictionary_cdict *e = dictionary_acquire_cdict(mrb, d, &cparams);
+        size_t s = ZSTD_CCtx_refCDict(zstd, e->cdict);
+        if (ZSTD_isError(s)) {
+            dictionary_cdict_release(mrb, e);
+            aux_check_error(mrb, s, "ZSTD_CCtx_refCDict");
+        }
+
+        return e;
+    } else if (!NIL_P(dict)) {
+        size_t s = ZSTD_CCtx_loadDictionary(zstd, RSTRING_PTR(dict), RSTRING_LEN(dict));
+        aux_check_error(mrb, s, "ZSTD_CCtx_loadDictionary");
+    }
+
+    return NULL;
+}
+
+static void
+aux_init_dstream(MRB, ZSTD_DStream *zstd, VALUE dict)
+{
+    struct dictionary *d = aux_dictionary_ptr(mrb, dict);
+
+    if (d) {
+        size_t s = ZSTD_initDStream_usingDDict(zstd, dictionary_get_ddict(mrb, d));
+        aux_check_error(mrb, s, "ZSTD_initDStream_usingDDict");
+    } else if (NIL_P(dict)) {
+        size_t s = ZSTD_initDStream(zstd);
+        aux_check_error(mrb, s, "ZSTD_initDStream");
+    } else {
+        size_t s = ZSTD_initDStream_usingDict(zstd, RSTRING_PTR(dict), RSTRING_LEN(dict));
+        aux_check_error(mrb, s, "ZSTD_initDStream_usingDict");
+    }
+}
+
+#define AUX_ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * workspace: の値から、静的なコンテキスト (ZSTD_initStatic*) のための作業領域を用意する。
+ *  - 文字列: その文字列の領域を使う (移動しないように凍結する)
+ *  - 整数: その大きさの領域を確保する
+ *  - true: needsize だけ確保する
+ * 確保した場合は *owned にも設定する (呼び出し元が解放する)。
+ */
+static void
+aux_workspace(MRB, VALUE ws, size_t needsize, char **ptr, size_t *size, void **owned)
+{
+    *owned = NULL;
+
+    if (mrb_string_p(ws)) {
+        *size = RSTRING_CAPA(ws);
+    } else if (mrb_type(ws) == MRB_TT_TRUE) {
+        *size = needsize;
+    } else {
+        mrb_int n = mrb_int(mrb, ws);
+        if (n < 1) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong workspace (given %S, expect positive integer)", ws);
+        }
+        *size = (size_t)n;
+    }
+
+    if (*size < needsize) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "workspace is too small (given %S bytes, need %S bytes)",
+                   aux_size_value(mrb, *size), aux_size_value(mrb, needsize));
+    }
+
+    if (!mrb_string_p(ws)) {
+        *ptr = (char *)mrb_malloc(mrb, *size);
+        *owned = *ptr;
+        return;
+    }
+
+    mrb_str_modify(mrb, RSTRING(ws));
+    *ptr = RSTRING_PTR(ws);
+    if ((uintptr_t)*ptr % 8 != 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "workspace is not 8-bytes aligned");
+    }
+    MRB_SET_FROZEN_FLAG(RSTRING(ws));
+}
+
+static size_t
+aux_decompress_dict(MRB, ZSTD_DCtx *zstd, void *dest, size_t destsize, const void *src, size_t srcsize, VALUE dict)
+{
+    struct dictionary *d = aux_dictionary_ptr(mrb, dict);
+
+    if (d) {
+        size_t s = ZSTD_decompress_usingDDict(zstd, dest, destsize, src, srcsize, dictionary_get_ddict(mrb, d));
+        aux_check_error(mrb, s, "ZSTD_decompress_usingDDict");
+        return s;
+    } else {
+        size_t s = ZSTD_decompress_usingDict(zstd, dest, destsize, src, srcsize,
+                (NIL_P(dict) ? NULL : RSTRING_PTR(dict)),
+                (NIL_P(dict) ? 0 : RSTRING_LEN(dict)));
+        aux_check_error(mrb, s, "ZSTD_decompress_usingDict");
+        return s;
+    }
+}
+
+static VALUE
+dict_s_new(MRB, VALUE self)
+{
+    struct RClass *klass = mrb_class_ptr(self);
+    struct RData *rd;
+    struct dictionary *p;
+    Data_Make_Struct(mrb, klass, struct dictionary, &dictionary_type, p, rd);
+    p->source = Qnil;
+
+    VALUE obj = mrb_obj_value(rd);
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    mrb_funcall_argv(mrb, obj, mrb_intern_lit(mrb, "initialize"), argc, argv);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  initialize(dict_string, level: nil) -> self
+ *
+ * [dict_string (string)]
+ *  Dictionary content (trained by Zstd::Dictionary.train or zstd-cli, or any raw content).
+ *
+ *  A frozen string is referenced as is. Otherwise a frozen copy is made once.
+ *
+ * [level (integer OR nil)]
+ *  Digest for this compression level in advance.
+ */
+static VALUE
+dict_initialize(MRB, VALUE self)
+{
+    struct dictionary *p;
+    Data_Get_Struct(mrb, self, &dictionary_type, p);
+
+    VALUE source, opts = Qnil, level = Qnil;
+    mrb_get_args(mrb, "S|H", &source, &opts);
+    if (!NIL_P(opts)) {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("level", &level, Qnil));
+    }
+
+    if (!NIL_P(p->source)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "already initialized dictionary");
+    }
+
+    if (!MRB_FROZEN_P(RSTRING(source))) {
+        source = mrb_str_dup(mrb, source);
+        MRB_SET_FROZEN_FLAG(RSTRING(source));
+    }
+
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.dictionary-source"), source);
+    p->source = source;
+
+    if (!NIL_P(level)) {
+        ZSTD_compressionParameters cparams = ZSTD_getCParams(mrb_int(mrb, level), 0, RSTRING_LEN(source));
+        dictionary_cdict_release(mrb, dictionary_acquire_cdict(mrb, p, &cparams));
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  dict_id -> integer
+ *
+ * Return 0 if raw content dictionary.
+ */
+static VALUE
+dict_dict_id(MRB, VALUE self)
+{
+    struct dictionary *p = getdictionary(mrb, self);
+    return mrb_fixnum_value(ZDICT_getDictID(RSTRING_PTR(p->source), RSTRING_LEN(p->source)));
+}
+
+/*
+ * call-seq:
+ *  to_s -> frozen string
+ */
+static VALUE
+dict_to_s(MRB, VALUE self)
+{
+    return getdictionary(mrb, self)->source;
+}
+
+/*
+ * call-seq:
+ *  bytesize -> integer
+ */
+static VALUE
+dict_bytesize(MRB, VALUE self)
+{
+    return mrb_fixnum_value(RSTRING_LEN(getdictionary(mrb, self)->source));
+}
+
+/*
+ * call-seq:
+ *  dict_id(dict_string) -> integer
+ *
+ * Return 0 if raw content dictionary.
+ */
+static VALUE
+dict_s_dict_id(MRB, VALUE self)
+{
+    const char *dict;
+    mrb_int dictsize;
+    mrb_get_args(mrb, "s", &dict, &dictsize);
+
+    return mrb_fixnum_value(ZDICT_getDictID(dict, dictsize));
+}
+
+/*
+ * samples (文字列の配列) を一つの連続したバッファに集める。
+ * 戻り値は mrb_malloc されたもので、先頭に各サンプルの大きさの配列が置かれる。
+ */
+static void *
+aux_gather_samples(MRB, VALUE samples, size_t **sizes, unsigned *nsamples, void **buf)
+{
+    mrb_check_type(mrb, samples, MRB_TT_ARRAY);
+
+    mrb_int num = RARRAY_LEN(samples);
+    size_t total = 0;
+    for (mrb_int i = 0; i < num; i ++) {
+        VALUE sample = mrb_ary_ref(mrb, samples, i);
+        mrb_check_type(mrb, sample, MRB_TT_STRING);
+        total += RSTRING_LEN(sample);
+    }
+
+    if (num < 1 || num > UINT32_MAX) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong number of samples (given %S)",
+                   mrb_fixnum_value(num));
+    }
+
+    char *block = (char *)mrb_malloc(mrb, sizeof(size_t) * num + total);
+    char *p = block + sizeof(size_t) * num;
+    *sizes = (size_t *)block;
+    *nsamples = num;
+    *buf = p;
+
+    for (mrb_int i = 0; i < num; i ++) {
+        VALUE sample = RARRAY_PTR(samples)[i];
+        (*sizes)[i] = RSTRING_LEN(sample);
+        memcpy(p, RSTRING_PTR(sample), RSTRING_LEN(sample));
+        p += RSTRING_LEN(sample);
+    }
+
+    return block;
+}
+
+static unsigned
+aux_to_uint(MRB, VALUE v, unsigned defval)
+{
+    if (NIL_P(v)) { return defval; }
+
+    mrb_int n = mrb_int(mrb, v);
+    if (n < 0 || n > UINT32_MAX) {
+        mrb_raisef(mrb, E_RANGE_ERROR, "out of range - %S", v);
+    }
+
+    return (unsigned)n;
+}
+
+/*
+ * call-seq:
+ *  train(samples, capacity: 112640, algorithm: :fastcover, level: 0, dict_id: 0,
+ *        k: nil, d: nil, f: nil, steps: nil, threads: nil, split_point: nil,
+ *        accel: nil, selectivity: nil, notification: 0) -> instance of Zstd::Dictionary
+ *
+ * Train a dictionary from samples.
+ *
+ * [samples (array of strings)]
+ *  Training samples.
+ *
+ * [capacity (integer)]
+ *  Maximum dictionary size.
+ *
+ * [algorithm (:fastcover, :cover OR :legacy)]
+ *  fastcover and cover try the parameters that are not given, and choose the best.
+ *
+ * [level (integer)]
+ *  Optimize for this compression level.
+ *
+ * [dict_id (integer)]
+ *  Force dictionary ID. 0 means random.
+ *
+ * [k, d, f, steps, threads, split_point, accel (integer, float OR nil)]
+ *  Tunables for fastcover and cover (f and accel are fastcover only).
+ *  see ZDICT_fastCover_params_t and ZDICT_cover_params_t in zdict.h.
+ *
+ *  threads is ignored if not built with ZSTD_MULTITHREAD.
+ *
+ * [selectivity (integer OR nil)]
+ *  Tunable for legacy.
+ */
+static VALUE
+dict_s_train(MRB, VALUE self)
+{
+    VALUE samples, opts = Qnil;
+    mrb_get_args(mrb, "A|H", &samples, &opts);
+
+    VALUE capacity = Qnil, algorithm = Qnil, level = Qnil, dictid = Qnil,
+          k = Qnil, d = Qnil, f = Qnil, steps = Qnil, threads = Qnil, splitpoint = Qnil,
+          accel = Qnil, selectivity = Qnil, notification = Qnil;
+    if (!NIL_P(opts)) {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("capacity",      &capacity,      Qnil),
+                MRBX_SCANHASH_ARGS("algorithm",     &algorithm,     Qnil),
+                MRBX_SCANHASH_ARGS("level",         &level,         Qnil),
+                MRBX_SCANHASH_ARGS("dict_id",       &dictid,        Qnil),
+                MRBX_SCANHASH_ARGS("k",             &k,             Qnil),
+                MRBX_SCANHASH_ARGS("d",             &d,             Qnil),
+                MRBX_SCANHASH_ARGS("f",             &f,             Qnil),
+                MRBX_SCANHASH_ARGS("steps",         &steps,         Qnil),
+                MRBX_SCANHASH_ARGS("threads",       &threads,       Qnil),
+                MRBX_SCANHASH_ARGS("split_point",   &splitpoint,    Qnil),
+                MRBX_SCANHASH_ARGS("accel",         &accel,         Qnil),
+                MRBX_SCANHASH_ARGS("selectivity",   &selectivity,   Qnil),
+                MRBX_SCANHASH_ARGS("notification",  &notification,  Qnil));
+    }
+
+    ZDICT_params_t zparams = {
+        .compressionLevel = (NIL_P(level) ? 0 : mrb_int(mrb, level)),
+        .notificationLevel = aux_to_uint(mrb, notification, 0),
+        .dictID = aux_to_uint(mrb, dictid, 0),
+    };
+
+    mrb_sym algo = (NIL_P(algorithm) ? id_fastcover : (mrb_check_type(mrb, algorithm, MRB_TT_SYMBOL), mrb_symbol(algorithm)));
+    if (algo != id_fastcover && algo != id_cover && algo != id_legacy) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong algorithm (given %S, expect fastcover, cover or legacy)",
+                   algorithm);
+    }
+
+    mrb_int dictcapa = (NIL_P(capacity) ? 112640 : mrb_int(mrb, capacity));
+    if (dictcapa < 256 || dictcapa > AUX_MALLOC_MAX) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong dictionary capacity (given %S)",
+                   mrb_fixnum_value(dictcapa));
+    }
+
+    unsigned selectlevel = aux_to_uint(mrb, selectivity, 0);
+    ZDICT_fastCover_params_t fastcover = {
+        .k = aux_to_uint(mrb, k, 0),
+        .d = aux_to_uint(mrb, d, 0),
+        .f = aux_to_uint(mrb, f, 0),
+        .steps = aux_to_uint(mrb, steps, 0),
+        .nbThreads = aux_to_uint(mrb, threads, 1),
+        .splitPoint = (NIL_P(splitpoint) ? 0.0 : mrb_to_flo(mrb, splitpoint)),
+        .accel = aux_to_uint(mrb, accel, 0),
+        .zParams = zparams,
+    };
+
+    VALUE dict = mrb_str_buf_new(mrb, dictcapa);
+
+    /* NOTE: ここから mrb_free(mrb, block) までの間は例外を発生させてはならない */
+    size_t *sizes;
+    unsigned nsamples;
+    void *samplebuf;
+    void *block = aux_gather_samples(mrb, samples, &sizes, &nsamples, &samplebuf);
+
+    size_t s;
+    if (algo == id_fastcover) {
+        s = ZDICT_optimizeTrainFromBuffer_fastCover(RSTRING_PTR(dict), dictcapa,
+                samplebuf, sizes, nsamples, &fastcover);
+    } else if (algo == id_cover) {
+        ZDICT_cover_params_t params = {
+            .k = fastcover.k,
+            .d = fastcover.d,
+            .steps = fastcover.steps,
+            .nbThreads = fastcover.nbThreads,
+            .splitPoint = fastcover.splitPoint,
+            .zParams = zparams,
+        };
+
+        s = ZDICT_optimizeTrainFromBuffer_cover(RSTRING_PTR(dict), dictcapa,
+                samplebuf, sizes, nsamples, &params);
+    } else {
+        ZDICT_legacy_params_t params = {
+            .selectivityLevel = selectlevel,
+            .zParams = zparams,
+        };
+
+        s = ZDICT_trainFromBuffer_legacy(RSTRING_PTR(dict), dictcapa,
+                samplebuf, sizes, nsamples, params);
+    }
+
+    mrb_free(mrb, block);
+    aux_check_error(mrb, s, "ZDICT_trainFromBuffer");
+    RSTR_SET_LEN(RSTRING(dict), s);
+    MRB_SET_FROZEN_FLAG(RSTRING(dict));
+
+    return mrb_funcall_argv(mrb, self, mrb_intern_lit(mrb, "new"), 1, &dict);
+}
+
+/*
+ * call-seq:
+ *  finalize(content, samples, capacity: 112640, level: 0, dict_id: 0, notification: 0) -> instance of Zstd::Dictionary
+ *
+ * Make a zstd formatted dictionary from raw content.
+ * The entropy tables are computed from samples.
+ */
+static VALUE
+dict_s_finalize(MRB, VALUE self)
+{
+    VALUE content, samples, opts = Qnil;
+    mrb_get_args(mrb, "SA|H", &content, &samples, &opts);
+
+    VALUE capacity = Qnil, level = Qnil, dictid = Qnil, notification = Qnil;
+    if (!NIL_P(opts)) {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("capacity",      &capacity,      Qnil),
+                MRBX_SCANHASH_ARGS("level",         &level,         Qnil),
+                MRBX_SCANHASH_ARGS("dict_id",       &dictid,        Qnil),
+                MRBX_SCANHASH_ARGS("notification",  &notification,  Qnil));
+    }
+
+    ZDICT_params_t zparams = {
+        .compressionLevel = (NIL_P(level) ? 0 : mrb_int(mrb, level)),
+        .notificationLevel = aux_to_uint(mrb, notification, 0),
+        .dictID = aux_to_uint(mrb, dictid, 0),
+    };
+
+    mrb_int dictcapa = (NIL_P(capacity) ? 112640 : mrb_int(mrb, capacity));
+    if (dictcapa < 256 || dictcapa > AUX_MALLOC_MAX) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong dictionary capacity (given %S)",
+                   mrb_fixnum_value(dictcapa));
+    }
+
+    VALUE dict = mrb_str_buf_new(mrb, dictcapa);
+
+    /* NOTE: ここから mrb_free(mrb, block) までの間は例外を発生させてはならない */
+    size_t *sizes;
+    unsigned nsamples;
+    void *samplebuf;
+    void *block = aux_gather_samples(mrb, samples, &sizes, &nsamples, &samplebuf);
+
+    size_t s = ZDICT_finalizeDictionary(RSTRING_PTR(dict), dictcapa,
+            RSTRING_PTR(content), RSTRING_LEN(content),
+            samplebuf, sizes, nsamples, zparams);
+
+    mrb_free(mrb, block);
+    aux_check_error(mrb, s, "ZDICT_finalizeDictionary");
+    RSTR_SET_LEN(RSTRING(dict), s);
+    MRB_SET_FROZEN_FLAG(RSTRING(dict));
+
+    return mrb_funcall_argv(mrb, self, mrb_intern_lit(mrb, "new"), 1, &dict);
+}
+
+static void
+init_dictionary(MRB, struct RClass *mZstd)
+{
+    struct RClass *cDictionary = mrb_define_class_under(mrb, mZstd, "Dictionary", mrb_cObject);
+    mrb_define_class_method(mrb, cDictionary, "new", dict_s_new, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cDictionary, "train", dict_s_train, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cDictionary, "finalize", dict_s_finalize, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cDictionary, "dict_id", dict_s_dict_id, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cDictionary, "initialize", dict_initialize, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDictionary, "dict_id", dict_dict_id, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDictionary, "to_s", dict_to_s, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDictionary, "bytesize", dict_bytesize, MRB_ARGS_NONE());
+
+    mrb_define_alias(mrb, cDictionary, "size", "bytesize");
+}
+
+
+/*
+ * native worker pool
+ *
+ * 独立した複数の入力を、ワーカーごとのコンテキストを使い回しながら処理する。
+ * ワーカースレッドは mruby の VM に触れないため、出力先は呼び出し元のスレッドであらかじめ確保しておく。
+ */
+
+enum context_owner
+{
+    CONTEXT_BORROWED,   /* 呼び出し元が所有する */
+    CONTEXT_POOLED,     /* context pool から借りた */
+    CONTEXT_OWNED,      /* 一時的に作成した (処理後に解放する) */
+};
+
+struct batch;
+
+struct batch_job
+{
+    const char *src;
+    size_t srcsize;
+    char *dest;         /* 出力先の文字列バッファ (NULL の場合は heap に確保する) */
+    size_t destsize;
+    char *heap;         /* 伸長後の大きさが不明な場合に realloc() で確保する */
+    size_t result;      /* 出力の大きさ、またはエラーコード */
+};
+
+struct batch_worker
+{
+    struct batch *batch;
+    void *context;      /* ZSTD_CCtx または ZSTD_DCtx */
+    enum context_owner owner;
+    struct dictionary_cdict *cdict;
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    pthread_t thread;
+    mrb_bool running;
+#endif
+};
+
+struct batch
+{
+    mrb_bool encode;
+    VALUE src, dest, dict;  /* src と dest は Array (バッチ処理) または String (フレーム分割) */
+    const struct encode_params *params;
+    size_t framesize;   /* 1 つの入力をフレームに分割する場合の大きさ */
+    struct batch_job *jobs;
+    size_t njobs;
+    size_t next;
+    mrb_bool failed;
+    int nworkers;
+    struct batch_worker *workers;
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    pthread_mutex_t mutex;
+    mrb_bool mutex_ready;
+#endif
+};
+
+static void
+batch_lock(struct batch *b)
+{
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    if (b->mutex_ready) { pthread_mutex_lock(&b->mutex); }
+#endif
+}
+
+static void
+batch_unlock(struct batch *b)
+{
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    if (b->mutex_ready) { pthread_mutex_unlock(&b->mutex); }
+#endif
+}
+
+static struct batch_job *
+batch_next_job(struct batch *b)
+{
+    struct batch_job *job = NULL;
+
+    batch_lock(b);
+    if (!b->failed && b->next < b->njobs) {
+        job = &b->jobs[b->next ++];
+    }
+    batch_unlock(b);
+
+    return job;
+}
+
+/*
+ * 伸長後の大きさが不明な入力を heap に伸長する。
+ * ワーカースレッドから呼ばれるため、例外は発生させずにエラーコードを返す。
+ */
+static size_t
+batch_decode_stream(ZSTD_DCtx *dctx, struct batch_job *job)
+{
+    ZSTD_inBuffer input = { .src = job->src, .size = job->srcsize, .pos = 0, };
+    ZSTD_outBuffer output = { .dst = NULL, .size = 0, .pos = 0, };
+    size_t s = ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    if (ZSTD_isError(s)) { return s; }
+
+    for (;;) {
+        if (output.pos >= output.size) {
+            size_t newsize;
+            if (output.size == 0) {
+                newsize = CLAMP_MAX(CLAMP_MIN(job->srcsize, ZSTD_DStreamOutSize()), AUX_MALLOC_MAX);
+            } else if (output.size >= AUX_MALLOC_MAX) {
+                return AUX_ZSTD_ERROR(dstSize_tooSmall);
+            } else {
+                newsize = (output.size > AUX_MALLOC_MAX / 2 ? AUX_MALLOC_MAX : output.size * 2);
+            }
+
+            char *p = (char *)realloc(job->heap, newsize);
+            if (!p) { return AUX_ZSTD_ERROR(memory_allocation); }
+            job->heap = p;
+            output.dst = p;
+            output.size = newsize;
+        }
+
+        s = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(s)) { return s; }
+        if (input.pos >= input.size && output.pos < output.size) { break; }
+    }
+
+    /* 入力が途中で途切れている */
+    if (s != 0) { return AUX_ZSTD_ERROR(srcSize_wrong); }
+
+    return output.pos;
+}
+
+static void *
+batch_worker_main(void *arg)
+{
+    struct batch_worker *w = (struct batch_worker *)arg;
+    struct batch *b = w->batch;
+    struct batch_job *job;
+
+    while ((job = batch_next_job(b)) != NULL) {
+        if (b->encode) {
+            job->result = ZSTD_compress2((ZSTD_CCtx *)w->context, job->dest, job->destsize, job->src, job->srcsize);
+        } else if (job->dest) {
+            job->result = ZSTD_decompressDCtx((ZSTD_DCtx *)w->context, job->dest, job->destsize, job->src, job->srcsize);
+        } else {
+            job->result = batch_decode_stream((ZSTD_DCtx *)w->context, job);
+        }
+
+        if (ZSTD_isError(job->result)) {
+            /* 残りの入力は処理しない */
+            batch_lock(b);
+            b->failed = TRUE;
+            batch_unlock(b);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+batch_prepare_workers(MRB, struct batch *b)
+{
+    b->workers = (struct batch_worker *)mrb_calloc(mrb, b->nworkers, sizeof(struct batch_worker));
+
+    for (int i = 0; i < b->nworkers; i ++) {
+        struct batch_worker *w = &b->workers[i];
+        w->batch = b;
+
+        /*
+         * 呼び出し元のスレッドは context pool のコンテキストを使う。
+         * それ以外のワーカースレッドからは mruby のアロケータを使えないため、既定のアロケータで作成する。
+         */
+        if (i == 0) {
+            w->owner = CONTEXT_POOLED;
+            w->context = (b->encode ? (void *)context_pool_acquire_cctx(mrb) : (void *)context_pool_acquire_dctx(mrb));
+        } else {
+            w->owner = CONTEXT_OWNED;
+            w->context = (b->encode ? (void *)ZSTD_createCCtx() : (void *)ZSTD_createDCtx());
+            if (!w->context) {
+                mrb_raise(mrb, E_RUNTIME_ERROR, (b->encode ? "ZSTD_createCCtx failed" : "ZSTD_createDCtx failed"));
+            }
+        }
+
+        if (b->encode) {
+            w->cdict = aux_init_cstream(mrb, (ZSTD_CCtx *)w->context, b->dict, b->params, -1);
+        } else {
+            ZSTD_DCtx *dctx = (ZSTD_DCtx *)w->context;
+            aux_check_error(mrb, ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters), "ZSTD_DCtx_reset");
+            struct dictionary *d = aux_dictionary_ptr(mrb, b->dict);
+            if (d) {
+                aux_check_error(mrb, ZSTD_DCtx_refDDict(dctx, dictionary_get_ddict(mrb, d)), "ZSTD_DCtx_refDDict");
+            }
+        }
+    }
+}
+
+static void
+batch_join(struct batch *b)
+{
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    if (!b->workers) { return; }
+
+    for (int i = 0; i < b->nworkers; i ++) {
+        if (b->workers[i].running) {
+            pthread_join(b->workers[i].thread, NULL);
+            b->workers[i].running = FALSE;
+        }
+    }
+#endif
+}
+
+/*
+ * ワーカーを用意して全ての job を処理する。呼び出し元のスレッドも 1 つのワーカーとして働く。
+ * 各 job の結果 (またはエラーコード) は job->result に格納される。
+ */
+static void
+batch_run(MRB, struct batch *b)
+{
+    batch_prepare_workers(mrb, b);
+
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    if (b->nworkers > 1) {
+        if (pthread_mutex_init(&b->mutex, NULL) != 0) {
+            mrb_raise(mrb, E_RUNTIME_ERROR, "pthread_mutex_init failed");
+        }
+        b->mutex_ready = TRUE;
+
+        for (int i = 1; i < b->nworkers; i ++) {
+            /* スレッドを作成できなくても、残りのワーカーが処理する */
+            struct batch_worker *w = &b->workers[i];
+            w->running = (pthread_create(&w->thread, NULL, batch_worker_main, w) == 0);
+        }
+    }
+#endif
+
+    batch_worker_main(&b->workers[0]);
+    batch_join(b);
+}
+
+/*
+ * threads: に与えられた値からワーカーの数を決める。nil の場合は deflt とする。
+ * スレッドが使えない場合は常に 1 となる。
+ */
+static int
+batch_count_workers(MRB, VALUE threads, mrb_int deflt, size_t njobs)
+{
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    mrb_int n = (NIL_P(threads) ? deflt : mrb_int(mrb, threads));
+    n = CLAMP_MAX(n, MRUBY_ZSTD_BATCH_MAX_THREADS);
+    n = CLAMP_MAX((size_t)CLAMP_MIN(n, 1), njobs);
+    return (int)CLAMP_MIN(n, 1);
+#else
+    /* スレッドが使えない場合は呼び出し元のスレッドで順番に処理する */
+    (void)threads;
+    (void)deflt;
+    (void)njobs;
+    return 1;
+#endif
+}
+
+/*
+ * 利用可能な CPU の数 (分からない場合は 1)。
+ */
+static mrb_int
+aux_cpu_count(void)
+{
+#if defined(MRUBY_ZSTD_BATCH_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0 ? (mrb_int)n : 1);
+#else
+    return 1;
+#endif
+}
+
+static VALUE
+batch_main_cleanup(MRB, VALUE args)
+{
+    struct batch *b = (struct batch *)mrb_cptr(args);
+
+    batch_join(b);
+
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    if (b->mutex_ready) {
+        pthread_mutex_destroy(&b->mutex);
+        b->mutex_ready = FALSE;
+    }
+#endif
+
+    if (b->jobs) {
+        for (size_t i = 0; i < b->njobs; i ++) {
+            free(b->jobs[i].heap);
+        }
+        mrb_free(mrb, b->jobs);
+    }
+
+    if (b->workers) {
+        for (int i = 0; i < b->nworkers; i ++) {
+            struct batch_worker *w = &b->workers[i];
+            if (!w->context) { continue; }
+
+            /* Zstd::Dictionary が先に解放されても参照が残らないようにする */
+            if (b->encode) {
+                ZSTD_CCtx *cctx = (ZSTD_CCtx *)w->context;
+                ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+                ZSTD_CCtx_refCDict(cctx, NULL);
+                dictionary_cdict_replace(mrb, &w->cdict, NULL);
+                if (w->owner == CONTEXT_POOLED) {
+                    context_pool_release_cctx(mrb, cctx);
+                } else {
+                    ZSTD_freeCCtx(cctx);
+                }
+            } else {
+                ZSTD_DCtx *dctx = (ZSTD_DCtx *)w->context;
+                ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+                ZSTD_DCtx_refDDict(dctx, NULL);
+                if (w->owner == CONTEXT_POOLED) {
+                    context_pool_release_dctx(mrb, dctx);
+                } else {
+                    ZSTD_freeDCtx(dctx);
+                }
+            }
+        }
+        mrb_free(mrb, b->workers);
+    }
+
+    return Qnil;
+}
+
+/*
+ * 文字列の辞書は ZSTD_CDict / ZSTD_DDict を各ワーカーで共有するため、Zstd::Dictionary に変換する。
+ */
+static VALUE
+aux_to_dictionary(MRB, VALUE dict)
+{
+    if (!mrb_string_p(dict)) { return dict; }
+
+    struct RClass *cDictionary = mrb_class_get_under(mrb, mrb_module_get(mrb, "Zstd"), "Dictionary");
+    return mrb_funcall(mrb, mrb_obj_value(cDictionary), "new", 1, dict);
+}
+
+/*
+ * class Zstd::Encoder
+ */
+
+static int
+aux_to_flag(VALUE v)
+{
+    return (NIL_P(v) ? -1 : (mrb_bool(v) ? 1 : 0));
+}
+
+static int
+aux_to_param(MRB, VALUE v)
+{
+    return (NIL_P(v) ? 0 : (int)mrb_int(mrb, v));
+}
+
+static void
+encode_kwargs(MRB, VALUE opts, VALUE src, struct encode_params *params, mrb_int *pledgedsize, VALUE *dict)
+{
+    memset(params, 0, sizeof(*params));
+    params->contentsize = params->checksum = params->nodictid = -1;
+
+    if (NIL_P(opts)) {
+        if (NIL_P(src)) {
+            *pledgedsize = ZSTD_CONTENTSIZE_UNKNOWN;
+        } else {
+            *pledgedsize = RSTRING_LEN(src);
+        }
+
+        *dict = Qnil;
+    } else {
+        VALUE level, contentsize, checksum, nodictid, srcsizehint, anestimatedsize, apledgedsize,
+              windowlog, chainlog, hashlog, searchlog, minmatch, targetlength, strategy,
+              workers, jobsize, overlaplog,
+              ldm, ldm_hashlog, ldm_minmatch, ldm_bucketsizelog, ldm_hashratelog,
+              targetcblocksize;
+        struct mrbx_scanhash_arg args[] = {
+            MRBX_SCANHASH_ARGS("level",         &level,             Qnil),
+            MRBX_SCANHASH_ARGS("dict",          dict,               Qnil),
+            MRBX_SCANHASH_ARGS("windowlog",     &windowlog,         Qnil),
+            MRBX_SCANHASH_ARGS("chainlog",      &chainlog,          Qnil),
+            MRBX_SCANHASH_ARGS("hashlog",       &hashlog,           Qnil),
+            MRBX_SCANHASH_ARGS("searchlog",     &searchlog,         Qnil),
+            MRBX_SCANHASH_ARGS("minmatch",      &minmatch,          Qnil),
+            MRBX_SCANHASH_ARGS("targetlength",  &targetlength,      Qnil),
+            MRBX_SCANHASH_ARGS("strategy",      &strategy,          Qnil),
+            MRBX_SCANHASH_ARGS("contentsize",   &contentsize,       Qnil),
+            MRBX_SCANHASH_ARGS("checksum",      &checksum,          Qnil),
+            MRBX_SCANHASH_ARGS("nodictid",      &nodictid,          Qnil),
+            MRBX_SCANHASH_ARGS("workers",       &workers,           Qnil),
+            MRBX_SCANHASH_ARGS("jobsize",       &jobsize,           Qnil),
+            MRBX_SCANHASH_ARGS("overlaplog",    &overlaplog,        Qnil),
+            MRBX_SCANHASH_ARGS("ldm",           &ldm,               Qnil),
+            MRBX_SCANHASH_ARGS("ldm_hashlog",   &ldm_hashlog,       Qnil),
+            MRBX_SCANHASH_ARGS("ldm_minmatch",  &ldm_minmatch,      Qnil),
+            MRBX_SCANHASH_ARGS("ldm_bucketsizelog", &ldm_bucketsizelog, Qnil),
+            MRBX_SCANHASH_ARGS("ldm_hashratelog", &ldm_hashratelog, Qnil),
+            MRBX_SCANHASH_ARGS("target_cblock_size", &targetcblocksize, Qnil),
+            MRBX_SCANHASH_ARGS("srcsize_hint",  &srcsizehint,       Qnil),
+            MRBX_SCANHASH_ARGS("estimatedsize", &anestimatedsize,   Qnil),
+            MRBX_SCANHASH_ARGS("pledgedsize",   &apledgedsize,      Qnil),
+        };
+
+        if (NIL_P(src)) {
+            mrbx_scanhash(mrb, opts, Qnil, ELEMENTOF(args), args);
+            *pledgedsize = (NIL_P(apledgedsize) ? ZSTD_CONTENTSIZE_UNKNOWN : mrb_int(mrb, apledgedsize));
+
+            /* estimatedsize は srcsize_hint の旧名 */
+            if (NIL_P(srcsizehint)) { srcsizehint = anestimatedsize; }
+            params->srcsizehint = aux_to_param(mrb, srcsizehint);
+            if (params->srcsizehint < 0) { params->srcsizehint = 0; }
+        } else {
+            /* NOTE: ELEMENTOF(args) - 3 によって srcsize_hint と estimatedsize と pledgedsize をないものと扱う */
+            mrbx_scanhash(mrb, opts, Qnil, ELEMENTOF(args) - 3, args);
+
+            *pledgedsize = RSTRING_LEN(src);
+        }
+
+        aux_check_dict(mrb, *dict);
+
+        params->level = aux_to_param(mrb, level);
+        params->windowlog = aux_to_param(mrb, windowlog);
+        params->chainlog = aux_to_param(mrb, chainlog);
+        params->hashlog = aux_to_param(mrb, hashlog);
+        params->searchlog = aux_to_param(mrb, searchlog);
+        params->minmatch = aux_to_param(mrb, minmatch);
+        params->targetlength = aux_to_param(mrb, targetlength);
+        if (!NIL_P(strategy)) { params->strategy = aux_to_strategy(mrb, strategy); }
+
+        params->contentsize = aux_to_flag(contentsize);
+        params->checksum = aux_to_flag(checksum);
+        params->nodictid = aux_to_flag(nodictid);
+
+        params->ldm = (aux_to_flag(ldm) > 0 ? 1 : 0);
+        params->ldm_hashlog = aux_to_param(mrb, ldm_hashlog);
+        params->ldm_minmatch = aux_to_param(mrb, ldm_minmatch);
+        params->ldm_bucketsizelog = aux_to_param(mrb, ldm_bucketsizelog);
+        params->ldm_hashratelog = aux_to_param(mrb, ldm_hashratelog);
+        params->targetcblocksize = aux_to_param(mrb, targetcblocksize);
+
+#ifdef ZSTD_MULTITHREAD
+        params->workers = aux_to_param(mrb, workers);
+        params->jobsize = aux_to_param(mrb, jobsize);
+        params->overlaplog = aux_to_param(mrb, overlaplog);
+        if (params->workers < 0) { params->workers = 0; }
+#else
+        /* 単一スレッドで処理する */
+        (void)workers;
+        (void)jobsize;
+        (void)overlaplog;
+#endif
+    }
+}
+
+/*
+ * opts から key を取り除いて、その値を返す。opts は初めて取り除く時に複製する。
+ */
+static VALUE
+aux_opts_take(MRB, VALUE *opts, mrb_bool *dupped, VALUE key)
+{
+    if (NIL_P(*opts) || !mrb_hash_key_p(mrb, *opts, key)) { return Qnil; }
+
+    if (!*dupped) {
+        *opts = mrb_hash_dup(mrb, *opts);
+        *dupped = TRUE;
+    }
+
+    return mrb_hash_delete_key(mrb, *opts, key);
+}
+
+/*
+ * frames: と frame_size: から 1 フレームあたりの大きさを求める。
+ * 分割しない場合は 0 を返す。
+ */
+static mrb_int
+aux_frame_split_size(MRB, VALUE src, VALUE frames, VALUE framesize)
+{
+    if (NIL_P(frames) && NIL_P(framesize)) { return 0; }
+
+    if (!NIL_P(frames) && !NIL_P(framesize)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "frames and frame_size are exclusive");
+    }
+
+    if (!NIL_P(framesize)) {
+        mrb_int n = mrb_int(mrb, framesize);
+        if (n < 1) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR, "frame_size must be positive (given %S)", framesize);
+        }
+        return n;
+    } else {
+        mrb_int n = mrb_int(mrb, frames);
+        if (n < 1) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR, "frames must be positive (given %S)", frames);
+        }
+        mrb_int len = RSTRING_LEN(src);
+        return CLAMP_MIN(len / n + (len % n != 0 ? 1 : 0), 1);
+    }
+}
+
+static void
+enc_s_encode_args(MRB, VALUE *src, VALUE *dest, mrb_int *maxdest, struct encode_params *params, mrb_int *pledgedsize, VALUE *dict, mrb_int *framesize, VALUE *threads)
+{
+    VALUE *argv;
+    mrb_int argc;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    VALUE opts;
+
+    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+        opts = argv[argc - 1];
+        argc --;
+    } else {
+        opts = Qnil;
+    }
+
+    switch (argc) {
+    case 1:
+        *src = argv[0];
+        *maxdest = -1;
+        *dest = Qnil;
+        break;
+    case 2:
+        *src = argv[0];
+        if (mrb_string_p(argv[1])) {
+            *maxdest = -1;
+            *dest = argv[1];
+        } else {
+            *maxdest = (NIL_P(argv[1]) ? -1 : mrb_int(mrb, argv[1]));
+            *dest = Qnil;
+        }
+        break;
+    case 3:
+        *src = argv[0];
+        *maxdest = (NIL_P(argv[1]) ? -1 : mrb_int(mrb, argv[1]));
+        *dest = argv[2];
+        break;
+    default:
+        mrb_raisef(mrb,
+                   E_ARGUMENT_ERROR,
+                   "wrong number of arguments (given %S, expect 1..3 with optional keywords)",
+                   mrb_fixnum_value(argc));
+        break;
+    }
+
+    mrb_check_type(mrb, *src, MRB_TT_STRING);
+
+    mrb_bool dupped = FALSE;
+    VALUE frames = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "frames")));
+    VALUE asize = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "frame_size")));
+    *threads = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "threads")));
+    *framesize = aux_frame_split_size(mrb, *src, frames, asize);
+
+    if (*framesize > 0) {
+        /* 出力先はフレームの数に応じて enc_s_encode_frames() で確保する */
+        if (NIL_P(*dest)) {
+            *dest = mrb_str_new(mrb, NULL, 0);
+        } else {
+            mrb_check_type(mrb, *dest, MRB_TT_STRING);
+            mrb_str_resize(mrb, *dest, 0);
+        }
+    } else {
+        if (*maxdest < 0) {
+            *maxdest = ZSTD_compressBound(RSTRING_LEN(*src));
+        }
+
+        if (NIL_P(*dest)) {
+            *dest = mrb_str_buf_new(mrb, *maxdest);
+        } else {
+            mrb_check_type(mrb, *dest, MRB_TT_STRING);
+            mrb_str_resize(mrb, *dest, *maxdest);
+        }
+
+        RSTR_SET_LEN(RSTRING(*dest), 0);
+    }
+
+    encode_kwargs(mrb, opts, *src, params, pledgedsize, dict);
+}
+
+struct encode_args
+{
+    ZSTD_CStream *zstd;
+    enum context_owner owner;
+    VALUE src, dest;
+    mrb_int maxdest;
+    struct encode_params *params;
+    mrb_int pledgedsize;
+    VALUE dict;
+    struct dictionary_cdict *cdict;
+};
+
+static VALUE
+enc_s_encode_main_body(MRB, VALUE args)
+{
+    struct encode_args *p = (struct encode_args *)mrb_cptr(args);
+
+    p->cdict = aux_init_cstream(mrb, p->zstd, p->dict, p->params, p->pledgedsize);
+
+    struct stats *st = get_stats_global(mrb);
+    ZSTD_inBuffer input = {
+        .src = RSTRING_PTR(p->src),
+        .size = RSTRING_LEN(p->src),
+        .pos = 0,
+    };
+    ZSTD_outBuffer output = {
+        .dst = RSTRING_PTR(p->dest),
+        .size = (p->maxdest < 0 ? RSTRING_CAPA(p->dest) : p->maxdest),
+        .pos = 0,
+    };
+
+    for (;;) {
+        size_t s = aux_compress_stream(st, p->zstd, &output, &input, ZSTD_e_end); /* 's' is Status */
+        aux_check_error(mrb, s, "ZSTD_compressStream2");
+        if (s == 0) { break; }
+        /* nbWorkers > 0 の場合は、出力に余裕があっても戻ってくることがある */
+        if (output.pos < output.size) { continue; }
+        if (p->maxdest >= 0) {
+            aux_zstd_error(mrb,
+                    AUX_ZSTD_ERROR(dstSize_tooSmall),
+                    "ZSTD_compressStream2");
+        }
+
+        /* expand dest */
+        s = aux_grow_size(mrb, RSTRING_CAPA(p->dest), "ZSTD_compressStream2"); /* 's' is Size */
+        mrb_str_resize(mrb, p->dest, s);
+        STATS_ADD(st, reallocs, 1);
+        output.dst = RSTRING_PTR(p->dest);
+        output.size = RSTRING_CAPA(p->dest);
+    }
+
+    RSTR_SET_LEN(RSTRING(p->dest), output.pos);
+
+    return Qnil;
+}
+
+static VALUE
+enc_s_encode_cleanup(MRB, VALUE args)
+{
+    struct encode_args *p = (struct encode_args *)mrb_cptr(args);
+
+    /* Zstd::Dictionary が先に解放されても参照が残らないようにする */
+    ZSTD_CCtx_reset(p->zstd, ZSTD_reset_session_only);
+    ZSTD_CCtx_refCDict(p->zstd, NULL);
+    dictionary_cdict_replace(mrb, &p->cdict, NULL);
+
+    switch (p->owner) {
+    case CONTEXT_POOLED:
+        context_pool_release_cctx(mrb, p->zstd);
+        break;
+    case CONTEXT_OWNED:
+        ZSTD_freeCCtx(p->zstd);
+        break;
+    default:
+        break;
+    }
+
+    return Qnil;
+}
+
+/*
+ * 並列圧縮用のコンテキストを作成する。
+ * ワーカースレッドからもメモリ確保が行われるため、mruby のアロケータは使わない。
+ */
+static ZSTD_CCtx *
+aux_create_mt_cctx(MRB)
+{
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (!cctx) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createCCtx failed"); }
+    return cctx;
+}
+
+/*
+ * zstd == NULL の場合は context pool から借りてくる。
+ */
+static void
+enc_s_encode_main(MRB, ZSTD_CStream *zstd, VALUE src, VALUE dest, mrb_int maxdest, struct encode_params *params, mrb_int pledgedsize, VALUE dict)
+{
+    enum context_owner owner = CONTEXT_BORROWED;
+
+    if (params->workers > 0) {
+        zstd = aux_create_mt_cctx(mrb);
+        owner = CONTEXT_OWNED;
+    } else if (!zstd) {
+        zstd = context_pool_acquire_cctx(mrb);
+        owner = CONTEXT_POOLED;
+    }
+
+    struct encode_args p = { zstd, owner, src, dest, maxdest, params, pledgedsize, dict };
+
+    VALUE argsp = mrb_cptr_value(mrb, &p);
+    mrb_ensure(mrb, enc_s_encode_main_body, argsp, enc_s_encode_cleanup, argsp);
+}
+
+static VALUE
+enc_s_encode_frames_body(MRB, VALUE args)
+{
+    struct batch *b = (struct batch *)mrb_cptr(args);
+    const char *src = RSTRING_PTR(b->src);
+    size_t srcsize = RSTRING_LEN(b->src);
+    size_t total = 0;
+
+    b->jobs = (struct batch_job *)mrb_calloc(mrb, b->njobs, sizeof(struct batch_job));
+    for (size_t i = 0; i < b->njobs; i ++) {
+        struct batch_job *job = &b->jobs[i];
+        size_t off = i * b->framesize;
+        job->src = src + off;
+        job->srcsize = CLAMP_MAX(srcsize - off, b->framesize);
+        job->destsize = ZSTD_compressBound(job->srcsize);
+        if (ZSTD_isError(job->destsize) || job->destsize > AUX_MALLOC_MAX - total) {
+            aux_zstd_error(mrb, AUX_ZSTD_ERROR(dstSize_tooSmall), "ZSTD_compressBound");
+        }
+        total += job->destsize;
+    }
+
+    /* 各フレームは ZSTD_compressBound() ごとに区切った位置に出力して、後で詰める */
+    mrb_str_resize(mrb, b->dest, total);
+    char *dest = RSTRING_PTR(b->dest);
+    for (size_t i = 0, off = 0; i < b->njobs; i ++) {
+        b->jobs[i].dest = dest + off;
+        off += b->jobs[i].destsize;
+    }
+
+    batch_run(mrb, b);
+
+    size_t pos = 0;
+    for (size_t i = 0; i < b->njobs; i ++) {
+        struct batch_job *job = &b->jobs[i];
+        if (ZSTD_isError(job->result)) {
+            RSTR_SET_LEN(RSTRING(b->dest), 0);
+            aux_zstd_error(mrb, job->result, "ZSTD_compress2");
+        }
+        memmove(dest + pos, job->dest, job->result);
+        pos += job->result;
+    }
+
+    mrb_str_resize(mrb, b->dest, pos);
+
+    return Qnil;
+}
+
+/*
+ * 入力を framesize ごとの独立したフレームに分割して圧縮する。
+ * 各フレームはワーカースレッドで並列に圧縮され、出力は連結されたフレーム列となる。
+ */
+static void
+enc_s_encode_frames(MRB, VALUE src, VALUE dest, mrb_int maxdest, struct encode_params *params, VALUE dict, mrb_int framesize, VALUE threads)
+{
+    size_t srcsize = RSTRING_LEN(src);
+    size_t nframes = (srcsize == 0 ? 1 : srcsize / framesize + (srcsize % framesize != 0 ? 1 : 0));
+
+    /* フレームごとに並列化するため、ZSTD_c_nbWorkers は使わない */
+    params->workers = params->jobsize = params->overlaplog = 0;
+
+    struct batch b;
+    memset(&b, 0, sizeof(b));
+    b.encode = TRUE;
+    b.src = src;
+    b.dest = dest;
+    b.dict = aux_to_dictionary(mrb, dict);
+    b.params = params;
+    b.framesize = framesize;
+    b.njobs = nframes;
+    b.nworkers = batch_count_workers(mrb, threads, aux_cpu_count(), nframes);
+
+    VALUE argsp = mrb_cptr_value(mrb, &b);
+    mrb_ensure(mrb, enc_s_encode_frames_body, argsp, batch_main_cleanup, argsp);
+
+    if (maxdest >= 0 && RSTRING_LEN(dest) > maxdest) {
+        mrb_str_resize(mrb, dest, 0);
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(dstSize_tooSmall), "ZSTD_compress2");
+    }
+}
+
+/*
+ * call-seq:
+ *  encode(source, buffer = "", opts = {}) -> buffer for zstd'd string
+ *  encode(source, maxsize, buffer = "", opts = {}) -> buffer for zstd'd string
+ *
+ * [source (string)]
+ *  Input data.
+ *
+ * [buffer (string OR nil)]
+ *  Output buffer. Must give a string object.
+ *
+ * [maxsize (positive integer OR nil)]
+ *  Maximum output buffer size.
+ *
+ *  Raise exception, if encoded data is over this size.
+ *
+ * [opts (hash)]
+ *  level:: zstd compression level (1 .. 22)
+ *  frames, frame_size:: split the source into independent frames (compressed in parallel)
+ *  threads:: number of native threads for frames/frame_size (default is number of CPUs)
+ */
+static VALUE
+enc_s_encode(MRB, VALUE self)
+{
+    struct encode_params params;
+    mrb_int pledgedsize;
+    VALUE src, dest, dict, threads;
+    mrb_int maxdest, framesize;
+    enc_s_encode_args(mrb, &src, &dest, &maxdest, &params, &pledgedsize, &dict, &framesize, &threads);
+
+    if (framesize > 0) {
+        enc_s_encode_frames(mrb, src, dest, maxdest, &params, dict, framesize, threads);
+    } else {
+        enc_s_encode_main(mrb, NULL, src, dest, maxdest, &params, pledgedsize, dict);
+    }
+
+    return dest;
+}
+
+struct encoder
+{
+    struct {
+        ZSTD_CStream *context;
+        ZSTD_customMem allocator;
+        ZSTD_inBuffer bufin;
+        struct dictionary_cdict *cdict; /* context が ZSTD_CCtx_refCDict している辞書 */
+    } zstd;
+
+    VALUE io;
+    VALUE outbuf;
+    VALUE outbuf2;      /* outbuf_mode: :double の場合の予備 */
+    size_t outbufsize;
+    size_t outpos;      /* coalesce: true の場合に、まだ outport へ渡していない長さ */
+    int outmode;
+    mrb_bool coalesce;
+
+    int fd;         /* 直接書き込む場合のファイル記述子 (使わない場合は -1) */
+    char *fdbuf;
+    mrb_bool nofd;  /* fd: false (reset で出力先を差し替えるときに用いる) */
+
+    mrb_bool staticctx; /* zstd.context が ZSTD_initStaticCStream によるもの (解放しない) */
+    void *workspace;    /* workspace: に整数か true を与えた場合に確保した領域 */
+
+    struct {
+        mrb_bool enabled;   /* adapt: true */
+        int level, minlevel, maxlevel;
+        size_t bytes;       /* 前回の判定から圧縮した入力の長さ */
+        uint64_t zstd_nsec; /* 前回の判定から ZSTD_compressStream2 に費やした時間 */
+        uint64_t port_nsec; /* 前回の判定から出力 (outport << data / write(2)) に費やした時間 */
+    } adapt;
+
+    struct stats stats;
+};
+
+/*
+ * outport に渡した outbuf の扱い
+ */
+enum encoder_outbuf_mode
+{
+    OUTBUF_REUSE,   /* 凍結されていなければ使い回す */
+    OUTBUF_DOUBLE,  /* 2 つを交互に使う (渡した outbuf は次の << を呼ぶまで書き換えない) */
+    OUTBUF_DONATE,  /* 渡した outbuf は手放し、毎回新しく確保する */
+};
+
+static void
+encoder_free(MRB, struct encoder *p)
+{
+    if (p->zstd.context && !p->staticctx) {
+        ZSTD_freeCStream(p->zstd.context);
+    }
+
+    dictionary_cdict_release(mrb, p->zstd.cdict);
+
+    mrb_free(mrb, p->workspace);
+    mrb_free(mrb, p->fdbuf);
+    mrb_free(mrb, p);
+}
+
+/*
+ * コンテキストを差し替える。以前のコンテキストと作業領域は解放する。
+ */
+static void
+encoder_replace_context(MRB, struct encoder *p, ZSTD_CCtx *cctx, mrb_bool isstatic, void *workspace)
+{
+    if (p->zstd.context && !p->staticctx) {
+        ZSTD_freeCStream(p->zstd.context);
+    }
+
+    p->zstd.context = cctx;
+    p->staticctx = isstatic;
+    dictionary_cdict_replace(mrb, &p->zstd.cdict, NULL);
+
+    if (p->workspace != workspace) {
+        mrb_free(mrb, p->workspace);
+        p->workspace = workspace;
+    }
+}
+
+static const mrb_data_type encoder_type = {
+    .struct_name = "mruby_zstd.encoder",
+    .dfree = (void (*)(mrb_state *, void *))encoder_free,
+};
+
+static struct encoder *
+getencoder(MRB, VALUE self)
+{
+    struct encoder *p;
+    Data_Get_Struct(mrb, self, &encoder_type, p);
+    return p;
+}
+
+static VALUE
+encoder_set_outport(MRB, VALUE self, struct encoder *p, VALUE port)
+{
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.outport"), port);
+    p->io = port;
+    return port;
+}
+
+static VALUE
+encoder_set_outbuf(MRB, VALUE obj, struct encoder *p, VALUE val)
+{
+    p->outbuf = val;
+    mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-zstd.outbuf"), val);
+    return val;
+}
+
+static VALUE
+encoder_set_outbuf2(MRB, VALUE obj, struct encoder *p, VALUE val)
+{
+    p->outbuf2 = val;
+    mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-zstd.outbuf2"), val);
+    return val;
+}
+
+/*
+ * call-seq:
+ *  new(level = nil, prefs = {})
+ */
+static VALUE
+enc_s_new(MRB, VALUE self)
+{
+    struct RClass *klass = mrb_class_ptr(self);
+    struct RData *rd;
+    struct encoder *p;
+    Data_Make_Struct(mrb, klass, struct encoder, &encoder_type, p, rd);
+    p->io = p->outbuf = p->outbuf2 = Qnil;
+    p->fd = -1;
+    p->outbufsize = ZSTD_CStreamOutSize();
+    if (p->outbufsize > AUX_MALLOC_MAX) { p->outbufsize = AUX_MALLOC_MAX; }
+    p->zstd.allocator = aux_stats_allocator(mrb, &p->stats);
+    p->zstd.context = ZSTD_createCStream_advanced(p->zstd.allocator);
+
+    if (!p->zstd.context) {
+        mrb_raise(mrb,
+                  E_RUNTIME_ERROR,
+                  "ZSTD_createCStream_advanced failed");
+    }
+
+    VALUE obj = mrb_obj_value(rd);
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    mrb_funcall_argv(mrb, obj, mrb_intern_lit(mrb, "initialize"), argc, argv);
+
+    return obj;
+}
+
+static void
+enc_initialize_args(MRB, VALUE *outport, struct encode_params *params, mrb_int *pledgedsize, VALUE *dict,
+                    VALUE *fd, VALUE *outbufsize, VALUE *outbufmode, VALUE *coalesce, VALUE *workspace,
+                    VALUE *adapt, VALUE *minlevel, VALUE *maxlevel)
+{
+    mrb_int argc;
+    VALUE *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    VALUE opts;
+
+    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+        opts = argv[argc - 1];
+        argc --;
+    } else {
+        opts = Qnil;
+    }
+
+    switch (argc) {
+    case 1:
+        break;
+    default:
+        mrb_raisef(mrb,
+                   E_ARGUMENT_ERROR,
+                   "wrong arguments (given %S, expect ``initialize(outport, opts = {})'')",
+                   mrb_fixnum_value(argc));
+    }
+
+    *outport = argv[0];
+
+    mrb_bool dupped = FALSE;
+    *fd = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "fd")));
+    *outbufsize = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "outbuf_size")));
+    *outbufmode = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "outbuf_mode")));
+    *coalesce = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "coalesce")));
+    *workspace = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "workspace")));
+    *adapt = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "adapt")));
+    *minlevel = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "min_level")));
+    *maxlevel = aux_opts_take(mrb, &opts, &dupped, mrb_symbol_value(mrb_intern_lit(mrb, "max_level")));
+
+    encode_kwargs(mrb, opts, Qnil, params, pledgedsize, dict);
+}
+
+/*
+ * adapt: true の設定を確認し、初期の圧縮レベルを min_level から max_level の範囲に収める。
+ */
+static void
+encoder_init_adapt(MRB, struct encoder *p, struct encode_params *params, VALUE dict,
+                   VALUE workspace, VALUE adapt, VALUE minlevel, VALUE maxlevel)
+{
+    p->adapt.enabled = mrb_bool(adapt);
+
+    if (!p->adapt.enabled) {
+        if (!NIL_P(minlevel) || !NIL_P(maxlevel)) {
+            mrb_raise(mrb, E_ARGUMENT_ERROR, "min_level: and max_level: need adapt: true");
+        }
+        return;
+    }
+
+    int min = (NIL_P(minlevel) ? 1 : (int)mrb_int(mrb, minlevel));
+    int max = (NIL_P(maxlevel) ? 19 : (int)mrb_int(mrb, maxlevel));
+    if (min < ZSTD_minCLevel() || max > ZSTD_maxCLevel() || min > max) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong min_level and max_level (given %S..%S, expect in %S..%S)",
+                   mrb_fixnum_value(min), mrb_fixnum_value(max),
+                   mrb_fixnum_value(ZSTD_minCLevel()), mrb_fixnum_value(ZSTD_maxCLevel()));
+    }
+
+    /* ZSTD_CDict は作成時の圧縮レベルに固定され、静的なコンテキストは大きさが固定されるため */
+    if (aux_dictionary_ptr(mrb, dict)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "adapt: can not be used with Zstd::Dictionary (use a string for dict:)");
+    }
+    if (mrb_bool(workspace)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "adapt: can not be used with workspace:");
+    }
+
+    /*
+     * フレームの途中で圧縮レベルを変更できるのはマルチスレッド圧縮 (次のジョブから適用される) に限られる。
+     * シングルスレッドでフレームを区切ると、Zstd::Decoder#read を一度だけ呼ぶ利用者が途中までしか読めなくなる。
+     */
+    if (params->workers <= 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "adapt: needs workers: (zstd can change the level only between jobs)");
+    }
+
+    int level = (params->level == 0 ? ZSTD_CLEVEL_DEFAULT : params->level);
+    params->level = p->adapt.level = CLAMP_MAX(CLAMP_MIN(level, min), max);
+    p->adapt.minlevel = min;
+    p->adapt.maxlevel = max;
+    p->adapt.bytes = 0;
+    p->adapt.zstd_nsec = p->adapt.port_nsec = 0;
+}
+
+/*
+ * workspace: の領域に静的なコンテキストを作成する。
+ * 辞書が文字列であれば、その ZSTD_CDict も同じ領域に作成する (Zstd::Dictionary は共有する)。
+ */
+static void
+encoder_init_static(MRB, VALUE self, struct encoder *p, VALUE workspace, const struct encode_params *params, mrb_int pledgedsize, VALUE dict)
+{
+    if (params->workers > 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "workspace: can not be used with workers:");
+    }
+
+    /* ZSTD_estimateCStreamSize_usingCParams() は長距離一致のテーブルを含まない */
+    if (params->ldm > 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "workspace: can not be used with ldm:");
+    }
+
+    size_t ctxsize = ZSTD_estimateCStreamSize_usingCParams(aux_encode_cparams(mrb, params, 0, 0));
+    size_t dictsize = 0;
+    ZSTD_compressionParameters dparams;
+
+    if (mrb_string_p(dict)) {
+        dparams = aux_encode_cparams(mrb, params, 0, RSTRING_LEN(dict));
+        ctxsize = CLAMP_MIN(ctxsize, ZSTD_estimateCStreamSize_usingCParams(dparams));
+        dictsize = AUX_ALIGN8(ZSTD_estimateCDictSize_advanced(RSTRING_LEN(dict), dparams, ZSTD_dlm_byCopy));
+    }
+
+    char *ws;
+    size_t wssize;
+    void *owned;
+    aux_workspace(mrb, workspace, dictsize + ctxsize, &ws, &wssize, &owned);
+
+    /* 作業領域の先頭に辞書を、残りをコンテキストに割り当てる */
+    ZSTD_CCtx *cctx = ZSTD_initStaticCStream(ws + dictsize, wssize - dictsize);
+    if (!cctx) {
+        mrb_free(mrb, owned);
+        mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_initStaticCStream failed");
+    }
+
+    encoder_replace_context(mrb, p, cctx, TRUE, owned);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.workspace"), (mrb_string_p(workspace) ? workspace : Qnil));
+
+    p->zstd.cdict = aux_init_cstream(mrb, cctx, (mrb_string_p(dict) ? Qnil : dict), params, pledgedsize);
+
+    if (dictsize > 0) {
+        const ZSTD_CDict *cdict = ZSTD_initStaticCDict(ws, dictsize, RSTRING_PTR(dict), RSTRING_LEN(dict),
+                                                       ZSTD_dlm_byCopy, ZSTD_dct_auto, dparams);
+        if (!cdict) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_initStaticCDict failed"); }
+        aux_check_error(mrb, ZSTD_CCtx_refCDict(cctx, cdict), "ZSTD_CCtx_refCDict");
+    }
+}
+
+/*
+ * call-seq:
+ *  initialize(outport, level = nil, opts = {})
+ *
+ * If +outport+ responds to +fileno+ (e.g. File), compressed data is written
+ * to the file descriptor directly by write(2) instead of +outport << data+.
+ *
+ * [opts (hash)]
+ *  fd (integer OR false):: file descriptor to write (outport may be nil), or false to always use +<<+
+ *  outbuf_size (integer):: size of the output buffer (default is ZSTD_CStreamOutSize())
+ *  coalesce (true OR false)::
+ *    if true, +outport+ gets the output only when the buffer is full or on +flush+ / +close+
+ *  outbuf_mode (:reuse, :double OR :donate)::
+ *    :reuse (default) overwrites the string given to +outport << data+ on the next output
+ *    unless it is frozen.
+ *    :double uses two strings alternately, so the given string is kept until the next +<<+.
+ *    :donate gives the string to +outport+ and allocates a new one each time.
+ *  workspace (string, integer OR true)::
+ *    create the context in a fixed workspace (see ZSTD_initStaticCCtx) instead of allocating on demand.
+ *    A string is frozen and used as is, an integer allocates that many bytes,
+ *    and true allocates the size estimated from the parameters.
+ *    A dictionary given as a string is placed in the same workspace.
+ *    Can not be used with +workers+ or +ldm+.
+ *  adapt (true OR false)::
+ *    if true, the compression level follows how fast +outport+ drains (like zstd --adapt).
+ *    The time spent in +outport << data+ and in ZSTD_compressStream2 is compared
+ *    every MRUBY_ZSTD_ADAPT_INTERVAL (1 MiB) of input;
+ *    the level is raised when writing is slower and lowered when compressing is much slower.
+ *    Needs +workers+ (the new level applies from the next job), so the output stays a single frame.
+ *    Can not be used with a string +outport+ (the time spent appending can not be measured apart
+ *    from compressing), +workspace+ or Zstd::Dictionary.
+ *  min_level (integer):: lower limit of the level with +adapt+ (default is 1)
+ *  max_level (integer):: upper limit of the level with +adapt+ (default is 19)
+ */
+static VALUE
+enc_initialize(MRB, VALUE self)
+{
+    struct encode_params params;
+    mrb_int pledgedsize;
+    VALUE dict, port, fd, outbufsize, outbufmode, coalesce, workspace, adapt, minlevel, maxlevel;
+    enc_initialize_args(mrb, &port, &params, &pledgedsize, &dict, &fd, &outbufsize, &outbufmode, &coalesce, &workspace,
+                        &adapt, &minlevel, &maxlevel);
+    struct encoder *p = getencoder(mrb, self);
+
+    encoder_init_adapt(mrb, p, &params, dict, workspace, adapt, minlevel, maxlevel);
+
+    /* 文字列の末尾へ直接出力する場合は、出力に掛かる時間を圧縮と分けて測れないため */
+    if (p->adapt.enabled && mrb_string_p(port) && (NIL_P(fd) || mrb_type(fd) == MRB_TT_FALSE)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "adapt: can not be used with a string outport");
+    }
+
+    if (!NIL_P(outbufsize)) {
+        mrb_int n = mrb_int(mrb, outbufsize);
+        if (n < 1) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong outbuf_size (given %S, expect positive integer)", outbufsize);
+        }
+        p->outbufsize = CLAMP_MAX((size_t)n, AUX_MALLOC_MAX);
+    }
+
+    if (NIL_P(outbufmode) || mrb_obj_eq(mrb, outbufmode, mrb_symbol_value(mrb_intern_lit(mrb, "reuse")))) {
+        p->outmode = OUTBUF_REUSE;
+    } else if (mrb_obj_eq(mrb, outbufmode, mrb_symbol_value(mrb_intern_lit(mrb, "double")))) {
+        p->outmode = OUTBUF_DOUBLE;
+    } else if (mrb_obj_eq(mrb, outbufmode, mrb_symbol_value(mrb_intern_lit(mrb, "donate")))) {
+        p->outmode = OUTBUF_DONATE;
+    } else {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong outbuf_mode (given %S, expect :reuse, :double or :donate)",
+                   outbufmode);
+    }
+
+    p->coalesce = mrb_bool(coalesce);
+
+    if (mrb_bool(workspace)) {
+        encoder_init_static(mrb, self, p, workspace, &params, pledgedsize, dict);
+    } else {
+        if (params.workers > 0) {
+            encoder_replace_context(mrb, p, aux_create_mt_cctx(mrb), FALSE, NULL);
+        } else if (p->staticctx) {
+            ZSTD_CCtx *cctx = ZSTD_createCStream_advanced(p->zstd.allocator);
+            if (!cctx) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createCStream_advanced failed"); }
+            encoder_replace_context(mrb, p, cctx, FALSE, NULL);
+        }
+
+        mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.workspace"), Qnil);
+        dictionary_cdict_replace(mrb, &p->zstd.cdict, aux_init_cstream(mrb, p->zstd.context, dict, &params, pledgedsize));
+    }
+
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.dictionary"), dict);
+
+    encoder_set_outport(mrb, self, p, port);
+    encoder_set_outbuf(mrb, self, p, Qnil);
+    encoder_set_outbuf2(mrb, self, p, Qnil);
+    p->outpos = 0;
+
+    p->nofd = (!NIL_P(fd) && mrb_type(fd) == MRB_TT_FALSE);
+    p->fd = aux_port_fd(mrb, port, fd);
+    if (p->fd >= 0) {
+        p->fdbuf = (char *)mrb_realloc(mrb, p->fdbuf, p->outbufsize);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  reset(outport = nil, pledgedsize: nil) -> self
+ *
+ * Start a new frame reusing the context (see ZSTD_CCtx_reset).
+ * The allocated workspace, the parameters and the dictionary are kept.
+ * Data written after the last +close+ is discarded.
+ *
+ * If +outport+ is given, the following output goes to it.
+ */
+static VALUE
+enc_reset(MRB, VALUE self)
+{
+    VALUE *argv;
+    mrb_int argc;
+    VALUE pledgedsize = Qnil;
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+        MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
+                MRBX_SCANHASH_ARGS("pledgedsize", &pledgedsize, Qnil));
+        argc --;
+    }
+
+    if (argc > 1) {
+        mrb_raisef(mrb,
+                   E_ARGUMENT_ERROR,
+                   "wrong number of arguments (given %S, expect 0..1 with optional keywords)",
+                   mrb_fixnum_value(argc));
+    }
+
+    mrb_int size = (NIL_P(pledgedsize) ? -1 : mrb_int(mrb, pledgedsize));
+    if (size < 0 && !NIL_P(pledgedsize)) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong pledgedsize (given %S, expect nil or 0 and more)", pledgedsize);
+    }
+
+    struct encoder *p = getencoder(mrb, self);
+
+    if (p->adapt.enabled && argc > 0 && mrb_string_p(argv[0])) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "adapt: can not be used with a string outport");
+    }
+
+    aux_check_error(mrb, ZSTD_CCtx_reset(p->zstd.context, ZSTD_reset_session_only), "ZSTD_CCtx_reset");
+    aux_check_error(mrb,
+            ZSTD_CCtx_setPledgedSrcSize(p->zstd.context,
+                (size < 0 ? ZSTD_CONTENTSIZE_UNKNOWN : (unsigned long long)size)),
+            "ZSTD_CCtx_setPledgedSrcSize");
+
+    /* 出力しきれていないデータは捨てる */
+    p->outpos = 0;
+    p->adapt.bytes = 0;
+    p->adapt.zstd_nsec = p->adapt.port_nsec = 0;
+
+    if (argc > 0 && !NIL_P(argv[0])) {
+        encoder_set_outport(mrb, self, p, argv[0]);
+        p->fd = aux_port_fd(mrb, p->io, (p->nofd ? mrb_false_value() : Qnil));
+        if (p->fd >= 0 && !p->fdbuf) {
+            p->fdbuf = (char *)mrb_malloc(mrb, p->outbufsize);
+        }
+    }
+
+    return self;
+}
+
+/*
+ * 出力先のバッファを返す。
+ * 未出力のデータが残っている場合 (p->outpos > 0) は同じバッファを返す。
+ */
+static char *
+encoder_outbuf(MRB, VALUE self, struct encoder *p)
+{
+    if (p->fd >= 0) { return p->fdbuf; }
+
+    if (p->outpos == 0) {
+        if (NIL_P(p->outbuf) || MRB_FROZEN_P(RSTRING(p->outbuf))) {
+            encoder_set_outbuf(mrb, self, p, mrb_str_buf_new(mrb, p->outbufsize));
+        } else {
+            mrb_str_modify(mrb, RSTRING(p->outbuf));
+        }
+        mrb_str_resize(mrb, p->outbuf, p->outbufsize);
+    }
+
+    return RSTRING_PTR(p->outbuf);
+}
+
+/*
+ * バッファに溜まった p->outpos バイトを outport に渡す。
+ */
+static void
+encoder_emit(MRB, VALUE self, struct encoder *p)
+{
+    if (p->outpos < 1) { return; }
+
+    size_t size = p->outpos;
+    p->outpos = 0;
+
+    uint64_t start = (p->adapt.enabled ? aux_clock_nsec() : 0);
+
+    if (p->fd >= 0) {
+        aux_fd_write(mrb, p->fd, p->fdbuf, size);
+        if (p->adapt.enabled) { p->adapt.port_nsec += aux_clock_nsec() - start; }
+        return;
+    }
+
+    VALUE buf = p->outbuf;
+    RSTR_SET_LEN(RSTRING(buf), size);
+    STATS_ADD(&p->stats, port_calls, 1);
+    FUNCALL(mrb, p->io, ID_op_lshift, buf);
+    if (p->adapt.enabled) { p->adapt.port_nsec += aux_clock_nsec() - start; }
+
+    switch (p->outmode) {
+    case OUTBUF_DOUBLE:
+        encoder_set_outbuf(mrb, self, p, p->outbuf2);
+        encoder_set_outbuf2(mrb, self, p, buf);
+        break;
+    case OUTBUF_DONATE:
+        encoder_set_outbuf(mrb, self, p, Qnil);
+        break;
+    default:
+        break;
+    }
+}
+
+static size_t
+encoder_compress_stream(struct encoder *p, ZSTD_outBuffer *output, ZSTD_inBuffer *input, ZSTD_EndDirective end)
+{
+    if (!p->adapt.enabled) {
+        return aux_compress_stream(&p->stats, p->zstd.context, output, input, end);
+    }
+
+    size_t inpos = input->pos;
+    uint64_t start = aux_clock_nsec();
+    size_t s = aux_compress_stream(&p->stats, p->zstd.context, output, input, end);
+    p->adapt.zstd_nsec += aux_clock_nsec() - start;
+    p->adapt.bytes += input->pos - inpos;
+
+    return s;
+}
+
+/*
+ * adapt: true の場合に、前回の判定から MRUBY_ZSTD_ADAPT_INTERVAL 以上の入力を圧縮していれば圧縮レベルを見直す。
+ * 出力に費やした時間が圧縮に費やした時間を上回っていれば出力先が詰まっているとみなしてレベルを上げ、
+ * 圧縮に費やした時間が出力の 4 倍を超えていればレベルを下げる。
+ * 新しいレベルは次のジョブから適用される (adapt: は workers: を必要とする)。
+ */
+static void
+encoder_adapt(MRB, struct encoder *p)
+{
+    if (p->adapt.bytes < MRUBY_ZSTD_ADAPT_INTERVAL) { return; }
+
+    int level = p->adapt.level;
+    if (p->adapt.port_nsec > p->adapt.zstd_nsec) {
+        level = CLAMP_MAX(level + 1, p->adapt.maxlevel);
+    } else if (p->adapt.zstd_nsec / 4 > p->adapt.port_nsec) {
+        level = CLAMP_MIN(level - 1, p->adapt.minlevel);
+    }
+
+    if (level != p->adapt.level) {
+        AUX_CCTX_SET(mrb, p->zstd.context, ZSTD_c_compressionLevel, level, "level");
+        p->adapt.level = level;
+    }
+
+    p->adapt.bytes = 0;
+    p->adapt.zstd_nsec = p->adapt.port_nsec = 0;
+}
+
+/*
+ * 圧縮した出力を outport に書き出す。
+ * ZSTD_e_continue の場合は入力を全て消費するまで、それ以外の場合は全て出力し終えるまで繰り返す。
+ *
+ * outport が文字列であれば、その末尾に直接出力する。
+ * coalesce: true の場合は、バッファが埋まるか ZSTD_e_continue 以外の場合にだけ outport に渡す。
+ */
+static void
+encoder_compress(MRB, VALUE self, struct encoder *p, ZSTD_inBuffer *input, ZSTD_EndDirective end)
+{
+    int ai = mrb_gc_arena_save(mrb);
+
+    for (;;) {
+        mrb_gc_arena_restore(mrb, ai);
+
+        if (p->adapt.enabled && end == ZSTD_e_continue) {
+            encoder_adapt(mrb, p);
+        }
+
+        if (p->fd < 0 && mrb_string_p(p->io)) {
+            struct RString *strport = RSTRING(p->io);
+            if (aux_str_reserve_tail(mrb, strport, p->outbufsize, "ZSTD_compressStream2")) {
+                STATS_ADD(&p->stats, reallocs, 1);
+            }
+            size_t len = RSTR_LEN(strport);
+
+            ZSTD_outBuffer output = { .dst = RSTR_PTR(strport) + len, .size = RSTR_CAPA(strport) - len, .pos = 0 };
+            size_t s = encoder_compress_stream(p, &output, input, end);
+            aux_check_error(mrb, s, "ZSTD_compressStream2");
+            aux_str_set_len(strport, len + output.pos);
+
+            if (end == ZSTD_e_continue ? input->pos >= input->size : s == 0) { break; }
+            continue;
+        }
+
+        ZSTD_outBuffer output = { .dst = encoder_outbuf(mrb, self, p), .size = p->outbufsize, .pos = p->outpos };
+        size_t s = encoder_compress_stream(p, &output, input, end);
+        aux_check_error(mrb, s, "ZSTD_compressStream2");
+        p->outpos = output.pos;
+
+        mrb_bool done = (end == ZSTD_e_continue ? input->pos >= input->size : s == 0);
+
+        if (!p->coalesce || output.pos >= output.size || (done && end != ZSTD_e_continue)) {
+            encoder_emit(mrb, self, p);
+        }
+
+        if (done) { break; }
+    }
+}
+
+/*
+ * call-seq:
+ *  write(str) -> self
+ */
+static VALUE
+enc_write(MRB, VALUE self)
+{
+    VALUE src;
+    mrb_get_args(mrb, "S", &src);
+    struct encoder *p = getencoder(mrb, self);
+
+    /* 出力先の文字列を拡張すると入力が移動してしまうため */
+    if (mrb_obj_eq(mrb, src, p->io)) { src = mrb_str_dup(mrb, src); }
+
+    ZSTD_inBuffer input = { .src = RSTRING_PTR(src), .size = RSTRING_LEN(src), .pos = 0 };
+
+    if (input.size > 0) {
+        encoder_compress(mrb, self, p, &input, ZSTD_e_continue);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  flush -> self
+ */
+static VALUE
+enc_flush(MRB, VALUE self)
+{
+    ZSTD_inBuffer input = { 0 };
+    encoder_compress(mrb, self, getencoder(mrb, self), &input, ZSTD_e_flush);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  close -> nil
+ */
+static VALUE
+enc_close(MRB, VALUE self)
+{
+    ZSTD_inBuffer input = { 0 };
+    encoder_compress(mrb, self, getencoder(mrb, self), &input, ZSTD_e_end);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  level -> integer
+ *
+ * Return the current compression level (changes with +adapt: true+).
+ */
+static VALUE
+enc_level(MRB, VALUE self)
+{
+    int level;
+    aux_check_error(mrb,
+            ZSTD_CCtx_getParameter(getencoder(mrb, self)->zstd.context, ZSTD_c_compressionLevel, &level),
+            "ZSTD_CCtx_getParameter");
+
+    return mrb_fixnum_value(level);
+}
+
+/*
+ * call-seq:
+ *  get_port -> self
+ */
+static VALUE
+enc_get_port(MRB, VALUE self)
+{
+    return getencoder(mrb, self)->io;
+}
+
+/*
+ * call-seq:
+ *  progress -> hash
+ *
+ * Return the progression of current frame (see ZSTD_getFrameProgression).
+ *
+ *  { ingested: integer, consumed: integer, produced: integer, flushed: integer,
+ *    current_job_id: integer, active_workers: integer }
+ */
+static VALUE
+enc_progress(MRB, VALUE self)
+{
+    ZSTD_frameProgression prog = ZSTD_getFrameProgression(getencoder(mrb, self)->zstd.context);
+    VALUE hash = mrb_hash_new_capa(mrb, 6);
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "ingested")), aux_size_value(mrb, prog.ingested));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "consumed")), aux_size_value(mrb, prog.consumed));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "produced")), aux_size_value(mrb, prog.produced));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "flushed")), aux_size_value(mrb, prog.flushed));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "current_job_id")), mrb_fixnum_value(prog.currentJobID));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "active_workers")), mrb_fixnum_value(prog.nbActiveWorkers));
+
+    return hash;
+}
+
+/*
+ * call-seq:
+ *  flushable -> integer
+ *
+ * Return the size of compressed data that can be flushed without waiting
+ * for the workers (see ZSTD_toFlushNow).
+ * Always 0 with single thread compression.
+ */
+static VALUE
+enc_flushable(MRB, VALUE self)
+{
+    return mrb_fixnum_value(ZSTD_toFlushNow(getencoder(mrb, self)->zstd.context));
+}
+
+/*
+ * call-seq:
+ *  memsize -> integer
+ *
+ * Return the bytes currently allocated by the compression context
+ * (see ZSTD_sizeof_CStream) and the native output buffer.
+ * Output strings passed to +outport+ are not counted.
+ */
+static VALUE
+enc_memsize(MRB, VALUE self)
+{
+    struct encoder *p = getencoder(mrb, self);
+    size_t size = ZSTD_sizeof_CStream(p->zstd.context);
+    if (p->fdbuf) { size += p->outbufsize; }
+
+    return aux_size_value(mrb, size);
+}
+
+#if MRUBY_ZSTD_STATS
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ *  { bytes_in: integer, bytes_out: integer, zstd_calls: integer, zstd_nsec: integer,
+ *    port_calls: integer, reallocs: integer, alloc_bytes_total: integer }
+ *
+ * See Zstd.stats.
+ */
+static VALUE
+enc_stats(MRB, VALUE self)
+{
+    return stats_to_hash(mrb, &getencoder(mrb, self)->stats);
+}
+#endif
+
+static void
+init_encoder(MRB, struct RClass *mZstd)
+{
+    struct RClass *cEncoder = mrb_define_class_under(mrb, mZstd, "Encoder", mrb_cObject);
+    mrb_define_class_method(mrb, cEncoder, "encode", enc_s_encode, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cEncoder, "new", enc_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cEncoder, "initialize", enc_initialize, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cEncoder, "write", enc_write, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cEncoder, "flush", enc_flush, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "close", enc_close, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "reset", enc_reset, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cEncoder, "get_port", enc_get_port, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "progress", enc_progress, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "flushable", enc_flushable, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "memsize", enc_memsize, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "level", enc_level, MRB_ARGS_NONE());
+#if MRUBY_ZSTD_STATS
+    mrb_define_method(mrb, cEncoder, "stats", enc_stats, MRB_ARGS_NONE());
+#endif
+
+    mrb_define_alias(mrb, cEncoder, "<<", "write");
+    mrb_define_alias(mrb, cEncoder, "finish", "close");
+
+    mrb_define_const(mrb, cEncoder, "LEVEL_MIN", mrb_fixnum_value(1));
+#ifdef ZSTD_CLEVEL_DEFAULT
+    mrb_define_const(mrb, cEncoder, "LEVEL_DEFAULT", mrb_fixnum_value(ZSTD_CLEVEL_DEFAULT));
+#else
+    mrb_define_const(mrb, cEncoder, "LEVEL_DEFAULT", mrb_fixnum_value(3));
+#endif
+    mrb_define_const(mrb, cEncoder, "LEVEL_MAX", mrb_fixnum_value(ZSTD_maxCLevel()));
+}
+
+/*
+ * class Zstd::Decoder
+ */
+
+/*
+ * 伸長後の大きさが max_output (負であれば無制限) を超える場合に例外を発生させる。
+ */
+static void
+aux_check_max_output(MRB, unsigned long long size, mrb_int maxoutput)
+{
+    if (maxoutput >= 0 && size > (unsigned long long)maxoutput) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "decompressed data exceeds max_output (%S bytes)",
+                   mrb_fixnum_value(maxoutput));
+    }
+}
+
+/*
+ * フレームヘッダの伸長後の大きさは偽装できるため、伸長する前に確保する大きさは入力の大きさから制限する。
+ * これを超える分は伸長しながら拡張する。
+ */
+#define AUX_DECODE_PREALLOC_RATIO 32
+
+static size_t
+aux_decode_prealloc_limit(size_t srcsize)
+{
+    return (srcsize > AUX_MALLOC_MAX / AUX_DECODE_PREALLOC_RATIO ? AUX_MALLOC_MAX : srcsize * AUX_DECODE_PREALLOC_RATIO);
+}
+
+/*
+ * max_window_log: と max_output: を取り出す。
+ */
+static void
+aux_decode_limits(MRB, VALUE awindowlogmax, VALUE amaxoutput, int *windowlogmax, mrb_int *maxoutput)
+{
+    *windowlogmax = (NIL_P(awindowlogmax) ? 0 : (int)mrb_int(mrb, awindowlogmax));
+    if (*windowlogmax != 0) {
+        ZSTD_bounds b = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+        if (*windowlogmax < b.lowerBound || *windowlogmax > b.upperBound) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong max_window_log (given %S, expect %S..%S)",
+                       awindowlogmax, mrb_fixnum_value(b.lowerBound), mrb_fixnum_value(b.upperBound));
+        }
+    }
+
+    *maxoutput = (NIL_P(amaxoutput) ? -1 : mrb_int(mrb, amaxoutput));
+    if (*maxoutput < 0 && !NIL_P(amaxoutput)) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong max_output (given %S, expect nil or 0 and more)", amaxoutput);
+    }
+}
+
+static void
+dec_s_decode_args(MRB, VALUE *src, VALUE *dest, mrb_int *maxsize, unsigned long long *contentsize, VALUE *dict, VALUE *threads,
+                  int *windowlogmax, mrb_int *maxoutput)
+{
+    VALUE *argv;
+    mrb_int argc;
+    mrb_get_args(mrb, "S*", src, &argv, &argc);
+
+    VALUE awindowlogmax = Qnil, amaxoutput = Qnil;
+    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+        MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
+                MRBX_SCANHASH_ARGS("dict", dict, Qnil),
+                MRBX_SCANHASH_ARGS("threads", threads, Qnil),
+                MRBX_SCANHASH_ARGS("max_window_log", &awindowlogmax, Qnil),
+                MRBX_SCANHASH_ARGS("max_output", &amaxoutput, Qnil));
+        aux_check_dict(mrb, *dict);
+        argc --;
+    } else {
+        *dict = Qnil;
+        *threads = Qnil;
+    }
+
+    aux_decode_limits(mrb, awindowlogmax, amaxoutput, windowlogmax, maxoutput);
+
+    switch (argc) {
+    case 0:
+        *maxsize = -1;
+        *dest = Qnil;
+        break;
+    case 1:
+        if (mrb_string_p(argv[0])) {
+            *maxsize = -1;
+            *dest = argv[0];
+        } else {
+            *maxsize = mrb_int(mrb, argv[0]);
+            *dest = mrb_str_buf_new(mrb, *maxsize);
+        }
+        break;
+    case 2:
+        *maxsize = mrb_int(mrb, argv[0]);
+        *dest = argv[1];
+        break;
+    default:
+        mrb_raisef(mrb,
+                   E_ARGUMENT_ERROR,
+                   "wrong number of arguments (given %S, expect 1..3)",
+                   mrb_fixnum_value(argc + 1));
+        break;
+    }
+
+    size_t allocsize;
+    if (*maxsize < 0) {
+        /*
+         * 全てのフレームが伸長後の大きさを持っている場合は、一度で確保する。
+         * そうでなければ ZSTD_CONTENTSIZE_UNKNOWN か ZSTD_CONTENTSIZE_ERROR となる。
+         */
+        *contentsize = ZSTD_findDecompressedSize(RSTRING_PTR(*src), RSTRING_LEN(*src));
+        if (*contentsize < ZSTD_CONTENTSIZE_ERROR) {
+            /* 確保する前に確かめる */
+            aux_check_max_output(mrb, *contentsize, *maxoutput);
+        }
+
+        size_t limit = CLAMP_MIN(aux_decode_prealloc_limit(RSTRING_LEN(*src)), MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE);
+        if (*contentsize <= limit) {
+            allocsize = *contentsize;
+            /* 一度で伸長すると ZSTD_d_windowLogMax が効かないため、逐次処理する */
+            if (*windowlogmax != 0) { *contentsize = ZSTD_CONTENTSIZE_UNKNOWN; }
+        } else if (*contentsize < ZSTD_CONTENTSIZE_ERROR) {
+            *contentsize = ZSTD_CONTENTSIZE_UNKNOWN;
+            allocsize = limit;
+        } else {
+            *contentsize = ZSTD_CONTENTSIZE_UNKNOWN;
+            allocsize = MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE;
+        }
+    } else {
+        *contentsize = ZSTD_CONTENTSIZE_UNKNOWN;
+        allocsize = *maxsize;
+    }
+
+    if (*maxoutput >= 0 && allocsize > (size_t)*maxoutput + 1) {
+        allocsize = (size_t)*maxoutput + 1;
+    }
+
+    if (NIL_P(*dest)) {
+        *dest = mrb_str_buf_new(mrb, allocsize);
+    } else {
+        mrb_check_type(mrb, *dest, MRB_TT_STRING);
+        mrb_str_resize(mrb, *dest, allocsize);
+    }
+}
+
+struct decode_args
+{
+    ZSTD_DStream *zstd;
+    mrb_bool pooled;
+    VALUE src, dest;
+    mrb_int maxsize;
+    unsigned long long contentsize;
+    VALUE dict;
+    int windowlogmax;
+    mrb_int maxoutput;
+    mrb_int pos;
+};
+
+/*
+ * max_output を超えたことが分かるように、出力バッファは最大でも max_output + 1 バイトとする。
+ */
+static size_t
+aux_output_limit(size_t size, mrb_int maxoutput)
+{
+    if (maxoutput >= 0 && size > (size_t)maxoutput + 1) { return (size_t)maxoutput + 1; }
+    return size;
+}
+
+static VALUE
+decode_main_body(MRB, VALUE args)
+{
+    struct decode_args *p = (struct decode_args *)mrb_cptr(args);
+
+    if (p->contentsize != ZSTD_CONTENTSIZE_UNKNOWN) {
+        /* 伸長後の大きさが分かっているため、一度で伸長する */
+        uint64_t start = stats_clock();
+        p->pos = aux_decompress_dict(mrb, p->zstd,
+                RSTRING_PTR(p->dest), p->contentsize,
+                RSTRING_PTR(p->src), RSTRING_LEN(p->src),
+                p->dict);
+        stats_count(get_stats_global(mrb), start, RSTRING_LEN(p->src), p->pos);
+
+        return Qnil;
+    }
+
+    aux_init_dstream(mrb, p->zstd, p->dict);
+    aux_check_error(mrb, ZSTD_DCtx_setParameter(p->zstd, ZSTD_d_windowLogMax, p->windowlogmax), "ZSTD_DCtx_setParameter (max_window_log)");
+
+    struct stats *st = get_stats_global(mrb);
+    ZSTD_inBuffer bufin = { .src = RSTRING_PTR(p->src), .size = RSTRING_LEN(p->src), .pos = 0, };
+    ZSTD_outBuffer bufout = {
+        .dst = RSTRING_PTR(p->dest),
+        .size = aux_output_limit((p->maxsize < 0 ? RSTRING_CAPA(p->dest) : p->maxsize), p->maxoutput),
+        .pos = 0,
+    };
+
+    for (;;) {
+        size_t s = aux_decompress_stream(st, p->zstd, &bufout, &bufin);
+        p->pos = bufout.pos;
+        aux_check_error(mrb, s, "ZSTD_decompressStream");
+        aux_check_max_output(mrb, bufout.pos, p->maxoutput);
+
+        if (s == 0 && bufin.pos >= bufin.size) { break; }
+        if (p->maxsize >= 0) { break; }
+        if (bufout.pos >= AUX_MALLOC_MAX) { break; }
+        if (bufout.pos < bufout.size) {
+            if (bufin.pos >= bufin.size) {
+                /* 入力が途中で途切れている */
+                aux_zstd_error(mrb, AUX_ZSTD_ERROR(srcSize_wrong), "ZSTD_decompressStream");
+            }
+
+            continue;
+        }
+
+        /* dest を拡張する */
+
+        s = aux_grow_size(mrb, RSTRING_CAPA(p->dest), "ZSTD_decompressStream");
+        s = aux_output_limit(s, p->maxoutput);
+        mrb_str_resize(mrb, p->dest, s);
+        STATS_ADD(st, reallocs, 1);
+        bufout.dst = RSTRING_PTR(p->dest);
+        bufout.size = aux_output_limit(RSTRING_CAPA(p->dest), p->maxoutput);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+decode_main_ensure(MRB, VALUE args)
+{
+    struct decode_args *p = (struct decode_args *)mrb_cptr(args);
+
+    RSTR_SET_LEN(RSTRING(p->dest), p->pos);
+
+    /*
+     * Zstd::Dictionary が先に解放されても参照が残らないようにする。
+     * max_window_log も次の利用者に持ち越さないように、パラメータごと初期化する。
+     */
+    ZSTD_DCtx_reset(p->zstd, ZSTD_reset_session_and_parameters);
+
+    if (p->pooled) {
+        context_pool_release_dctx(mrb, p->zstd);
+    }
+
+    return Qnil;
+}
+
+/*
+ * zstd == NULL の場合は context pool から借りてくる。
+ */
+static void
+decode_main(MRB, ZSTD_DStream *zstd, VALUE src, VALUE dest, mrb_int maxsize, unsigned long long contentsize, VALUE dict,
+            int windowlogmax, mrb_int maxoutput)
+{
+    mrb_bool pooled = FALSE;
+
+    if (!zstd) {
+        zstd = context_pool_acquire_dctx(mrb);
+        pooled = TRUE;
+    }
+
+    struct decode_args args = { zstd, pooled, src, dest, maxsize, contentsize, dict, windowlogmax, maxoutput, 0 };
+
+    VALUE argsp = mrb_cptr_value(mrb, &args);
+    mrb_ensure(mrb, decode_main_body, argsp, decode_main_ensure, argsp);
+}
+
+static VALUE
+decode_frames_body(MRB, VALUE args)
+{
+    struct batch *b = (struct batch *)mrb_cptr(args);
+    const char *src = RSTRING_PTR(b->src);
+    size_t srcsize = RSTRING_LEN(b->src);
+    char *dest = RSTRING_PTR(b->dest);
+    size_t destpos = 0;
+
+    b->jobs = (struct batch_job *)mrb_calloc(mrb, b->njobs, sizeof(struct batch_job));
+    for (size_t off = 0, i = 0; off < srcsize && i < b->njobs; ) {
+        size_t csize = ZSTD_findFrameCompressedSize(src + off, srcsize - off);
+        unsigned long long dsize = ZSTD_getFrameContentSize(src + off, csize);
+        if (dsize > 0) {
+            struct batch_job *job = &b->jobs[i ++];
+            job->src = src + off;
+            job->srcsize = csize;
+            job->dest = dest + destpos;
+            job->destsize = dsize;
+            destpos += dsize;
+        }
+        off += csize;
+    }
+
+    batch_run(mrb, b);
+
+    for (size_t i = 0; i < b->njobs; i ++) {
+        struct batch_job *job = &b->jobs[i];
+        aux_check_error(mrb, job->result, "ZSTD_decompressDCtx");
+        if (job->result != job->destsize) {
+            aux_zstd_error(mrb, AUX_ZSTD_ERROR(corruption_detected), "ZSTD_decompressDCtx");
+        }
+    }
+
+    RSTR_SET_LEN(RSTRING(b->dest), destpos);
+
+    return Qnil;
+}
+
+/*
+ * 連結されたフレームを並列に伸長する。
+ * dest は伸長後の大きさ (contentsize) だけ確保済みであること。
+ * 並列化できない (フレームが 1 つしかない、threads: が 1 以下、など) 場合は何もせずに FALSE を返す。
+ */
+static mrb_bool
+decode_frames(MRB, VALUE src, VALUE dest, unsigned long long contentsize, VALUE dict, VALUE threads)
+{
+    if (NIL_P(threads) || contentsize == ZSTD_CONTENTSIZE_UNKNOWN) { return FALSE; }
+
+    const char *p = RSTRING_PTR(src);
+    size_t size = RSTRING_LEN(src);
+    size_t nframes = 0;
+    for (size_t off = 0; off < size; ) {
+        size_t csize = ZSTD_findFrameCompressedSize(p + off, size - off);
+        /* 壊れたフレームは逐次処理に任せてエラーを報告させる */
+        if (ZSTD_isError(csize)) { return FALSE; }
+        /* skippable frame と空のフレームは伸長する必要がない */
+        if (ZSTD_getFrameContentSize(p + off, csize) > 0) { nframes ++; }
+        off += csize;
+    }
+
+    int nworkers = batch_count_workers(mrb, threads, 1, nframes);
+    if (nworkers < 2) { return FALSE; }
+
+    struct batch b;
+    memset(&b, 0, sizeof(b));
+    b.encode = FALSE;
+    b.src = src;
+    b.dest = dest;
+    b.dict = aux_to_dictionary(mrb, dict);
+    b.njobs = nframes;
+    b.nworkers = nworkers;
+
+    VALUE argsp = mrb_cptr_value(mrb, &b);
+    mrb_ensure(mrb, decode_frames_body, argsp, batch_main_cleanup, argsp);
+
+    return TRUE;
+}
+
+/*
+ * call-seq:
+ *  decode(zstd_sequence, buffer = "", opts = {}) -> buffer
+ *  decode(zstd_sequence, maxsize, buffer = "", opts = {}) -> buffer
+ *
+ * [opts (hash)]
+ *  dict (nil, string OR Zstd::Dictionary):: decompression with dictionary
+ *  threads (integer):: decompress concatenated frames in parallel, if all frames have the content size
+ *  max_window_log (integer)::
+ *    reject frames whose window is larger than 2 ** max_window_log (see ZSTD_d_windowLogMax).
+ *    The input is then always decompressed in streaming mode (and +threads+ is ignored).
+ *  max_output (integer)::
+ *    raise an exception before the decompressed data exceeds this size
+ */
+static VALUE
+dec_s_decode(MRB, VALUE self)
+{
+    VALUE src, dest, dict, threads;
+    mrb_int maxsize, maxoutput;
+    int windowlogmax;
+    unsigned long long contentsize;
+    dec_s_decode_args(mrb, &src, &dest, &maxsize, &contentsize, &dict, &threads, &windowlogmax, &maxoutput);
+
+    if (!decode_frames(mrb, src, dest, contentsize, dict, threads)) {
+        decode_main(mrb, NULL, src, dest, maxsize, contentsize, dict, windowlogmax, maxoutput);
+    }
+
+    return dest;
+}
+
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+/*
+ * ファイル記述子からの先読みを行うスレッド。
+ * nslots 個の chunksize バイトの領域を環状に使い、伸長と並行して read(2) する。
+ */
+struct readahead
+{
+    int fd;
+    size_t chunksize;
+    unsigned int nslots;
+    char *bufs;             /* chunksize * nslots */
+    size_t *lens;           /* 各領域に読み込んだ大きさ */
+    unsigned int head;      /* 伸長側が次に使う (または使用中の) 位置 */
+    unsigned int count;     /* 読み込み済みの数 (使用中のものを含む) */
+    mrb_bool holding;       /* head を伸長側が使用中 */
+    mrb_bool eof;
+    mrb_bool stop;
+    int err;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+    pthread_t thread;
+};
+
+static void *
+readahead_main(void *arg)
+{
+    struct readahead *ra = (struct readahead *)arg;
+
+    pthread_mutex_lock(&ra->mutex);
+    for (;;) {
+        while (ra->count >= ra->nslots && !ra->stop) {
+            pthread_cond_wait(&ra->writable, &ra->mutex);
+        }
+        if (ra->stop) { break; }
+        unsigned int slot = (ra->head + ra->count) % ra->nslots;
+        pthread_mutex_unlock(&ra->mutex);
+
+        /* stop を確認できるように、読み込めるようになるまで短い間隔で待つ */
+        struct pollfd pfd = { .fd = ra->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, 50);
+        ssize_t n = 0;
+        int err = 0;
+
+        if (ready > 0 || (ready < 0 && errno != EINTR)) {
+            n = read(ra->fd, ra->bufs + ra->chunksize * slot, ra->chunksize);
+            if (n < 0) { err = errno; }
+        }
+
+        pthread_mutex_lock(&ra->mutex);
+        if (ready == 0 || (n < 0 && (err == EINTR || err == EAGAIN || err == EWOULDBLOCK))) {
+            continue;
+        }
+
+        if (n <= 0) {
+            ra->err = (n < 0 ? err : 0);
+            ra->eof = TRUE;
+            pthread_cond_signal(&ra->readable);
+            break;
+        }
+
+        ra->lens[slot] = (size_t)n;
+        ra->count ++;
+        pthread_cond_signal(&ra->readable);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+
+    return NULL;
+}
+
+static void
+readahead_free(MRB, struct readahead *ra)
+{
+    if (!ra) { return; }
+
+    pthread_mutex_lock(&ra->mutex);
+    ra->stop = TRUE;
+    pthread_cond_signal(&ra->writable);
+    pthread_mutex_unlock(&ra->mutex);
+    pthread_join(ra->thread, NULL);
+
+    pthread_cond_destroy(&ra->writable);
+    pthread_cond_destroy(&ra->readable);
+    pthread_mutex_destroy(&ra->mutex);
+    mrb_free(mrb, ra);
+}
+
+static struct readahead *
+readahead_new(MRB, int fd, size_t chunksize, unsigned int nslots)
+{
+    /* 構造体と lens と bufs をまとめて確保する */
+    size_t head = sizeof(struct readahead) + sizeof(size_t) * nslots;
+    if (chunksize > (AUX_MALLOC_MAX - head) / nslots) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "readsize * readahead is too large");
+    }
+
+    struct readahead *ra = (struct readahead *)mrb_malloc(mrb, head + chunksize * nslots);
+    memset(ra, 0, head);
+    ra->fd = fd;
+    ra->chunksize = chunksize;
+    ra->nslots = nslots;
+    ra->lens = (size_t *)(ra + 1);
+    ra->bufs = (char *)(ra->lens + nslots);
+
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->readable, NULL);
+    pthread_cond_init(&ra->writable, NULL);
+
+    if (pthread_create(&ra->thread, NULL, readahead_main, ra) != 0) {
+        pthread_cond_destroy(&ra->writable);
+        pthread_cond_destroy(&ra->readable);
+        pthread_mutex_destroy(&ra->mutex);
+        mrb_free(mrb, ra);
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed to create the read-ahead thread");
+    }
+
+    return ra;
+}
+
+/*
+ * 先読みした次の領域を返す。終端に達した場合は 0 を返す。
+ * 前回返した領域は、この時に読み込みスレッドに戻す。
+ */
+static size_t
+readahead_next(MRB, struct readahead *ra, const char **buf)
+{
+    pthread_mutex_lock(&ra->mutex);
+
+    if (ra->holding) {
+        ra->holding = FALSE;
+        ra->head = (ra->head + 1) % ra->nslots;
+        ra->count --;
+        pthread_cond_signal(&ra->writable);
+    }
+
+    while (ra->count == 0 && !ra->eof) {
+        pthread_cond_wait(&ra->readable, &ra->mutex);
+    }
+
+    size_t n = 0;
+    int err = 0;
+
+    if (ra->count > 0) {
+        ra->holding = TRUE;
+        *buf = ra->bufs + ra->chunksize * ra->head;
+        n = ra->lens[ra->head];
+    } else {
+        err = ra->err;
+        ra->err = 0;
+    }
+
+    pthread_mutex_unlock(&ra->mutex);
+
+    if (err != 0) {
+        errno = err;
+        mrb_sys_fail(mrb, "read");
+    }
+
+    return n;
+}
+#endif /* MRUBY_ZSTD_BATCH_THREADS */
+
+struct decoder
+{
+    struct {
+        ZSTD_DStream *context;
+        ZSTD_customMem allocator;
+        ZSTD_inBuffer bufin;
+    } zstd;
+
+    VALUE io;
+    VALUE dict;
+    VALUE inbuf;
+
+    size_t readsize;    /* 1 回に読み込む大きさ */
+
+    /* reset で入力元を差し替えるときのための、初期化時の指定 */
+    size_t chunksize;   /* readsize: */
+    int readchunks;     /* readahead: */
+    mrb_bool readthread;
+    mrb_bool usefileno; /* fd: true */
+
+    int windowlogmax;   /* max_window_log: (0 であれば既定値) */
+    mrb_int maxoutput;  /* max_output: (負であれば無制限) */
+
+    struct stats stats;
+
+    /* workspace: (ws[0 ... wsdictsize] に辞書を、残りにコンテキストを作成する) */
+    char *ws;
+    size_t wssize;
+    size_t wsdictsize;
+    void *workspace;    /* 整数か true を与えた場合に確保した領域 */
+
+    unsigned long long outtotal;    /* これまでに伸長したバイト数 (window に残っている分を含む) */
+    unsigned long long intotal;     /* bufin より前に消費した圧縮データのバイト数 */
+
+    /* gets や getc などのために伸長したデータ (window[winpos ... winlen] が未読) */
+    char *window;
+    size_t winsize;
+    size_t winpos;
+    size_t winlen;
+
+    int fd;         /* 直接読み込む場合のファイル記述子 (使わない場合は -1) */
+    char *fdbuf;
+    size_t fdbufsize;
+    void *map;      /* 通常ファイルを mmap した領域 */
+    size_t mapsize;
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    struct readahead *readahead;
+#endif
+};
+
+static void
+decoder_stop_readahead(MRB, struct decoder *p)
+{
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    struct readahead *ra = p->readahead;
+    p->readahead = NULL;
+    readahead_free(mrb, ra);
+#endif
+}
+
+static void
+decoder_unmap(struct decoder *p)
+{
+#ifndef _WIN32
+    if (p->map) {
+        munmap(p->map, p->mapsize);
+        p->map = NULL;
+        p->mapsize = 0;
+    }
+#endif
+}
+
+/*
+ * コンテキストとバッファをすべて解放する。
+ */
+static void
+decoder_release(MRB, struct decoder *p)
+{
+    if (p->zstd.context) {
+        /* 静的なコンテキストは作業領域ごと再利用するため、解放しない */
+        if (!p->ws) { ZSTD_freeDStream(p->zstd.context); }
+        p->zstd.context = NULL;
+    }
+
+    decoder_stop_readahead(mrb, p);
+    decoder_unmap(p);
+    mrb_free(mrb, p->fdbuf);
+    p->fdbuf = NULL;
+    p->fdbufsize = 0;
+    mrb_free(mrb, p->window);
+    p->window = NULL;
+    p->winsize = p->winpos = p->winlen = 0;
+    p->fd = -1;
+    p->zstd.bufin.src = "";
+    p->zstd.bufin.size = p->zstd.bufin.pos = 0;
+}
+
+static void
+decoder_free(MRB, struct decoder *p)
+{
+    decoder_release(mrb, p);
+    mrb_free(mrb, p->workspace);
+    mrb_free(mrb, p);
+}
+
+static const mrb_data_type decoder_type = {
+    .struct_name = "mruby_zstd.decoder",
+    .dfree = (void (*)(mrb_state *, void *))decoder_free,
+};
+
+static struct decoder *
+getdecoder(MRB, VALUE self)
+{
+    struct decoder *p;
+    Data_Get_Struct(mrb, self, &decoder_type, p);
+    return p;
+}
+
+static VALUE
+decoder_set_inport(MRB, VALUE self, struct decoder *p, VALUE port)
+{
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.inport"), port);
+    p->io = port;
+    return port;
+}
+
+static VALUE
+decoder_set_dict(MRB, VALUE self, struct decoder *p, VALUE dict)
+{
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.dictionary"), dict);
+    p->dict = dict;
+    return dict;
+}
+
+static VALUE
+decoder_set_inbuf(MRB, VALUE obj, struct decoder *p, VALUE buf)
+{
+    mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-zstd.outbuf"), buf);
+    p->inbuf = buf;
+    return buf;
+}
+
+static void
+decoder_create_context(MRB, struct decoder *p)
+{
+    if (p->zstd.context) { return; }
+
+    if (p->ws) {
+        p->zstd.context = ZSTD_initStaticDStream(p->ws + p->wsdictsize, p->wssize - p->wsdictsize);
+
+        if (!p->zstd.context) {
+            mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_initStaticDStream failed");
+        }
+
+        return;
+    }
+
+    p->zstd.context = ZSTD_createDStream_advanced(p->zstd.allocator);
+
+    if (!p->zstd.context) {
+        mrb_raise(mrb,
+                  E_RUNTIME_ERROR,
+                  "ZSTD_createDStream_advanced failed");
+    }
+}
+
+/*
+ * 辞書と max_window_log を設定する。
+ */
+static void
+decoder_init_context(MRB, struct decoder *p)
+{
+    if (p->wsdictsize > 0) {
+        const ZSTD_DDict *ddict = ZSTD_initStaticDDict(p->ws, p->wsdictsize, RSTRING_PTR(p->dict), RSTRING_LEN(p->dict),
+                                                       ZSTD_dlm_byCopy, ZSTD_dct_auto);
+        if (!ddict) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_initStaticDDict failed"); }
+        aux_check_error(mrb, ZSTD_initDStream_usingDDict(p->zstd.context, ddict), "ZSTD_initDStream_usingDDict");
+    } else {
+        aux_init_dstream(mrb, p->zstd.context, p->dict);
+    }
+    aux_check_error(mrb,
+            ZSTD_DCtx_setParameter(p->zstd.context, ZSTD_d_windowLogMax, p->windowlogmax),
+            "ZSTD_DCtx_setParameter (max_window_log)");
+}
+
+static void
+decoder_check_closed(MRB, struct decoder *p)
+{
+    if (!p->zstd.context) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "closed decoder");
+    }
+}
+
+/*
+ * bufin から output へ伸長し、伸長したバイト数を数える。
+ */
+static size_t
+decoder_decompress(MRB, struct decoder *p, ZSTD_outBuffer *output)
+{
+    decoder_check_closed(mrb, p);
+
+    size_t before = output->pos;
+    size_t s = aux_decompress_stream(&p->stats, p->zstd.context, output, &p->zstd.bufin);
+    aux_check_error(mrb, s, "ZSTD_decompressStream");
+    p->outtotal += output->pos - before;
+    aux_check_max_output(mrb, p->outtotal, p->maxoutput);
+
+    return s;
+}
+
+static VALUE
+dec_s_new(MRB, VALUE self)
+{
+    struct RClass *klass = mrb_class_ptr(self);
+    struct RData *rd;
+    struct decoder *p;
+    Data_Make_Struct(mrb, klass, struct decoder, &decoder_type, p, rd);
+    p->fd = -1;
+    p->zstd.allocator = aux_stats_allocator(mrb, &p->stats);
+    decoder_create_context(mrb, p);
+
+    VALUE obj = mrb_obj_value(rd);
+    decoder_set_inport(mrb, obj, p, Qnil);
+    decoder_set_inbuf(mrb, obj, p, Qnil);
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    mrb_funcall_argv(mrb, obj, mrb_intern_lit(mrb, "initialize"), argc, argv);
+
+    return obj;
+}
+
+static void
+dec_initialize_args(MRB, VALUE *inport, VALUE *dict, VALUE *fd, VALUE *readsize, VALUE *readahead, VALUE *readthread,
+                    VALUE *windowlogmax, VALUE *maxoutput, VALUE *workspace)
+{
+    VALUE *argv;
+    mrb_int argc;
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+        MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
+                MRBX_SCANHASH_ARGS("dict", dict, Qnil),
+                MRBX_SCANHASH_ARGS("fd", fd, Qnil),
+                MRBX_SCANHASH_ARGS("readsize", readsize, Qnil),
+                MRBX_SCANHASH_ARGS("readahead", readahead, Qnil),
+                MRBX_SCANHASH_ARGS("read_thread", readthread, Qnil),
+                MRBX_SCANHASH_ARGS("max_window_log", windowlogmax, Qnil),
+                MRBX_SCANHASH_ARGS("max_output", maxoutput, Qnil),
+                MRBX_SCANHASH_ARGS("workspace", workspace, Qnil));
+        aux_check_dict(mrb, *dict);
+        argc --;
+    } else {
+        *dict = Qnil;
+        *fd = Qnil;
+        *readsize = Qnil;
+        *readahead = Qnil;
+        *readthread = Qnil;
+        *windowlogmax = Qnil;
+        *maxoutput = Qnil;
+        *workspace = Qnil;
+    }
+
+    switch (argc) {
+    case 1:
+        *inport = argv[0];
+        break;
+    default:
+        mrb_raisef(mrb,
+                   E_ARGUMENT_ERROR,
+                   "wrong number of arguments (given %S, expect 1 with optional keywords)",
+                   mrb_fixnum_value(argc));
+        break;
+    }
+}
+
+/*
+ * 入力元のファイル記述子を求める。
+ * mruby-io の IO は読み込んだデータを内部に溜めていることがあるため、
+ * fd: に整数か true (p->io.fileno を用いる) を与えた場合に限って直接読み込む。
+ */
+static int
+decoder_port_fd(MRB, VALUE port, VALUE fd)
+{
+    if (mrb_fixnum_p(fd)) { return aux_port_fd(mrb, port, fd); }
+    if (mrb_type(fd) == MRB_TT_TRUE) { return aux_port_fd(mrb, port, Qnil); }
+    return -1;
+}
+
+/*
+ * p->io から読み込むように入力バッファを用意する。
+ * fd は初期化時の fd: の値。
+ */
+static void
+decoder_setup_input(MRB, VALUE self, struct decoder *p, VALUE fd)
+{
+    decoder_stop_readahead(mrb, p);
+    decoder_unmap(p);
+    p->winpos = p->winlen = 0;
+    p->outtotal = p->intotal = 0;
+    p->fd = (mrb_string_p(p->io) ? -1 : decoder_port_fd(mrb, p->io, fd));
+
+    if (mrb_string_p(p->io)) {
+        decoder_set_inbuf(mrb, self, p, Qnil);
+        p->zstd.bufin.src = RSTRING_PTR(p->io);
+        p->zstd.bufin.size = RSTRING_LEN(p->io);
+        p->zstd.bufin.pos = 0;
+    } else if (p->fd >= 0) {
+        decoder_set_inbuf(mrb, self, p, Qnil);
+#ifndef _WIN32
+        size_t head;
+        if (aux_fd_map(p->fd, &p->map, &p->mapsize, &head)) {
+            p->zstd.bufin.src = (p->map ? (const char *)p->map + head : "");
+            p->zstd.bufin.size = p->mapsize - head;
+            p->zstd.bufin.pos = 0;
+            /* 全体が bufin に収まっているため、以降は読み込まない */
+            p->fd = -1;
+        } else
+#endif
+        {
+            p->zstd.bufin.src = "";
+            p->zstd.bufin.size = 0;
+            p->zstd.bufin.pos = 0;
+
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+            if (p->readthread) {
+                p->readahead = readahead_new(mrb, p->fd, p->chunksize, (p->readchunks > 0 ? p->readchunks : 4));
+            } else
+#endif
+            {
+                p->readsize = CLAMP_MAX(p->chunksize * (p->readchunks > 0 ? p->readchunks : 1), AUX_MALLOC_MAX);
+                if (p->fdbufsize != p->readsize) {
+                    p->fdbuf = (char *)mrb_realloc(mrb, p->fdbuf, p->readsize);
+                    p->fdbufsize = p->readsize;
+                }
+                p->zstd.bufin.src = p->fdbuf;
+            }
+        }
+    } else {
+        p->readsize = CLAMP_MAX(p->chunksize * (p->readchunks > 0 ? p->readchunks : 1), AUX_MALLOC_MAX);
+        if (NIL_P(p->inbuf) || MRB_FROZEN_P(RSTRING(p->inbuf))) {
+            decoder_set_inbuf(mrb, self, p, mrb_str_buf_new(mrb, p->readsize));
+        }
+        p->zstd.bufin.src = RSTRING_PTR(p->inbuf);
+        p->zstd.bufin.size = 0;
+        p->zstd.bufin.pos = 0;
+    }
+}
+
+/*
+ * workspace: に応じて、静的なコンテキストのための作業領域を用意する。
+ * 必要な大きさは max_window_log (なければ ZSTD_WINDOWLOG_LIMIT_DEFAULT) から求める。
+ */
+static void
+decoder_setup_workspace(MRB, VALUE self, struct decoder *p, VALUE workspace)
+{
+    char *ws = NULL;
+    size_t wssize = 0, dictsize = 0;
+    void *owned = NULL;
+
+    if (mrb_bool(workspace)) {
+        int windowlog = (p->windowlogmax != 0 ? p->windowlogmax : ZSTD_WINDOWLOG_LIMIT_DEFAULT);
+        size_t ctxsize = ZSTD_estimateDStreamSize((size_t)1 << windowlog);
+        if (mrb_string_p(p->dict)) {
+            dictsize = AUX_ALIGN8(ZSTD_estimateDDictSize(RSTRING_LEN(p->dict), ZSTD_dlm_byCopy));
+        }
+
+        aux_workspace(mrb, workspace, dictsize + ctxsize, &ws, &wssize, &owned);
+    } else if (!p->ws) {
+        /* 動的なコンテキストのまま使い回す */
+        mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.workspace"), Qnil);
+        return;
+    }
+
+    if (p->zstd.context) {
+        if (!p->ws) { ZSTD_freeDStream(p->zstd.context); }
+        p->zstd.context = NULL;
+    }
+
+    mrb_free(mrb, p->workspace);
+    p->workspace = owned;
+    p->ws = ws;
+    p->wssize = wssize;
+    p->wsdictsize = dictsize;
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.workspace"), (mrb_string_p(workspace) ? workspace : Qnil));
+}
+
+/*
+ * call-seq:
+ *  initialize(input_stream, dict: nil, fd: nil) -> self
+ *
+ * If +fd+ is given, compressed data is read from the file descriptor directly
+ * by read(2) instead of +input_stream.read+.
+ * Regular files are mapped into memory by mmap(2).
+ * In this case, data already buffered by +input_stream+ is not seen,
+ * and the file offset is left unspecified afterwards.
+ *
+ * [fd (integer, true OR nil)]
+ *  file descriptor to read (input_stream may be nil), or true to use +input_stream.fileno+.
+ *  Without this, +input_stream.read+ is always used.
+ * [readsize (integer)]
+ *  bytes requested per refill (default is ZSTD_DStreamInSize())
+ * [readahead (integer)]
+ *  number of +readsize+ chunks read ahead.
+ *  Without +read_thread+, each refill requests +readsize * readahead+ bytes.
+ * [read_thread (true OR false)]
+ *  read the file descriptor on a background native thread (need ZSTD_MULTITHREAD),
+ *  overlapping I/O with decompression. Regular files are mapped instead.
+ * [max_window_log (integer)]
+ *  reject frames whose window is larger than 2 ** max_window_log (see ZSTD_d_windowLogMax)
+ * [max_output (integer)]
+ *  raise an exception when the decompressed data exceeds this size (counted until +reset+)
+ * [workspace (string, integer OR true)]
+ *  create the context in a fixed workspace (see ZSTD_initStaticDCtx) instead of allocating on demand.
+ *  A string is frozen and used as is, an integer allocates that many bytes,
+ *  and true allocates the size needed for +max_window_log+ (give it, the default limit is large).
+ *  A dictionary given as a string is placed in the same workspace.
+ */
+static VALUE
+dec_initialize(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+    VALUE dict, fd, areadsize, areadahead, readthread, windowlogmax, maxoutput, workspace;
+    dec_initialize_args(mrb, &p->io, &dict, &fd, &areadsize, &areadahead, &readthread, &windowlogmax, &maxoutput, &workspace);
+    decoder_set_inport(mrb, self, p, p->io);
+    decoder_set_dict(mrb, self, p, dict);
+
+#ifdef MRB_INT16
+    size_t readsize = MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE;
+#else
+    size_t readsize = ZSTD_DStreamInSize();
+#endif
+    if (!NIL_P(areadsize)) {
+        mrb_int n = mrb_int(mrb, areadsize);
+        if (n < 1) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong readsize (given %S, expect positive integer)", areadsize);
+        }
+        readsize = (size_t)n;
+    }
+
+    mrb_int readahead = (NIL_P(areadahead) ? 0 : mrb_int(mrb, areadahead));
+    if (readahead < 0 || readahead > 1024) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong readahead (given %S, expect 1..1024)", areadahead);
+    }
+
+    p->chunksize = readsize;
+    p->readchunks = (int)readahead;
+    p->readthread = mrb_bool(readthread);
+    p->usefileno = (mrb_type(fd) == MRB_TT_TRUE);
+    aux_decode_limits(mrb, windowlogmax, maxoutput, &p->windowlogmax, &p->maxoutput);
+
+    decoder_setup_workspace(mrb, self, p, workspace);
+    decoder_create_context(mrb, p);
+    decoder_setup_input(mrb, self, p, fd);
+    decoder_init_context(mrb, p);
+
+    if (p->ws && !p->window) {
+        /* 以降の伸長で確保しないように、先に用意しておく */
+        p->winsize = ZSTD_DStreamOutSize();
+        p->window = (char *)mrb_malloc(mrb, p->winsize);
+    }
+
+    return self;
+}
+
+/*
+ * 入力バッファを補充する。それ以上の入力がない場合は偽を返す。
+ */
+static mrb_bool
+decoder_fill(MRB, VALUE self, struct decoder *p)
+{
+    p->intotal += p->zstd.bufin.pos;
+    p->zstd.bufin.size = p->zstd.bufin.pos = 0;
+
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    if (p->readahead) {
+        const char *buf = "";
+        size_t n = readahead_next(mrb, p->readahead, &buf);
+        p->zstd.bufin.src = buf;
+        p->zstd.bufin.size = n;
+        p->zstd.bufin.pos = 0;
+
+        return (n > 0);
+    }
+#endif
+
+    if (p->fd >= 0) {
+        size_t n = aux_fd_read(mrb, p->fd, p->fdbuf, p->fdbufsize);
+        p->zstd.bufin.src = p->fdbuf;
+        p->zstd.bufin.size = n;
+        p->zstd.bufin.pos = 0;
+
+        return (n > 0);
+    }
+
+    if (NIL_P(p->inbuf)) { return FALSE; }
+
+    STATS_ADD(&p->stats, port_calls, 1);
+    VALUE buf = FUNCALL(mrb, p->io, ID_read, mrb_fixnum_value(p->readsize), p->inbuf);
+    if (NIL_P(buf)) {
+        decoder_set_inbuf(mrb, self, p, Qnil);
+        return FALSE;
+    }
+
+    mrb_check_type(mrb, buf, MRB_TT_STRING);
+    decoder_set_inbuf(mrb, self, p, buf);
+    p->zstd.bufin.src = RSTRING_PTR(buf);
+    p->zstd.bufin.size = RSTRING_LEN(buf);
+    p->zstd.bufin.pos = 0;
+
+    if (RSTRING_LEN(buf) < 1) {
+        decoder_set_inbuf(mrb, self, p, Qnil);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+dec_read_args(MRB, VALUE self, intptr_t *size, struct RString **dest)
+{
+    mrbx_get_read_args(mrb, size, dest);
+
+    size_t allocsize = *size;
+
+    if (allocsize == -1) {
+        allocsize = ZSTD_DStreamOutSize() * 2;
+    }
+
+    if (allocsize > AUX_MALLOC_MAX) {
+        *size = AUX_MALLOC_MAX;
+        allocsize = AUX_MALLOC_MAX;
+    }
+
+    mrbx_str_reserve(mrb, *dest, allocsize);
+}
+
+/*
+ * call-seq:
+ *  read -> string OR nil
+ *  read(size) -> string OR nil
+ *  read(size, buffer) -> buffer OR nil
+ */
+static VALUE
+dec_read(MRB, VALUE self)
+{
+    intptr_t size;
+    struct RString *dest;
+    dec_read_args(mrb, self, &size, &dest);
+
+    struct decoder *p = getdecoder(mrb, self);
+    decoder_check_closed(mrb, p);
+
+    if (size == 0) { return mrb_obj_value(dest); }
+
+    /* gets などで伸長済みのデータを先に渡す */
+    size_t pending = p->winlen - p->winpos;
+    if (size >= 0 && pending > (size_t)size) { pending = size; }
+    if (pending > (size_t)RSTR_CAPA(dest)) { mrbx_str_reserve(mrb, dest, pending); }
+    memcpy(RSTR_PTR(dest), p->window + p->winpos, pending);
+    p->winpos += pending;
+
+    ZSTD_outBuffer bufout = {
+        .dst = RSTR_PTR(dest),
+        .size = (size < 0 ? RSTR_CAPA(dest) : size),
+        .pos = pending,
+    };
+
+    while (size == -1 || bufout.pos < size) {
+        /* 入力が尽きても、内部に残っている出力は取り出す */
+        mrb_bool drained = (p->zstd.bufin.pos >= p->zstd.bufin.size && !decoder_fill(mrb, self, p));
+
+        if (bufout.pos - bufout.size < 1) {
+            size_t s = RSTR_CAPA(dest);
+            if (s == AUX_MALLOC_MAX) { aux_zstd_error(mrb, AUX_ZSTD_ERROR(dstSize_tooSmall), "ZSTD_decompressStream"); }
+            s *= 2;
+            s = CLAMP_MAX(s, AUX_MALLOC_MAX);
+            mrbx_str_reserve(mrb, dest, s);
+            STATS_ADD(&p->stats, reallocs, 1);
+            bufout.dst = RSTR_PTR(dest);
+            bufout.size = RSTR_CAPA(dest);
+        }
+
+        {
+            size_t before = bufout.pos;
+            size_t s = decoder_decompress(mrb, p, &bufout);
+            if (s < 1) { break; }
+            if (drained && bufout.pos == before) { break; }
+        }
+    }
+
+    RSTR_SET_LEN(dest, bufout.pos);
+
+    return (bufout.pos == 0 ? Qnil : mrb_obj_value(dest));
+}
+
+/*
+ * 伸長済みのデータがなければ、次を伸長する。
+ * それ以上のデータがない場合は偽を返す。
+ */
+static mrb_bool
+decoder_fill_window(MRB, VALUE self, struct decoder *p)
+{
+    if (p->winpos < p->winlen) { return TRUE; }
+
+    decoder_check_closed(mrb, p);
+
+    if (!p->window) {
+        p->winsize = ZSTD_DStreamOutSize();
+        p->window = (char *)mrb_malloc(mrb, p->winsize);
+    }
+
+    p->winpos = p->winlen = 0;
+
+    for (;;) {
+        mrb_bool drained = (p->zstd.bufin.pos >= p->zstd.bufin.size && !decoder_fill(mrb, self, p));
+        ZSTD_outBuffer output = { .dst = p->window, .size = p->winsize, .pos = 0 };
+        decoder_decompress(mrb, p, &output);
+
+        if (output.pos > 0) {
+            p->winlen = output.pos;
+            return TRUE;
+        }
+
+        if (drained) { return FALSE; }
+    }
+}
+
+/*
+ * buf[0 ... end] の末尾と、既に取り出した tail[0 ... taillen] を繋げたものが sep で終わるか。
+ */
+static mrb_bool
+aux_sep_match(const char *tail, size_t taillen, const char *buf, size_t end, const char *sep, size_t seplen)
+{
+    size_t n = CLAMP_MAX(end, seplen);
+    if (memcmp(buf + end - n, sep + seplen - n, n) != 0) { return FALSE; }
+    if (n == seplen) { return TRUE; }
+
+    size_t rest = seplen - n;
+    return (taillen >= rest && memcmp(tail + taillen - rest, sep, rest) == 0);
+}
+
+static void
+decoder_skip_newlines(MRB, VALUE self, struct decoder *p)
+{
+    while (decoder_fill_window(mrb, self, p)) {
+        while (p->winpos < p->winlen && p->window[p->winpos] == '\n') { p->winpos ++; }
+        if (p->winpos < p->winlen) { break; }
+    }
+}
+
+/*
+ * sep (seplen バイト) までの 1 行を返す。
+ * sep が NULL の場合は終端まで、limit が負でなければ最大 limit バイトまで。
+ */
+static VALUE
+decoder_gets(MRB, VALUE self, struct decoder *p, const char *sep, size_t seplen, mrb_int limit, mrb_bool paragraph)
+{
+    if (limit == 0) { return mrb_str_new(mrb, NULL, 0); }
+    if (paragraph) { decoder_skip_newlines(mrb, self, p); }
+
+    VALUE line = Qnil;
+    mrb_bool found = FALSE;
+
+    while (!found && decoder_fill_window(mrb, self, p)) {
+        const char *avail = p->window + p->winpos;
+        size_t n = p->winlen - p->winpos;
+        size_t curlen = (NIL_P(line) ? 0 : RSTRING_LEN(line));
+
+        if (limit > 0 && n > (size_t)limit - curlen) { n = (size_t)limit - curlen; }
+
+        if (sep) {
+            for (size_t off = 0; off < n; ) {
+                const char *q = (const char *)memchr(avail + off, sep[seplen - 1], n - off);
+                if (!q) { break; }
+                size_t end = q - avail + 1;
+
+                if (aux_sep_match((NIL_P(line) ? "" : RSTRING_PTR(line)), curlen, avail, end, sep, seplen)) {
+                    n = end;
+                    found = TRUE;
+                    break;
+                }
+
+                off = end;
+            }
+        }
+
+        if (NIL_P(line)) {
+            line = mrb_str_new(mrb, avail, n);
+        } else {
+            mrb_str_cat(mrb, line, avail, n);
+        }
+        p->winpos += n;
+
+        if (limit > 0 && RSTRING_LEN(line) >= limit) { break; }
+    }
+
+    if (paragraph && !NIL_P(line)) { decoder_skip_newlines(mrb, self, p); }
+
+    return line;
+}
+
+static void
+dec_gets_args(MRB, VALUE *sep, mrb_int *limit, VALUE *block)
+{
+    VALUE a1 = Qnil, a2 = Qnil;
+    mrb_int argc = mrb_get_args(mrb, "|oo&", &a1, &a2, block);
+
+    *sep = mrb_str_new_lit(mrb, "\n");
+    *limit = -1;
+
+    switch (argc) {
+    case 0:
+        break;
+    case 1:
+        if (mrb_fixnum_p(a1)) {
+            *limit = mrb_fixnum(a1);
+        } else {
+            *sep = a1;
+        }
+        break;
+    default:
+        *sep = a1;
+        *limit = (NIL_P(a2) ? -1 : mrb_int(mrb, a2));
+        break;
+    }
+
+    if (!NIL_P(*sep)) { mrb_check_type(mrb, *sep, MRB_TT_STRING); }
+    if (*limit < 0) { *limit = -1; }
+}
+
+static VALUE
+dec_gets_main(MRB, VALUE self, VALUE sep, mrb_int limit)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    if (NIL_P(sep)) {
+        return decoder_gets(mrb, self, p, NULL, 0, limit, FALSE);
+    } else if (RSTRING_LEN(sep) == 0) {
+        return decoder_gets(mrb, self, p, "\n\n", 2, limit, TRUE);
+    } else {
+        return decoder_gets(mrb, self, p, RSTRING_PTR(sep), RSTRING_LEN(sep), limit, FALSE);
+    }
+}
+
+/*
+ * call-seq:
+ *  gets(sep = "\n", limit = nil) -> string OR nil
+ *  gets(limit) -> string OR nil
+ *
+ * Read a line including +sep+. If +sep+ is nil, read all the rest.
+ * If +sep+ is empty, read a paragraph.
+ */
+static VALUE
+dec_gets(MRB, VALUE self)
+{
+    VALUE sep, block;
+    mrb_int limit;
+    dec_gets_args(mrb, &sep, &limit, &block);
+
+    return dec_gets_main(mrb, self, sep, limit);
+}
+
+/*
+ * call-seq:
+ *  each_line(sep = "\n", limit = nil) { |line| ... } -> self
+ *  each_line(sep = "\n", limit = nil) -> enumerator
+ */
+static VALUE
+dec_each_line(MRB, VALUE self)
+{
+    VALUE sep, block;
+    mrb_int limit;
+    dec_gets_args(mrb, &sep, &limit, &block);
+
+    if (NIL_P(block)) {
+        return FUNCALL(mrb, self, mrb_intern_lit(mrb, "to_enum"),
+                mrb_symbol_value(mrb_intern_lit(mrb, "each_line")),
+                sep, (limit < 0 ? Qnil : mrb_fixnum_value(limit)));
+    }
+
+    int ai = mrb_gc_arena_save(mrb);
+
+    for (;;) {
+        VALUE line = dec_gets_main(mrb, self, sep, limit);
+        if (NIL_P(line)) { break; }
+        mrb_yield(mrb, block, line);
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  each_chunk(size) { |chunk| ... } -> self
+ *  each_chunk(size) -> enumerator
+ *
+ * Yield the decompressed data in +size+ bytes (the last chunk may be shorter).
+ */
+static VALUE
+dec_each_chunk(MRB, VALUE self)
+{
+    mrb_int size;
+    VALUE block;
+    mrb_get_args(mrb, "i&", &size, &block);
+
+    if (size < 1) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong size (given %S, expect positive integer)", mrb_fixnum_value(size));
+    }
+
+    if (NIL_P(block)) {
+        return FUNCALL(mrb, self, mrb_intern_lit(mrb, "to_enum"),
+                mrb_symbol_value(mrb_intern_lit(mrb, "each_chunk")), mrb_fixnum_value(size));
+    }
+
+    struct decoder *p = getdecoder(mrb, self);
+    int ai = mrb_gc_arena_save(mrb);
+
+    for (;;) {
+        VALUE chunk = decoder_gets(mrb, self, p, NULL, 0, size, FALSE);
+        if (NIL_P(chunk)) { break; }
+        mrb_yield(mrb, block, chunk);
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return self;
+}
+
+/*
+ * ptr[0 ... len] を次に読み込まれるように戻す。
+ */
+static void
+decoder_unget(MRB, struct decoder *p, const char *ptr, size_t len)
+{
+    if (len < 1) { return; }
+
+    if (len <= p->winpos) {
+        p->winpos -= len;
+        memcpy(p->window + p->winpos, ptr, len);
+        return;
+    }
+
+    size_t rest = p->winlen - p->winpos;
+    if (len > AUX_MALLOC_MAX - rest) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "too large to push back");
+    }
+
+    if (rest + len > p->winsize) {
+        p->window = (char *)mrb_realloc(mrb, p->window, rest + len);
+        p->winsize = rest + len;
+        STATS_ADD(&p->stats, reallocs, 1);
+    }
+
+    memmove(p->window + len, p->window + p->winpos, rest);
+    memcpy(p->window, ptr, len);
+    p->winpos = 0;
+    p->winlen = rest + len;
+}
+
+/*
+ * call-seq:
+ *  getbyte -> integer OR nil
+ */
+static VALUE
+dec_getbyte(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    if (!decoder_fill_window(mrb, self, p)) { return Qnil; }
+
+    return mrb_fixnum_value((unsigned char)p->window[p->winpos ++]);
+}
+
+/*
+ * call-seq:
+ *  getc -> string OR nil
+ *
+ * Read a character (a UTF-8 sequence with MRB_UTF8_STRING, otherwise a byte).
+ */
+static VALUE
+dec_getc(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    if (!decoder_fill_window(mrb, self, p)) { return Qnil; }
+
+    char ch[4];
+    size_t len = 1;
+    ch[0] = p->window[p->winpos ++];
+
+#ifdef MRB_UTF8_STRING
+    unsigned char lead = (unsigned char)ch[0];
+    size_t need = (lead >= 0xf0 && lead < 0xf8 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1);
+
+    while (len < need && decoder_fill_window(mrb, self, p) &&
+           ((unsigned char)p->window[p->winpos] & 0xc0) == 0x80) {
+        ch[len ++] = p->window[p->winpos ++];
+    }
+
+    if (len < need) {
+        /* 不完全なバイト列であれば先頭の 1 バイトだけを返し、残りは戻す */
+        decoder_unget(mrb, p, ch + 1, len - 1);
+        len = 1;
+    }
+#endif
+
+    return mrb_str_new(mrb, ch, len);
+}
+
+/*
+ * call-seq:
+ *  each_byte { |byte| ... } -> self
+ *  each_byte -> enumerator
+ */
+static VALUE
+dec_each_byte(MRB, VALUE self)
+{
+    VALUE block;
+    mrb_get_args(mrb, "&", &block);
+
+    if (NIL_P(block)) {
+        return FUNCALL(mrb, self, mrb_intern_lit(mrb, "to_enum"),
+                mrb_symbol_value(mrb_intern_lit(mrb, "each_byte")));
+    }
+
+    struct decoder *p = getdecoder(mrb, self);
+    int ai = mrb_gc_arena_save(mrb);
+
+    while (decoder_fill_window(mrb, self, p)) {
+        mrb_yield(mrb, block, mrb_fixnum_value((unsigned char)p->window[p->winpos ++]));
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  ungetc(string) -> nil
+ *  ungetc(byte) -> nil
+ *
+ * Push back the string (or a byte) to be read next.
+ */
+static VALUE
+dec_ungetc(MRB, VALUE self)
+{
+    VALUE str;
+    mrb_get_args(mrb, "o", &str);
+    struct decoder *p = getdecoder(mrb, self);
+
+    char byte;
+    const char *ptr;
+    size_t len;
+
+    if (mrb_fixnum_p(str)) {
+        byte = (char)(mrb_fixnum(str) & 0xff);
+        ptr = &byte;
+        len = 1;
+    } else {
+        mrb_check_type(mrb, str, MRB_TT_STRING);
+        ptr = RSTRING_PTR(str);
+        len = RSTRING_LEN(str);
+    }
+
+    decoder_check_closed(mrb, p);
+    decoder_unget(mrb, p, ptr, len);
+
+    return Qnil;
+}
+
+/*
+ * 伸長したデータを最大 size バイト読み捨て、読み捨てたバイト数を返す。
+ * 伸長には window を使い回すため、文字列は確保しない。
+ */
+static unsigned long long
+decoder_skip(MRB, VALUE self, struct decoder *p, unsigned long long size)
+{
+    unsigned long long skipped = 0;
+
+    while (skipped < size && decoder_fill_window(mrb, self, p)) {
+        size_t n = p->winlen - p->winpos;
+        if (n > size - skipped) { n = (size_t)(size - skipped); }
+        p->winpos += n;
+        skipped += n;
+    }
+
+    return skipped;
+}
+
+/*
+ * 利用者から見た伸長済みデータの位置。
+ */
+static unsigned long long
+decoder_pos(struct decoder *p)
+{
+    size_t pending = p->winlen - p->winpos;
+
+    /* ungetc で読んだ以上に戻された場合 */
+    if (pending > p->outtotal) { return 0; }
+
+    return p->outtotal - pending;
+}
+
+/*
+ * call-seq:
+ *  skip(size) -> integer
+ *
+ * Discard +size+ bytes of decompressed data without allocating strings.
+ * Return the number of bytes actually skipped (shorter at end of stream).
+ */
+static VALUE
+dec_skip(MRB, VALUE self)
+{
+    mrb_int size;
+    mrb_get_args(mrb, "i", &size);
+
+    if (size < 0) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative size (given %S)", mrb_fixnum_value(size));
+    }
+
+    struct decoder *p = getdecoder(mrb, self);
+    decoder_check_closed(mrb, p);
+
+    return aux_size_value(mrb, decoder_skip(mrb, self, p, size));
+}
+
+static mrb_bool
+aux_seek_whence_cur(MRB, VALUE whence)
+{
+    if (NIL_P(whence)) { return FALSE; }
+
+    if (mrb_symbol_p(whence)) {
+        mrb_sym sym = mrb_symbol(whence);
+        if (sym == mrb_intern_lit(mrb, "SET") || sym == mrb_intern_lit(mrb, "set")) { return FALSE; }
+        if (sym == mrb_intern_lit(mrb, "CUR") || sym == mrb_intern_lit(mrb, "cur")) { return TRUE; }
+    } else {
+        switch (mrb_int(mrb, whence)) {
+        case 0: /* SEEK_SET */
+            return FALSE;
+        case 1: /* SEEK_CUR */
+            return TRUE;
+        }
+    }
+
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "wrong whence (given %S, expect SEEK_SET or SEEK_CUR)",
+               whence);
+
+    return FALSE;
+}
+
+/*
+ * call-seq:
+ *  seek(offset, whence = IO::SEEK_SET) -> 0
+ *
+ * Move forward in the decompressed data (as +skip+).
+ * +whence+ is IO::SEEK_SET, IO::SEEK_CUR, :SET or :CUR.
+ * Seeking backward or past the end of stream raises an exception.
+ */
+static VALUE
+dec_seek(MRB, VALUE self)
+{
+    mrb_int off;
+    VALUE whence = Qnil;
+    mrb_get_args(mrb, "i|o", &off, &whence);
+
+    struct decoder *p = getdecoder(mrb, self);
+    decoder_check_closed(mrb, p);
+
+    unsigned long long pos = decoder_pos(p);
+    unsigned long long target;
+
+    if (aux_seek_whence_cur(mrb, whence)) {
+        if (off < 0) {
+            mrb_raise(mrb, E_RUNTIME_ERROR, "can not seek backward");
+        }
+        target = pos + (unsigned long long)off;
+    } else {
+        if (off < 0 || (unsigned long long)off < pos) {
+            mrb_raise(mrb, E_RUNTIME_ERROR, "can not seek backward");
+        }
+        target = (unsigned long long)off;
+    }
+
+    if (decoder_skip(mrb, self, p, target - pos) < target - pos) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "seek past end of stream");
+    }
+
+    return mrb_fixnum_value(0);
+}
+
+/*
+ * call-seq:
+ *  pos -> integer
+ *
+ * Return the offset in the decompressed data.
+ */
+static VALUE
+dec_pos(MRB, VALUE self)
+{
+    return aux_size_value(mrb, decoder_pos(getdecoder(mrb, self)));
+}
+
+/*
+ * call-seq:
+ *  compressed_pos -> integer
+ *
+ * Return the number of compressed bytes consumed from the input so far
+ * (includes data consumed ahead of +pos+).
+ */
+static VALUE
+dec_compressed_pos(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    return aux_size_value(mrb, p->intotal + p->zstd.bufin.pos);
+}
+
+/*
+ * call-seq:
+ *  close -> nil
+ *
+ * Release the context and the buffers right away.
+ * The input port is not closed.
+ */
+static VALUE
+dec_close(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    /* 読まれずに捨てる分は pos に含めない */
+    p->outtotal = decoder_pos(p);
+    p->intotal += p->zstd.bufin.pos;
+    /* 先読みスレッドも、閉じられた (あるいは再利用された) ファイル記述子を読まないようにここで止める */
+    decoder_release(mrb, p);
+    decoder_set_inbuf(mrb, self, p, Qnil);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  reset(input_stream) -> self
+ *
+ * Read frames from +input_stream+ reusing the context (see ZSTD_DCtx_reset).
+ * The allocated buffers, the options given to +new+ and the dictionary are kept.
+ * Unread data from the previous input is discarded.
+ */
+static VALUE
+dec_reset(MRB, VALUE self)
+{
+    VALUE port;
+    mrb_get_args(mrb, "o", &port);
+    struct decoder *p = getdecoder(mrb, self);
+
+    if (p->zstd.context) {
+        aux_check_error(mrb, ZSTD_DCtx_reset(p->zstd.context, ZSTD_reset_session_only), "ZSTD_DCtx_reset");
+    } else {
+        /* close 済み */
+        decoder_create_context(mrb, p);
+        decoder_init_context(mrb, p);
+    }
+
+    decoder_set_inport(mrb, self, p, port);
+    decoder_setup_input(mrb, self, p, (p->usefileno ? mrb_true_value() : Qnil));
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  eof -> true OR false
+ *
+ * Return true if no more decompressed data.
+ * This may read and decompress the next block ahead.
+ */
+static VALUE
+dec_eof(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    return mrb_bool_value(!decoder_fill_window(mrb, self, p));
+}
+
+/*
+ * call-seq:
+ *  memsize -> integer
+ *
+ * Return the bytes currently allocated by the decompression context
+ * (see ZSTD_sizeof_DStream) and the native buffers (0 after +close+).
+ * Strings and memory mapped files are not counted.
+ */
+static VALUE
+dec_memsize(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+    size_t size = ZSTD_sizeof_DStream(p->zstd.context) + p->winsize + p->fdbufsize;
+#ifdef MRUBY_ZSTD_BATCH_THREADS
+    if (p->readahead) {
+        size += (p->readahead->chunksize + sizeof(size_t)) * p->readahead->nslots;
+    }
+#endif
+
+    return aux_size_value(mrb, size);
+}
+
+#if MRUBY_ZSTD_STATS
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * See Zstd::Encoder#stats and Zstd.stats.
+ */
+static VALUE
+dec_stats(MRB, VALUE self)
+{
+    return stats_to_hash(mrb, &getdecoder(mrb, self)->stats);
+}
+#endif
+
+/*
+ * call-seq:
+ *  get_port -> port
+ */
+static VALUE
+dec_get_port(MRB, VALUE self)
+{
+    return getdecoder(mrb, self)->io;
+}
+
+static void
+init_decoder(MRB, struct RClass *mZstd)
+{
+    struct RClass *cDecoder = mrb_define_class_under(mrb, mZstd, "Decoder", mrb_cObject);
+    mrb_define_class_method(mrb, cDecoder, "decode", dec_s_decode, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cDecoder, "new", dec_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDecoder, "initialize", dec_initialize, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDecoder, "read", dec_read, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDecoder, "gets", dec_gets, MRB_ARGS_OPT(2));
+    mrb_define_method(mrb, cDecoder, "each_line", dec_each_line, MRB_ARGS_OPT(2) | MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cDecoder, "each_chunk", dec_each_chunk, MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cDecoder, "getc", dec_getc, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "getbyte", dec_getbyte, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "each_byte", dec_each_byte, MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cDecoder, "ungetc", dec_ungetc, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cDecoder, "close", dec_close, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "reset", dec_reset, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cDecoder, "eof", dec_eof, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "skip", dec_skip, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cDecoder, "seek", dec_seek, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, cDecoder, "pos", dec_pos, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "compressed_pos", dec_compressed_pos, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "port", dec_get_port, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "memsize", dec_memsize, MRB_ARGS_NONE());
+#if MRUBY_ZSTD_STATS
+    mrb_define_method(mrb, cDecoder, "stats", dec_stats, MRB_ARGS_NONE());
+#endif
+
+    mrb_define_alias(mrb, cDecoder, "finish", "close");
+    mrb_define_alias(mrb, cDecoder, "eof?", "eof");
+    mrb_define_alias(mrb, cDecoder, "tell", "pos");
+}
+
+/*
+ * class Zstd::Context
+ */
+
+struct context
+{
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+};
+
+static void
+context_free(MRB, struct context *p)
+{
+    if (p->cctx) {
+        ZSTD_freeCCtx(p->cctx);
+    }
+
+    if (p->dctx) {
+        ZSTD_freeDCtx(p->dctx);
+    }
+
+    mrb_free(mrb, p);
+}
+
+static const mrb_data_type context_type = {
+    .struct_name = "mruby_zstd.context",
+    .dfree = (void (*)(mrb_state *, void *))context_free,
+};
+
+static struct context *
+getcontext(MRB, VALUE self)
+{
+    struct context *p;
+    Data_Get_Struct(mrb, self, &context_type, p);
+    return p;
+}
+
+static ZSTD_CCtx *
+context_get_cctx(MRB, struct context *p)
+{
+    if (!p->cctx) {
+        p->cctx = ZSTD_createCCtx_advanced(aux_zstd_allocator(mrb));
+        if (!p->cctx) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createCCtx_advanced failed"); }
+    }
+
+    return p->cctx;
+}
+
+static ZSTD_DCtx *
+context_get_dctx(MRB, struct context *p)
+{
+    if (!p->dctx) {
+        p->dctx = ZSTD_createDCtx_advanced(aux_zstd_allocator(mrb));
+        if (!p->dctx) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createDCtx_advanced failed"); }
+    }
+
+    return p->dctx;
+}
+
+static VALUE
+ctx_s_new(MRB, VALUE self)
+{
+    struct RClass *klass = mrb_class_ptr(self);
+    struct RData *rd;
+    struct context *p;
+    Data_Make_Struct(mrb, klass, struct context, &context_type, p, rd);
+
+    VALUE obj = mrb_obj_value(rd);
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    mrb_funcall_argv(mrb, obj, mrb_intern_lit(mrb, "initialize"), argc, argv);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  encode(source, buffer = "", opts = {}) -> buffer for zstd'd string
+ *  encode(source, maxsize, buffer = "", opts = {}) -> buffer for zstd'd string
+ *
+ * Same as Zstd::Encoder.encode, but uses the compression context owned by self.
+ */
+static VALUE
+ctx_encode(MRB, VALUE self)
+{
+    struct encode_params params;
+    mrb_int pledgedsize;
+    VALUE src, dest, dict, threads;
+    mrb_int maxdest, framesize;
+    enc_s_encode_args(mrb, &src, &dest, &maxdest, &params, &pledgedsize, &dict, &framesize, &threads);
+
+    if (framesize > 0) {
+        enc_s_encode_frames(mrb, src, dest, maxdest, &params, dict, framesize, threads);
+    } else {
+        ZSTD_CCtx *cctx = context_get_cctx(mrb, getcontext(mrb, self));
+        enc_s_encode_main(mrb, cctx, src, dest, maxdest, &params, pledgedsize, dict);
+    }
+
+    return dest;
+}
+
+/*
+ * call-seq:
+ *  decode(zstd_sequence, buffer = "", opts = {}) -> buffer
+ *  decode(zstd_sequence, maxsize, buffer = "", opts = {}) -> buffer
+ *
+ * Same as Zstd::Decoder.decode, but uses the decompression context owned by self.
+ */
+static VALUE
+ctx_decode(MRB, VALUE self)
+{
+    VALUE src, dest, dict, threads;
+    mrb_int maxsize, maxoutput;
+    int windowlogmax;
+    unsigned long long contentsize;
+    dec_s_decode_args(mrb, &src, &dest, &maxsize, &contentsize, &dict, &threads, &windowlogmax, &maxoutput);
+
+    if (!decode_frames(mrb, src, dest, contentsize, dict, threads)) {
+        ZSTD_DCtx *dctx = context_get_dctx(mrb, getcontext(mrb, self));
+        decode_main(mrb, dctx, src, dest, maxsize, contentsize, dict, windowlogmax, maxoutput);
+    }
+
+    return dest;
+}
+
+/*
+ * call-seq:
+ *  reset -> self
+ *
+ * Reset session and parameters.
+ * Allocated workspaces are kept.
+ */
+static VALUE
+ctx_reset(MRB, VALUE self)
+{
+    struct context *p = getcontext(mrb, self);
+
+    if (p->cctx) {
+        aux_check_error(mrb, ZSTD_CCtx_reset(p->cctx, ZSTD_reset_session_and_parameters), "ZSTD_CCtx_reset");
+    }
+
+    if (p->dctx) {
+        aux_check_error(mrb, ZSTD_DCtx_reset(p->dctx, ZSTD_reset_session_and_parameters), "ZSTD_DCtx_reset");
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  pool_limit -> integer
+ *
+ * Maximum number of idle contexts (each of compression and decompression)
+ * kept for one-shot Zstd.encode / Zstd.decode.
+ */
+static VALUE
+ctx_s_pool_limit(MRB, VALUE self)
+{
+    return mrb_fixnum_value(get_context_pool(mrb)->limit);
+}
+
+/*
+ * call-seq:
+ *  pool_limit = limit
+ *
+ * Idle contexts over the limit are freed immediately.
+ * Set 0 to disable the context pool.
+ */
+static VALUE
+ctx_s_set_pool_limit(MRB, VALUE self)
+{
+    mrb_int limit;
+    mrb_get_args(mrb, "i", &limit);
+
+    if (limit < 0) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "negative pool limit (given %S)",
+                   mrb_fixnum_value(limit));
+    }
+
+    context_pool_set_limit(mrb, get_context_pool(mrb), limit);
+
+    return mrb_fixnum_value(limit);
+}
+
+/*
+ * call-seq:
+ *  pool_size -> integer
+ *
+ * Number of idle contexts in the pool (compression and decompression).
+ */
+static VALUE
+ctx_s_pool_size(MRB, VALUE self)
+{
+    struct context_pool *p = get_context_pool(mrb);
+
+    return mrb_fixnum_value(p->ncctx + p->ndctx);
+}
+
+/*
+ * call-seq:
+ *  trim(keep = 0) -> nil
+ *
+ * Free idle contexts in the pool, leaving +keep+ of each.
+ */
+static VALUE
+ctx_s_trim(MRB, VALUE self)
+{
+    mrb_int keep = 0;
+    mrb_get_args(mrb, "|i", &keep);
+
+    context_pool_trim(get_context_pool(mrb), (keep < 0 ? 0 : keep));
+
+    return Qnil;
+}
+
+static void
+init_context(MRB, struct RClass *mZstd)
+{
+    struct RClass *cContext = mrb_define_class_under(mrb, mZstd, "Context", mrb_cObject);
+    mrb_define_class_method(mrb, cContext, "new", ctx_s_new, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cContext, "pool_limit", ctx_s_pool_limit, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, cContext, "pool_limit=", ctx_s_set_pool_limit, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, cContext, "pool_size", ctx_s_pool_size, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, cContext, "trim", ctx_s_trim, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cContext, "encode", ctx_encode, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cContext, "decode", ctx_decode, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cContext, "reset", ctx_reset, MRB_ARGS_NONE());
+
+    mrb_define_alias(mrb, cContext, "compress", "encode");
+    mrb_define_alias(mrb, cContext, "decompress", "decode");
+    mrb_define_alias(mrb, cContext, "uncompress", "decode");
+}
+
+/*
+ * module Zstd (frame inspection)
+ *
+ * コンテキストや出力バッファを確保せずに、フレームヘッダとフレームの長さを調べる。
+ */
+
+static VALUE
+aux_frame_info(MRB, VALUE src, mrb_int offset, size_t *framesizep)
+{
+    if (offset < 0 || offset > RSTRING_LEN(src)) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "offset is out of string (given %S, expect 0..%S)",
+                   mrb_fixnum_value(offset), mrb_fixnum_value(RSTRING_LEN(src)));
+    }
+
+    const char *p = RSTRING_PTR(src) + offset;
+    size_t size = RSTRING_LEN(src) - offset;
+
+    ZSTD_frameHeader header;
+    size_t s = ZSTD_getFrameHeader(&header, p, size);
+    aux_check_error(mrb, s, "ZSTD_getFrameHeader");
+    if (s > 0) {
+        /* フレームヘッダが途中で途切れている */
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(srcSize_wrong), "ZSTD_getFrameHeader");
+    }
+
+    size_t framesize = ZSTD_findFrameCompressedSize(p, size);
+    aux_check_error(mrb, framesize, "ZSTD_findFrameCompressedSize");
+    if (framesizep) { *framesizep = framesize; }
+
+    VALUE info = mrb_hash_new_capa(mrb, 10);
+    mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "offset")), mrb_fixnum_value(offset));
+    mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "frame_size")), aux_size_value(mrb, framesize));
+
+    if (header.frameType == ZSTD_skippableFrame) {
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "type")), mrb_symbol_value(mrb_intern_lit(mrb, "skippable")));
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "header_size")), mrb_fixnum_value(ZSTD_SKIPPABLEHEADERSIZE));
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "content_size")), aux_size_value(mrb, header.frameContentSize));
+        /* skippable frame の場合、dictID にはマジックナンバーの下位 4 ビットが格納される */
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "magic_variant")), mrb_fixnum_value(header.dictID));
+    } else {
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "type")), mrb_symbol_value(mrb_intern_lit(mrb, "frame")));
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "header_size")), mrb_fixnum_value(header.headerSize));
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "content_size")),
+                (header.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN ? Qnil : aux_size_value(mrb, header.frameContentSize)));
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "window_size")), aux_size_value(mrb, header.windowSize));
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "block_size_max")), aux_size_value(mrb, header.blockSizeMax));
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "dict_id")), aux_size_value(mrb, header.dictID));
+        mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "checksum")), mrb_bool_value(header.checksumFlag != 0));
+    }
+
+    return info;
+}
+
+/*
+ * call-seq:
+ *  frame_info(zstd_sequence, offset = 0) -> hash
+ *
+ * Parse the frame header at +offset+ without decompression.
+ *
+ * For zstd frame:
+ *
+ *  { offset: integer, frame_size: integer, type: :frame, header_size: integer,
+ *    content_size: integer OR nil, window_size: integer, block_size_max: integer,
+ *    dict_id: integer, checksum: true OR false }
+ *
+ * For skippable frame:
+ *
+ *  { offset: integer, frame_size: integer, type: :skippable, header_size: integer,
+ *    content_size: integer, magic_variant: integer }
+ *
+ * +frame_size+ is the compressed length of the whole frame (including the header).
+ */
+static VALUE
+frame_s_info(MRB, VALUE self)
+{
+    VALUE src;
+    mrb_int offset = 0;
+    mrb_get_args(mrb, "S|i", &src, &offset);
+
+    return aux_frame_info(mrb, src, offset, NULL);
+}
+
+/*
+ * call-seq:
+ *  each_frame(zstd_sequence) { |frame_info| ... } -> zstd_sequence
+ *  each_frame(zstd_sequence) -> array of frame_info
+ *
+ * Iterate the concatenated frames. See Zstd.frame_info.
+ */
+static VALUE
+frame_s_each(MRB, VALUE self)
+{
+    VALUE src, block;
+    mrb_get_args(mrb, "S&", &src, &block);
+
+    VALUE list = (NIL_P(block) ? mrb_ary_new(mrb) : Qnil);
+    int ai = mrb_gc_arena_save(mrb);
+
+    /* NOTE: ブロック内で文字列が変更されても良いように、毎回 RSTRING_LEN を確認する */
+    for (mrb_int offset = 0; offset < RSTRING_LEN(src); ) {
+        size_t framesize;
+        VALUE info = aux_frame_info(mrb, src, offset, &framesize);
+        offset += framesize;
+
+        if (NIL_P(block)) {
+            mrb_ary_push(mrb, list, info);
+        } else {
+            mrb_yield(mrb, block, info);
+        }
+
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return (NIL_P(block) ? list : src);
+}
+
+static void
+init_frame(MRB, struct RClass *mZstd)
+{
+    mrb_define_class_method(mrb, mZstd, "frame_info", frame_s_info, MRB_ARGS_ARG(1, 1));
+    mrb_define_class_method(mrb, mZstd, "each_frame", frame_s_each, MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
+}
+
+/*
+ * module Zstd (memory estimation)
+ *
+ * 同時に使えるストリームの数を見積もるために、コンテキストが必要とするメモリ量を求める。
+ */
+
+/*
+ * call-seq:
+ *  estimate_encoder_memory(opts = {}) -> integer
+ *
+ * Estimate the bytes used by a streaming compression context (see ZSTD_estimateCStreamSize_usingCParams).
+ * Dictionaries and multi-threading (+workers+) are not counted.
+ *
+ * [opts (hash)]
+ *  level, windowlog, chainlog, hashlog, searchlog, minmatch, targetlength, strategy::
+ *    same as Zstd::Encoder#initialize
+ *  srcsize_hint (integer):: expected input size (smaller parameters may be chosen)
+ */
+static VALUE
+estimate_s_encoder(MRB, VALUE self)
+{
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "|H", &opts);
+
+    struct encode_params params;
+    mrb_int pledgedsize;
+    VALUE dict;
+    encode_kwargs(mrb, opts, Qnil, &params, &pledgedsize, &dict);
+
+    unsigned long long srcsize = (params.srcsizehint > 0 ? (unsigned long long)params.srcsizehint : 0);
+    ZSTD_compressionParameters cparams = aux_encode_cparams(mrb, &params, srcsize, 0);
+
+    return aux_size_value(mrb, ZSTD_estimateCStreamSize_usingCParams(cparams));
+}
+
+/*
+ * call-seq:
+ *  estimate_decoder_memory(zstd_sequence) -> integer
+ *  estimate_decoder_memory(windowlog: integer) -> integer
+ *
+ * Estimate the bytes used by a streaming decompression context
+ * (see ZSTD_estimateDStreamSize_fromFrame and ZSTD_estimateDStreamSize).
+ * +zstd_sequence+ needs the first frame header only.
+ */
+static VALUE
+estimate_s_decoder(MRB, VALUE self)
+{
+    VALUE src;
+    mrb_get_args(mrb, "o", &src);
+
+    if (mrb_hash_p(src)) {
+        VALUE windowlog;
+        MRBX_SCANHASH(mrb, src, Qnil,
+                MRBX_SCANHASH_ARGS("windowlog", &windowlog, Qnil));
+        if (NIL_P(windowlog)) {
+            mrb_raise(mrb, E_ARGUMENT_ERROR, "need windowlog: keyword");
+        }
+
+        mrb_int log = mrb_int(mrb, windowlog);
+        if (log < ZSTD_WINDOWLOG_MIN || log > ZSTD_WINDOWLOG_MAX) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong windowlog (given %S, expect %S..%S)",
+                       windowlog, mrb_fixnum_value(ZSTD_WINDOWLOG_MIN), mrb_fixnum_value(ZSTD_WINDOWLOG_MAX));
+        }
+
+        return aux_size_value(mrb, ZSTD_estimateDStreamSize((size_t)1 << log));
+    }
+
+    mrb_check_type(mrb, src, MRB_TT_STRING);
+    size_t s = ZSTD_estimateDStreamSize_fromFrame(RSTRING_PTR(src), RSTRING_LEN(src));
+    aux_check_error(mrb, s, "ZSTD_estimateDStreamSize_fromFrame");
+
+    return aux_size_value(mrb, s);
+}
+
+static void
+init_estimate(MRB, struct RClass *mZstd)
+{
+    mrb_define_class_method(mrb, mZstd, "estimate_encoder_memory", estimate_s_encoder, MRB_ARGS_OPT(1));
+    mrb_define_class_method(mrb, mZstd, "estimate_decoder_memory", estimate_s_decoder, MRB_ARGS_REQ(1));
+}
+
+/*
+ * module Zstd (instrumentation counters)
+ */
+
+#if MRUBY_ZSTD_STATS
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * Return the counters of this mruby interpreter (mrb_state).
+ * These sum up Zstd::Encoder, Zstd::Decoder and one-shot Zstd.encode / Zstd.decode.
+ *
+ *  { bytes_in: integer, bytes_out: integer, zstd_calls: integer, zstd_nsec: integer,
+ *    port_calls: integer, reallocs: integer, alloc_bytes_total: integer }
+ *
+ * [bytes_in, bytes_out] bytes consumed and produced by libzstd
+ * [zstd_calls] number of ZSTD_compressStream2 / ZSTD_decompressStream calls
+ * [zstd_nsec] nanoseconds elapsed in those calls (wall-clock of the calling thread)
+ * [port_calls] number of +outport << data+ and +inport.read+ calls
+ * [reallocs] number of output buffer expansions
+ * [alloc_bytes_total] cumulative bytes allocated by libzstd through the mruby allocator (frees are not subtracted)
+ */
+static VALUE
+stats_s_stats(MRB, VALUE self)
+{
+    struct stats *g = get_stats_global(mrb);
+    struct stats st = {
+        .bytes_in = STATS_ATOMIC_LOAD(g->bytes_in),
+        .bytes_out = STATS_ATOMIC_LOAD(g->bytes_out),
+        .zstd_calls = STATS_ATOMIC_LOAD(g->zstd_calls),
+        .zstd_nsec = STATS_ATOMIC_LOAD(g->zstd_nsec),
+        .port_calls = STATS_ATOMIC_LOAD(g->port_calls),
+        .reallocs = STATS_ATOMIC_LOAD(g->reallocs),
+        .alloc_bytes_total = STATS_ATOMIC_LOAD(g->alloc_bytes_total),
+    };
+
+    return stats_to_hash(mrb, &st);
+}
+
+/*
+ * call-seq:
+ *  reset_stats -> nil
+ */
+static VALUE
+stats_s_reset(MRB, VALUE self)
+{
+    /* ワーカースレッドが加算している最中かもしれないため、memset() は使わない */
+    struct stats *g = get_stats_global(mrb);
+    STATS_ATOMIC_STORE(g->bytes_in, 0);
+    STATS_ATOMIC_STORE(g->bytes_out, 0);
+    STATS_ATOMIC_STORE(g->zstd_calls, 0);
+    STATS_ATOMIC_STORE(g->zstd_nsec, 0);
+    STATS_ATOMIC_STORE(g->port_calls, 0);
+    STATS_ATOMIC_STORE(g->reallocs, 0);
+    STATS_ATOMIC_STORE(g->alloc_bytes_total, 0);
+
+    return Qnil;
+}
+#endif
+
+static void
+init_stats(MRB, struct RClass *mZstd)
+{
+#if MRUBY_ZSTD_STATS
+    struct stats_root *p;
+    struct RData *rd;
+    Data_Make_Struct(mrb, mrb_cObject, struct stats_root, &stats_root_type, p, rd);
+    p->stats.mrb = mrb;
+    mrb_iv_set(mrb, mrb_obj_value(mZstd), mrb_intern_lit(mrb, "mruby-zstd.stats"), mrb_obj_value(rd));
+
+    mrb_define_const(mrb, mZstd, "STATS_SUPPORTED", mrb_bool_value(TRUE));
+    mrb_define_class_method(mrb, mZstd, "stats", stats_s_stats, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, mZstd, "reset_stats", stats_s_reset, MRB_ARGS_NONE());
+#else
+    mrb_define_const(mrb, mZstd, "STATS_SUPPORTED", mrb_bool_value(FALSE));
+#endif
+}
+
+/*
+ * module Zstd (batch processing)
+ */
+
+static void
+batch_prepare_jobs(MRB, struct batch *b)
+{
+    b->jobs = (struct batch_job *)mrb_calloc(mrb, b->njobs, sizeof(struct batch_job));
+
+    int ai = mrb_gc_arena_save(mrb);
+    for (size_t i = 0; i < b->njobs; i ++) {
+        VALUE src = RARRAY_PTR(b->src)[i];
+        struct batch_job *job = &b->jobs[i];
+        VALUE dest;
+
+        job->src = RSTRING_PTR(src);
+        job->srcsize = RSTRING_LEN(src);
+
+        if (b->encode) {
+            size_t bound = ZSTD_compressBound(job->srcsize);
+            if (ZSTD_isError(bound) || bound > AUX_MALLOC_MAX) { bound = AUX_MALLOC_MAX; }
+            dest = mrb_str_buf_new(mrb, bound);
+            job->dest = RSTRING_PTR(dest);
+            job->destsize = bound;
+        } else {
+            unsigned long long size = ZSTD_findDecompressedSize(job->src, job->srcsize);
+            if (size <= aux_decode_prealloc_limit(job->srcsize)) {
+                dest = mrb_str_buf_new(mrb, size);
+                job->dest = RSTRING_PTR(dest);
+                job->destsize = size;
+            } else {
+                /*
+                 * ZSTD_CONTENTSIZE_UNKNOWN または ZSTD_CONTENTSIZE_ERROR の場合と、
+                 * 入力に比べて大きすぎる (偽装されている可能性がある) 場合は、ワーカーが伸長しながら確保する。
+                 */
+                dest = mrb_str_new(mrb, NULL, 0);
+            }
+        }
+
+        mrb_ary_push(mrb, b->dest, dest);
+        mrb_gc_arena_restore(mrb, ai);
+    }
+}
+
+static VALUE
+batch_main_body(MRB, VALUE args)
+{
+    struct batch *b = (struct batch *)mrb_cptr(args);
+
+    batch_prepare_jobs(mrb, b);
+    batch_run(mrb, b);
+
+    for (size_t i = 0; i < b->njobs; i ++) {
+        struct batch_job *job = &b->jobs[i];
+        VALUE dest = RARRAY_PTR(b->dest)[i];
+
+        if (ZSTD_isError(job->result)) {
+            aux_zstd_error(mrb, job->result,
+                    (b->encode ? "ZSTD_compress2" :
+                     job->dest ? "ZSTD_decompressDCtx" : "ZSTD_decompressStream"));
+        }
+
+        if (job->heap) {
+            mrb_str_cat(mrb, dest, job->heap, job->result);
+            free(job->heap);
+            job->heap = NULL;
+        } else {
+            mrb_str_resize(mrb, dest, job->result);
+        }
+    }
+
+    return b->dest;
+}
+
+static VALUE
+batch_main(MRB, mrb_bool encode)
+{
+    VALUE src, opts = Qnil;
+    mrb_get_args(mrb, "A|H", &src, &opts);
+
+    for (mrb_int i = 0; i < RARRAY_LEN(src); i ++) {
+        mrb_check_type(mrb, RARRAY_PTR(src)[i], MRB_TT_STRING);
+    }
+
+    VALUE threads = Qnil;
+    if (!NIL_P(opts)) {
+        opts = mrb_hash_dup(mrb, opts);
+        threads = mrb_hash_delete_key(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "threads")));
+    }
+
+    struct encode_params params;
+    VALUE dict = Qnil;
+    if (encode) {
+        /* NOTE: 入力ごとに大きさが決まるため、srcsize_hint と pledgedsize は受け付けない */
+        mrb_int pledgedsize;
+        encode_kwargs(mrb, opts, mrb_str_new(mrb, NULL, 0), &params, &pledgedsize, &dict);
+
+        /* 入力ごとに並列化するため、ZSTD_c_nbWorkers は使わない */
+        params.workers = params.jobsize = params.overlaplog = 0;
+    } else if (!NIL_P(opts)) {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("dict", &dict, Qnil));
+        aux_check_dict(mrb, dict);
+    }
+
+    dict = aux_to_dictionary(mrb, dict);
+
+    struct batch b;
+    memset(&b, 0, sizeof(b));
+    b.encode = encode;
+    b.src = src;
+    b.dest = mrb_ary_new_capa(mrb, RARRAY_LEN(src));
+    b.dict = dict;
+    b.params = &params;
+    b.njobs = RARRAY_LEN(src);
+    b.nworkers = batch_count_workers(mrb, threads, 1, b.njobs);
+
+    if (b.njobs == 0) { return b.dest; }
+
+    VALUE argsp = mrb_cptr_value(mrb, &b);
+    return mrb_ensure(mrb, batch_main_body, argsp, batch_main_cleanup, argsp);
+}
+
+/*
+ * call-seq:
+ *  encode_batch(sources, opts = {}) -> array of zstd'd strings
+ *
+ * Compress each string of +sources+ into an independent zstd frame.
+ * Results are returned in the same order as +sources+.
+ *
+ * [opts (hash)]
+ *  threads (integer):: number of native threads (requires ZSTD_MULTITHREAD; default is 1)
+ *  other options:: same as Zstd::Encoder.encode (except srcsize_hint, pledgedsize, workers, jobsize and overlaplog)
+ */
+static VALUE
+batch_s_encode(MRB, VALUE self)
+{
+    return batch_main(mrb, TRUE);
+}
+
+/*
+ * call-seq:
+ *  decode_batch(sources, opts = {}) -> array of strings
+ *
+ * Decompress each zstd'd string of +sources+.
+ * Results are returned in the same order as +sources+.
+ *
+ * [opts (hash)]
+ *  threads (integer):: number of native threads (requires ZSTD_MULTITHREAD; default is 1)
+ *  dict (nil, string OR Zstd::Dictionary):: decompression with dictionary
+ */
+static VALUE
+batch_s_decode(MRB, VALUE self)
+{
+    return batch_main(mrb, FALSE);
+}
+
+static void
+init_batch(MRB, struct RClass *mZstd)
+{
+    mrb_define_class_method(mrb, mZstd, "encode_batch", batch_s_encode, MRB_ARGS_ARG(1, 1));
+    mrb_define_class_method(mrb, mZstd, "decode_batch", batch_s_decode, MRB_ARGS_ARG(1, 1));
+}
+
+/*
+ * class Zstd::SeekableEncoder
+ * class Zstd::SeekableDecoder
+ *
+ * zstd の contrib/seekable_format と同じ形式を扱う。
+ *
+ *  [zstd frame] ... [zstd frame] [skippable frame (seek table)]
+ *
+ * seek table は、各フレームの圧縮後の大きさ (u32le)、伸長後の大きさ (u32le)、
+ * (checksum が有効な場合) 伸長後のデータの XXH64 の下位 32 ビット (u32le) を並べたものに、
+ * フレーム数 (u32le)、記述子 (u8)、SEEKABLE_MAGICNUMBER (u32le) からなる 9 バイトのフッタが続く。
+ */
+
+#define SEEKABLE_MAGICNUMBER        0x8F92EAB1U
+#define SEEKABLE_SKIPPABLE_MAGIC    (ZSTD_MAGIC_SKIPPABLE_START | 0x0E)
+#define SEEKABLE_FOOTER_SIZE        9
+#define SEEKABLE_MAXFRAMES          0x8000000U
+#define SEEKABLE_MAX_FRAME_SIZE     0x40000000U
+#define SEEKABLE_DEFAULT_FRAME_SIZE (1 << 20)
+#define SEEKABLE_DEFAULT_CACHE_SIZE 4
+
+static uint32_t
+aux_load_le32(const void *ptr)
+{
+    const unsigned char *p = (const unsigned char *)ptr;
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+aux_store_le32(void *ptr, uint32_t n)
+{
+    unsigned char *p = (unsigned char *)ptr;
+    p[0] = (unsigned char)(n >> 0);
+    p[1] = (unsigned char)(n >> 8);
+    p[2] = (unsigned char)(n >> 16);
+    p[3] = (unsigned char)(n >> 24);
+}
+
+struct seekable_entry
+{
+    uint32_t csize;
+    uint32_t dsize;
+    uint32_t checksum;
+};
+
+struct seekable_encoder
+{
+    ZSTD_CCtx *context;
+    struct dictionary_cdict *cdict;
+    VALUE io;
+    VALUE outbuf;
+    size_t outbufsize;
+    size_t framesize;
+    size_t frame_in, frame_out;
+    mrb_bool checksum;
+    mrb_bool closed;
+    XXH64_state_t xxh;
+    struct seekable_entry *entries;
+    size_t nentries, capacity;
+};
+
+static void
+seekable_encoder_free(MRB, struct seekable_encoder *p)
+{
+    if (p->context) {
+        ZSTD_freeCCtx(p->context);
+    }
+
+    dictionary_cdict_release(mrb, p->cdict);
+    mrb_free(mrb, p->entries);
+    mrb_free(mrb, p);
+}
+
+static const mrb_data_type seekable_encoder_type = {
+    .struct_name = "mruby_zstd.seekable_encoder",
+    .dfree = (void (*)(mrb_state *, void *))seekable_encoder_free,
+};
+
+static struct seekable_encoder *
+getseekableencoder(MRB, VALUE self)
+{
+    struct seekable_encoder *p;
+    Data_Get_Struct(mrb, self, &seekable_encoder_type, p);
+    if (!p->context) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized seekable encoder");
+    }
+    return p;
+}
+
+static VALUE
+senc_s_new(MRB, VALUE self)
+{
+    struct RClass *klass = mrb_class_ptr(self);
+    struct RData *rd;
+    struct seekable_encoder *p;
+    Data_Make_Struct(mrb, klass, struct seekable_encoder, &seekable_encoder_type, p, rd);
+    p->io = Qnil;
+    p->outbuf = Qnil;
+    p->outbufsize = CLAMP_MAX(ZSTD_CStreamOutSize(), AUX_MALLOC_MAX);
+
+    VALUE obj = mrb_obj_value(rd);
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    mrb_funcall_argv(mrb, obj, mrb_intern_lit(mrb, "initialize"), argc, argv);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  initialize(outport, opts = {})
+ *
+ * [outport]
+ *  Output port for the seekable zstd stream. Need +.<<+ method.
+ *
+ * [opts (hash)]
+ *  frame_size (integer):: maximum uncompressed size of each frame (default is 1 MiB)
+ *  table_checksum (true OR false):: store checksums of each frame into the seek table (default is true)
+ *  other options:: same as Zstd::Encoder.new (except pledgedsize)
+ */
+static VALUE
+senc_initialize(MRB, VALUE self)
+{
+    VALUE port, opts = Qnil;
+    mrb_get_args(mrb, "o|H", &port, &opts);
+
+    VALUE framesize = Qnil, checksum = Qnil;
+    if (!NIL_P(opts)) {
+        opts = mrb_hash_dup(mrb, opts);
+        framesize = mrb_hash_delete_key(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "frame_size")));
+        checksum = mrb_hash_delete_key(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "table_checksum")));
+    }
+
+    struct encode_params params;
+    mrb_int pledgedsize;
+    VALUE dict;
+    encode_kwargs(mrb, opts, Qnil, &params, &pledgedsize, &dict);
+
+    mrb_int size = (NIL_P(framesize) ? SEEKABLE_DEFAULT_FRAME_SIZE : mrb_int(mrb, framesize));
+    if (size < 1 || size > SEEKABLE_MAX_FRAME_SIZE) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "frame_size is out of range (given %S, expect 1..%S)",
+                   framesize, mrb_fixnum_value(SEEKABLE_MAX_FRAME_SIZE));
+    }
+
+    /* 各フレームの大きさは frame_size を上限とするため、既定の srcsize_hint とする */
+    if (params.srcsizehint == 0) { params.srcsizehint = (int)size; }
+
+    struct seekable_encoder *p;
+    Data_Get_Struct(mrb, self, &seekable_encoder_type, p);
+    if (p->context) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "already initialized");
+    }
+
+    if (params.workers > 0) {
+        p->context = aux_create_mt_cctx(mrb);
+    } else {
+        p->context = ZSTD_createCCtx_advanced(aux_zstd_allocator(mrb));
+        if (!p->context) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createCCtx_advanced failed"); }
+    }
+
+    /* 各フレームは ZSTD_e_end で区切るため、伸長後の大きさは与えない */
+    p->cdict = aux_init_cstream(mrb, p->context, dict, &params, -1);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.dictionary"), dict);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.outport"), port);
+    p->io = port;
+    p->framesize = size;
+    p->checksum = (NIL_P(checksum) ? TRUE : mrb_bool(checksum));
+    XXH64_reset(&p->xxh, 0);
+
+    return self;
+}
+
+static void
+seekable_encoder_check_closed(MRB, struct seekable_encoder *p)
+{
+    if (p->closed) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "closed seekable encoder");
+    }
+}
+
+/*
+ * 出力を outport に書き出す。
+ * ZSTD_e_end の場合はフレームが完了するまで繰り返す。
+ */
+static void
+seekable_encoder_compress(MRB, VALUE self, struct seekable_encoder *p, ZSTD_inBuffer *input, ZSTD_EndDirective end)
+{
+    int ai = mrb_gc_arena_save(mrb);
+
+    for (;;) {
+        mrb_gc_arena_restore(mrb, ai);
+
+        if (NIL_P(p->outbuf) || MRB_FROZEN_P(RSTRING(p->outbuf))) {
+            p->outbuf = mrb_str_buf_new(mrb, p->outbufsize);
+            mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.outbuf"), p->outbuf);
+        } else {
+            mrb_str_modify(mrb, RSTRING(p->outbuf));
+        }
+        mrb_str_resize(mrb, p->outbuf, p->outbufsize);
+
+        ZSTD_outBuffer output = { .dst = RSTRING_PTR(p->outbuf), .size = RSTRING_CAPA(p->outbuf), .pos = 0 };
+        size_t s = ZSTD_compressStream2(p->context, &output, input, end);
+        aux_check_error(mrb, s, "ZSTD_compressStream2");
+        RSTR_SET_LEN(RSTRING(p->outbuf), output.pos);
+        p->frame_out += output.pos;
+        if (p->frame_out > UINT32_MAX) {
+            aux_zstd_error(mrb, AUX_ZSTD_ERROR(frameParameter_unsupported), "Zstd::SeekableEncoder");
+        }
+        if (output.pos > 0) {
+            FUNCALL(mrb, p->io, ID_op_lshift, p->outbuf);
+        }
+
+        if (end == ZSTD_e_end ? s == 0 : input->pos >= input->size) { break; }
+    }
+
+    mrb_gc_arena_restore(mrb, ai);
+}
+
+static void
+seekable_encoder_end_frame(MRB, VALUE self, struct seekable_encoder *p)
+{
+    if (p->nentries >= SEEKABLE_MAXFRAMES) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "too many frames for seekable format");
+    }
+
+    ZSTD_inBuffer input = { 0 };
+    seekable_encoder_compress(mrb, self, p, &input, ZSTD_e_end);
+
+    if (p->nentries >= p->capacity) {
+        size_t capa = CLAMP_MIN(p->capacity * 2, 16);
+        p->entries = (struct seekable_entry *)mrb_realloc(mrb, p->entries, capa * sizeof(struct seekable_entry));
+        p->capacity = capa;
+    }
+
+    struct seekable_entry *e = &p->entries[p->nentries ++];
+    e->csize = (uint32_t)p->frame_out;
+    e->dsize = (uint32_t)p->frame_in;
+    e->checksum = (p->checksum ? (uint32_t)(XXH64_digest(&p->xxh) & 0xFFFFFFFFU) : 0);
+
+    p->frame_in = p->frame_out = 0;
+    XXH64_reset(&p->xxh, 0);
+}
+
+/*
+ * call-seq:
+ *  write(str) -> self
+ *
+ * A new frame is started every +frame_size+ bytes.
+ */
+static VALUE
+senc_write(MRB, VALUE self)
+{
+    const char *inbuf;
+    mrb_int insize;
+    mrb_get_args(mrb, "s", &inbuf, &insize);
+    struct seekable_encoder *p = getseekableencoder(mrb, self);
+    seekable_encoder_check_closed(mrb, p);
+
+    while (insize > 0) {
+        size_t n = CLAMP_MAX((size_t)insize, p->framesize - p->frame_in);
+        ZSTD_inBuffer input = { .src = inbuf, .size = n, .pos = 0 };
+        seekable_encoder_compress(mrb, self, p, &input, ZSTD_e_continue);
+        if (p->checksum) { XXH64_update(&p->xxh, inbuf, n); }
+        p->frame_in += n;
+        inbuf += n;
+        insize -= n;
+
+        if (p->frame_in >= p->framesize) {
+            seekable_encoder_end_frame(mrb, self, p);
+        }
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  end_frame -> self
+ *
+ * End the current frame (if any) and start a new one.
+ */
+static VALUE
+senc_end_frame(MRB, VALUE self)
+{
+    struct seekable_encoder *p = getseekableencoder(mrb, self);
+    seekable_encoder_check_closed(mrb, p);
+
+    if (p->frame_in > 0) {
+        seekable_encoder_end_frame(mrb, self, p);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  close -> nil
+ *
+ * End the current frame and write the seek table.
+ */
+static VALUE
+senc_close(MRB, VALUE self)
+{
+    struct seekable_encoder *p = getseekableencoder(mrb, self);
+    seekable_encoder_check_closed(mrb, p);
+
+    if (p->frame_in > 0) {
+        seekable_encoder_end_frame(mrb, self, p);
+    }
+
+    size_t entsize = (p->checksum ? 12 : 8);
+    size_t tablesize = 8 + p->nentries * entsize + SEEKABLE_FOOTER_SIZE;
+    VALUE table = mrb_str_buf_new(mrb, tablesize);
+    char *t = RSTRING_PTR(table);
+
+    aux_store_le32(t, SEEKABLE_SKIPPABLE_MAGIC);
+    aux_store_le32(t + 4, (uint32_t)(tablesize - 8));
+    t += 8;
+
+    for (size_t i = 0; i < p->nentries; i ++) {
+        aux_store_le32(t, p->entries[i].csize);
+        aux_store_le32(t + 4, p->entries[i].dsize);
+        if (p->checksum) { aux_store_le32(t + 8, p->entries[i].checksum); }
+        t += entsize;
+    }
+
+    aux_store_le32(t, (uint32_t)p->nentries);
+    t[4] = (char)(p->checksum ? 0x80 : 0x00);
+    aux_store_le32(t + 5, SEEKABLE_MAGICNUMBER);
+
+    RSTR_SET_LEN(RSTRING(table), tablesize);
+    p->closed = TRUE;
+    FUNCALL(mrb, p->io, ID_op_lshift, table);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  get_port -> outport
+ */
+static VALUE
+senc_get_port(MRB, VALUE self)
+{
+    return getseekableencoder(mrb, self)->io;
+}
+
+/*
+ * call-seq:
+ *  frame_count -> integer
+ *
+ * Number of completed frames.
+ */
+static VALUE
+senc_frame_count(MRB, VALUE self)
+{
+    return aux_size_value(mrb, getseekableencoder(mrb, self)->nentries);
+}
+
+struct seekable_frame
+{
+    uint64_t coffset;
+    uint64_t doffset;
+    uint32_t checksum;
+};
+
+struct seekable_cache
+{
+    size_t frame;
+    char *buf;
+    size_t size;
+    size_t capacity;
+    uint64_t stamp;
+};
+
+#define SEEKABLE_CACHE_EMPTY ((size_t)-1)
+
+struct seekable_decoder
+{
+    ZSTD_DCtx *context;
+    VALUE source;
+    VALUE dict;
+    struct seekable_frame *frames;  /* nframes + 1 個 (最後は終端) */
+    size_t nframes;
+    mrb_bool checksum;
+    struct seekable_cache *cache;
+    int ncache;
+    uint64_t clock;
+};
+
+static void
+seekable_decoder_free(MRB, struct seekable_decoder *p)
+{
+    if (p->context) {
+        ZSTD_freeDCtx(p->context);
     }
 
+    if (p->cache) {
+        for (int i = 0; i < p->ncache; i ++) {
+            mrb_free(mrb, p->cache[i].buf);
+        }
+        mrb_free(mrb, p->cache);
+    }
+
+    mrb_free(mrb, p->frames);
     mrb_free(mrb, p);
 }
 
-static const mrb_data_type encoder_type = {
-    .struct_name = "mruby_zstd.encoder",
-    .dfree = (void (*)(mrb_state *, void *))encoder_free,
+static const mrb_data_type seekable_decoder_type = {
+    .struct_name = "mruby_zstd.seekable_decoder",
+    .dfree = (void (*)(mrb_state *, void *))seekable_decoder_free,
 };
 
-static struct encoder *
-getencoder(MRB, VALUE self)
+static struct seekable_decoder *
+getseekabledecoder(MRB, VALUE self)
 {
-    struct encoder *p;
-    Data_Get_Struct(mrb, self, &encoder_type, p);
+    struct seekable_decoder *p;
+    Data_Get_Struct(mrb, self, &seekable_decoder_type, p);
+    if (!p->frames) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized seekable decoder");
+    }
     return p;
 }
 
 static VALUE
-encoder_set_outport(MRB, VALUE self, struct encoder *p, VALUE port)
+sdec_s_new(MRB, VALUE self)
 {
-    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.outport"), port);
-    p->io = port;
-    return port;
+    struct RClass *klass = mrb_class_ptr(self);
+    struct RData *rd;
+    struct seekable_decoder *p;
+    Data_Make_Struct(mrb, klass, struct seekable_decoder, &seekable_decoder_type, p, rd);
+    p->source = Qnil;
+    p->dict = Qnil;
+
+    VALUE obj = mrb_obj_value(rd);
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    mrb_funcall_argv(mrb, obj, mrb_intern_lit(mrb, "initialize"), argc, argv);
+
+    return obj;
+}
+
+static uint64_t
+seekable_source_size(MRB, VALUE source)
+{
+    if (mrb_string_p(source)) {
+        return RSTRING_LEN(source);
+    }
+
+    mrb_int size = mrb_int(mrb, FUNCALL(mrb, source, mrb_intern_lit(mrb, "size")));
+    if (size < 0) { mrb_raise(mrb, E_RUNTIME_ERROR, "wrong source size"); }
+
+    return (uint64_t)size;
+}
+
+/*
+ * 圧縮データの [offset, offset + size) を返す。
+ * String の場合は直接参照し、それ以外の場合は seek と read によって読み込んだ文字列を *keep に格納する。
+ */
+static const char *
+seekable_source_read(MRB, VALUE source, uint64_t offset, size_t size, VALUE *keep)
+{
+    if (mrb_string_p(source)) {
+        if (offset > (uint64_t)RSTRING_LEN(source) || size > RSTRING_LEN(source) - offset) {
+            aux_zstd_error(mrb, AUX_ZSTD_ERROR(srcSize_wrong), "Zstd::SeekableDecoder");
+        }
+        *keep = source;
+        return RSTRING_PTR(source) + offset;
+    }
+
+    if (offset > (uint64_t)MRB_INT_MAX || size > AUX_MALLOC_MAX) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(srcSize_wrong), "Zstd::SeekableDecoder");
+    }
+
+    FUNCALL(mrb, source, mrb_intern_lit(mrb, "seek"), mrb_fixnum_value((mrb_int)offset), mrb_fixnum_value(SEEK_SET));
+    *keep = FUNCALL(mrb, source, ID_read, mrb_fixnum_value((mrb_int)size));
+    if (!mrb_string_p(*keep) || (size_t)RSTRING_LEN(*keep) != size) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(srcSize_wrong), "Zstd::SeekableDecoder");
+    }
+
+    return RSTRING_PTR(*keep);
+}
+
+static void
+seekable_decoder_load_table(MRB, struct seekable_decoder *p)
+{
+    uint64_t total = seekable_source_size(mrb, p->source);
+    if (total < SEEKABLE_FOOTER_SIZE) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(prefix_unknown), "Zstd::SeekableDecoder (seek table)");
+    }
+
+    VALUE keep;
+    const char *footer = seekable_source_read(mrb, p->source, total - SEEKABLE_FOOTER_SIZE, SEEKABLE_FOOTER_SIZE, &keep);
+    uint32_t nframes = aux_load_le32(footer);
+    unsigned char descriptor = (unsigned char)footer[4];
+    if (aux_load_le32(footer + 5) != SEEKABLE_MAGICNUMBER) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(prefix_unknown), "Zstd::SeekableDecoder (seek table)");
+    }
+    if ((descriptor & 0x7C) != 0 || nframes > SEEKABLE_MAXFRAMES) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(corruption_detected), "Zstd::SeekableDecoder (seek table)");
+    }
+
+    mrb_bool checksum = ((descriptor & 0x80) != 0);
+    size_t entsize = (checksum ? 12 : 8);
+    uint64_t tablesize = 8 + (uint64_t)nframes * entsize + SEEKABLE_FOOTER_SIZE;
+    if (tablesize > total) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(corruption_detected), "Zstd::SeekableDecoder (seek table)");
+    }
+
+    const char *table = seekable_source_read(mrb, p->source, total - tablesize, (size_t)tablesize, &keep);
+    if (aux_load_le32(table) != SEEKABLE_SKIPPABLE_MAGIC ||
+        aux_load_le32(table + 4) != tablesize - 8) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(corruption_detected), "Zstd::SeekableDecoder (seek table)");
+    }
+    table += 8;
+
+    struct seekable_frame *frames = (struct seekable_frame *)mrb_malloc(mrb, ((size_t)nframes + 1) * sizeof(struct seekable_frame));
+    uint64_t coffset = 0, doffset = 0;
+    for (uint32_t i = 0; i < nframes; i ++, table += entsize) {
+        uint32_t csize = aux_load_le32(table);
+        uint32_t dsize = aux_load_le32(table + 4);
+
+        /*
+         * 伸長後の大きさはフレームを読み込む前にそのまま確保するため、確保できない大きさと、
+         * 圧縮後の大きさから有り得ない大きさ (ブロックは最小 4 バイトで最大 ZSTD_BLOCKSIZE_MAX に伸長される) を拒否する。
+         */
+        if (dsize > AUX_MALLOC_MAX || dsize > ((uint64_t)csize / 4 + 1) * ZSTD_BLOCKSIZE_MAX) {
+            mrb_free(mrb, frames);
+            aux_zstd_error(mrb, AUX_ZSTD_ERROR(corruption_detected), "Zstd::SeekableDecoder (seek table)");
+        }
+
+        frames[i].coffset = coffset;
+        frames[i].doffset = doffset;
+        frames[i].checksum = (checksum ? aux_load_le32(table + 8) : 0);
+        coffset += csize;
+        doffset += dsize;
+    }
+    frames[nframes].coffset = coffset;
+    frames[nframes].doffset = doffset;
+    frames[nframes].checksum = 0;
+
+    if (coffset > total - tablesize) {
+        mrb_free(mrb, frames);
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(corruption_detected), "Zstd::SeekableDecoder (seek table)");
+    }
+
+    p->frames = frames;
+    p->nframes = nframes;
+    p->checksum = checksum;
 }
 
+/*
+ * call-seq:
+ *  initialize(source, opts = {})
+ *
+ * [source]
+ *  String, or object responding to +size+, +seek+ and +read+ (e.g. File).
+ *
+ * [opts (hash)]
+ *  dict (nil, string OR Zstd::Dictionary):: decompression with dictionary
+ *  cache (integer):: number of decompressed frames to keep (default is 4)
+ */
 static VALUE
-encoder_set_outbuf(MRB, VALUE obj, struct encoder *p, VALUE val)
+sdec_initialize(MRB, VALUE self)
 {
-    p->outbuf = val;
-    mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-zstd.outbuf"), val);
-    return val;
+    VALUE source, opts = Qnil;
+    mrb_get_args(mrb, "o|H", &source, &opts);
+
+    VALUE dict = Qnil, cache = Qnil;
+    if (!NIL_P(opts)) {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("dict", &dict, Qnil),
+                MRBX_SCANHASH_ARGS("cache", &cache, Qnil));
+        aux_check_dict(mrb, dict);
+    }
+
+    mrb_int ncache = (NIL_P(cache) ? SEEKABLE_DEFAULT_CACHE_SIZE : mrb_int(mrb, cache));
+    ncache = CLAMP_MAX(CLAMP_MIN(ncache, 1), 256);
+
+    struct seekable_decoder *p;
+    Data_Get_Struct(mrb, self, &seekable_decoder_type, p);
+    if (p->frames) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "already initialized");
+    }
+
+    /* 文字列の辞書は ZSTD_DDict を使い回すために Zstd::Dictionary に変換する */
+    p->dict = aux_to_dictionary(mrb, dict);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.dictionary"), p->dict);
+    p->source = source;
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.source"), source);
+
+    if (!p->context) {
+        p->context = ZSTD_createDCtx_advanced(aux_zstd_allocator(mrb));
+        if (!p->context) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createDCtx_advanced failed"); }
+    }
+
+    if (!p->cache) {
+        p->cache = (struct seekable_cache *)mrb_calloc(mrb, ncache, sizeof(struct seekable_cache));
+        p->ncache = (int)ncache;
+        for (int i = 0; i < p->ncache; i ++) {
+            p->cache[i].frame = SEEKABLE_CACHE_EMPTY;
+        }
+    }
+
+    seekable_decoder_load_table(mrb, p);
+
+    return self;
+}
+
+/*
+ * off を含むフレームの番号を返す (off は全体の大きさ未満であること)。
+ */
+static size_t
+seekable_decoder_find_frame(struct seekable_decoder *p, uint64_t off)
+{
+    size_t lo = 0, hi = p->nframes;
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (p->frames[mid].doffset <= off) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * フレームを伸長してキャッシュに格納する。キャッシュが一杯の場合は最も古いものを捨てる。
+ */
+static struct seekable_cache *
+seekable_decoder_load_frame(MRB, struct seekable_decoder *p, size_t frame)
+{
+    struct seekable_cache *slot = &p->cache[0];
+
+    for (int i = 0; i < p->ncache; i ++) {
+        struct seekable_cache *c = &p->cache[i];
+        if (c->frame == frame) {
+            c->stamp = ++ p->clock;
+            return c;
+        }
+        if (c->stamp < slot->stamp) { slot = c; }
+    }
+
+    const struct seekable_frame *f = &p->frames[frame];
+    size_t csize = (size_t)(f[1].coffset - f[0].coffset);
+    size_t dsize = (size_t)(f[1].doffset - f[0].doffset);
+
+    slot->frame = SEEKABLE_CACHE_EMPTY;
+    slot->stamp = 0;
+
+    int ai = mrb_gc_arena_save(mrb);
+    VALUE keep;
+    const char *src = seekable_source_read(mrb, p->source, f->coffset, csize, &keep);
+
+    /* シークテーブルの値を信用せず、実際のフレームから伸長後の大きさの上限を求めてから確保する */
+    unsigned long long bound = ZSTD_decompressBound(src, csize);
+    if (bound == ZSTD_CONTENTSIZE_ERROR || dsize > bound) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(corruption_detected), "Zstd::SeekableDecoder");
+    }
+
+    if (slot->capacity < dsize) {
+        slot->buf = (char *)mrb_realloc(mrb, slot->buf, dsize);
+        slot->capacity = dsize;
+    }
+
+    size_t s = aux_decompress_dict(mrb, p->context, slot->buf, dsize, src, csize, p->dict);
+    mrb_gc_arena_restore(mrb, ai);
+
+    if (s != dsize) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(corruption_detected), "Zstd::SeekableDecoder");
+    }
+
+    if (p->checksum && (uint32_t)(XXH64(slot->buf, dsize, 0) & 0xFFFFFFFFU) != f->checksum) {
+        aux_zstd_error(mrb, AUX_ZSTD_ERROR(checksum_wrong), "Zstd::SeekableDecoder");
+    }
+
+    slot->frame = frame;
+    slot->size = dsize;
+    slot->stamp = ++ p->clock;
+
+    return slot;
+}
+
+/*
+ * call-seq:
+ *  pread(offset, length, buffer = "") -> buffer
+ *
+ * Read +length+ bytes from +offset+ of the decompressed data.
+ * Only the frames in the range are decompressed.
+ * The result is shorter than +length+ if the range is over the end.
+ */
+static VALUE
+sdec_pread(MRB, VALUE self)
+{
+    mrb_int offset, length;
+    VALUE dest = Qnil;
+    mrb_get_args(mrb, "ii|S!", &offset, &length, &dest);
+    struct seekable_decoder *p = getseekabledecoder(mrb, self);
+
+    if (offset < 0 || length < 0) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "negative offset or length (given %S, %S)",
+                   mrb_fixnum_value(offset), mrb_fixnum_value(length));
+    }
+
+    uint64_t total = p->frames[p->nframes].doffset;
+    uint64_t off = CLAMP_MAX((uint64_t)offset, total);
+    uint64_t end = off + CLAMP_MAX((uint64_t)length, total - off);
+
+    if (NIL_P(dest)) {
+        dest = mrb_str_buf_new(mrb, (size_t)(end - off));
+    } else {
+        mrb_str_modify(mrb, RSTRING(dest));
+        mrb_str_resize(mrb, dest, 0);
+    }
+
+    int ai = mrb_gc_arena_save(mrb);
+    for (size_t frame = (off < end ? seekable_decoder_find_frame(p, off) : 0); off < end; frame ++) {
+        const struct seekable_frame *f = &p->frames[frame];
+        if (f[1].doffset <= off) { continue; }
+
+        struct seekable_cache *c = seekable_decoder_load_frame(mrb, p, frame);
+        size_t pos = (size_t)(off - f->doffset);
+        size_t n = (size_t)CLAMP_MAX(end - off, c->size - pos);
+        mrb_str_cat(mrb, dest, c->buf + pos, n);
+        off += n;
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return dest;
+}
+
+/*
+ * call-seq:
+ *  size -> integer
+ *
+ * Total size of the decompressed data.
+ */
+static VALUE
+sdec_size(MRB, VALUE self)
+{
+    struct seekable_decoder *p = getseekabledecoder(mrb, self);
+    return aux_size_value(mrb, p->frames[p->nframes].doffset);
+}
+
+/*
+ * call-seq:
+ *  frame_count -> integer
+ */
+static VALUE
+sdec_frame_count(MRB, VALUE self)
+{
+    return aux_size_value(mrb, getseekabledecoder(mrb, self)->nframes);
+}
+
+static void
+init_seekable(MRB, struct RClass *mZstd)
+{
+    struct RClass *cSeekableEncoder = mrb_define_class_under(mrb, mZstd, "SeekableEncoder", mrb_cObject);
+    mrb_define_class_method(mrb, cSeekableEncoder, "new", senc_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cSeekableEncoder, "initialize", senc_initialize, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, cSeekableEncoder, "write", senc_write, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cSeekableEncoder, "end_frame", senc_end_frame, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cSeekableEncoder, "close", senc_close, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cSeekableEncoder, "get_port", senc_get_port, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cSeekableEncoder, "frame_count", senc_frame_count, MRB_ARGS_NONE());
+    mrb_define_alias(mrb, cSeekableEncoder, "<<", "write");
+    mrb_define_alias(mrb, cSeekableEncoder, "finish", "close");
+
+    struct RClass *cSeekableDecoder = mrb_define_class_under(mrb, mZstd, "SeekableDecoder", mrb_cObject);
+    mrb_define_class_method(mrb, cSeekableDecoder, "new", sdec_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cSeekableDecoder, "initialize", sdec_initialize, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, cSeekableDecoder, "pread", sdec_pread, MRB_ARGS_ARG(2, 1));
+    mrb_define_method(mrb, cSeekableDecoder, "size", sdec_size, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cSeekableDecoder, "frame_count", sdec_frame_count, MRB_ARGS_NONE());
+}
+
+/*
+ * mruby_zstd initializer
+ * module Zstd
+ */
+
+/*
+ * Zstd.compress_file
+ * Zstd.decompress_file
+ * Zstd.copy_stream
+ *
+ * The whole stream is pumped in C: the source is mapped (regular files) or
+ * read into a native buffer, and the output is written by write(2).
+ * Only when the ports don't have file descriptors, the VM calls
+ * +read+ and +<<+ for each chunk.
+ */
+
+struct pump
+{
+    mrb_bool encode;
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    enum context_owner owner;
+    struct encode_params params;
+    mrb_int pledgedsize;
+    VALUE dict;
+    struct dictionary_cdict *cdict;
+
+    VALUE src, dest;        /* ファイル記述子を使わない場合の入出力先 */
+    int srcfd, destfd;
+    mrb_bool closesrc, closedest;
+    const char *destpath;   /* 失敗した時に削除するファイル */
+    mrb_bool done;
+
+    void *map;
+    size_t mapsize;
+    char *inbuf, *outbuf;
+    size_t inbufsize, outbufsize;
+
+    unsigned long long total;
+};
+
+#ifdef _WIN32
+#   define AUX_OPEN_READ    (_O_RDONLY | _O_BINARY)
+#   define AUX_OPEN_WRITE   (_O_WRONLY | _O_CREAT | _O_BINARY)
+#   define aux_open         _open
+#   define aux_close        _close
+#   define aux_unlink       _unlink
+#else
+#   ifdef O_CLOEXEC
+#       define AUX_OPEN_READ    (O_RDONLY | O_CLOEXEC)
+#       define AUX_OPEN_WRITE   (O_WRONLY | O_CREAT | O_CLOEXEC)
+#   else
+#       define AUX_OPEN_READ    (O_RDONLY)
+#       define AUX_OPEN_WRITE   (O_WRONLY | O_CREAT)
+#   endif
+#   define aux_open         open
+#   define aux_close        close
+#   define aux_unlink       unlink
+#endif
+
+static void
+pump_write(MRB, struct pump *p, const char *buf, size_t size)
+{
+    if (size < 1) { return; }
+
+    if (p->destfd >= 0) {
+        aux_fd_write(mrb, p->destfd, buf, size);
+    } else {
+        int ai = mrb_gc_arena_save(mrb);
+        FUNCALL(mrb, p->dest, ID_op_lshift, mrb_str_new(mrb, buf, size));
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    p->total += size;
 }
 
-/*
- * call-seq:
- *  new(level = nil, prefs = {})
- */
-static VALUE
-enc_s_new(MRB, VALUE self)
-{
-    struct RClass *klass = mrb_class_ptr(self);
-    struct RData *rd;
-    struct encoder *p;
-    Data_Make_Struct(mrb, klass, struct encoder, &encoder_type, p, rd);
-    p->io = Qnil;
-    p->outbufsize = ZSTD_CStreamOutSize();
-    if (p->outbufsize > AUX_MALLOC_MAX) { p->outbufsize = AUX_MALLOC_MAX; }
-    p->zstd.allocator = aux_zstd_allocator(mrb);
-    p->zstd.context = ZSTD_createCStream_advanced(p->zstd.allocator);
+/*
+ * 入力を補充する。それ以上の入力がない場合は偽を返す。
+ */
+static mrb_bool
+pump_read(MRB, struct pump *p, ZSTD_inBuffer *input)
+{
+    if (p->srcfd < 0 && NIL_P(p->src)) { return FALSE; }
+
+    if (p->srcfd >= 0) {
+        size_t n = aux_fd_read(mrb, p->srcfd, p->inbuf, p->inbufsize);
+        input->src = p->inbuf;
+        input->size = n;
+        input->pos = 0;
+
+        return (n > 0);
+    }
+
+    VALUE buf = FUNCALL(mrb, p->src, ID_read, mrb_fixnum_value((mrb_int)CLAMP_MAX(p->inbufsize, AUX_MALLOC_MAX)));
+    if (NIL_P(buf) || (mrb_check_type(mrb, buf, MRB_TT_STRING), RSTRING_LEN(buf) < 1)) {
+        p->src = Qnil;
+        return FALSE;
+    }
+
+    /* 次の read を呼ぶまで消費するため複製しない (それまで GC arena で保護される) */
+    mrb_gc_protect(mrb, buf);
+    input->src = RSTRING_PTR(buf);
+    input->size = RSTRING_LEN(buf);
+    input->pos = 0;
+
+    return TRUE;
+}
+
+static VALUE
+pump_main_body(MRB, VALUE args)
+{
+    struct pump *p = (struct pump *)mrb_cptr(args);
+    ZSTD_inBuffer input = { .src = "", .size = 0, .pos = 0 };
+    mrb_bool eof = FALSE;
+
+    if (p->encode) {
+        if (p->params.workers > 0) {
+            p->cctx = aux_create_mt_cctx(mrb);
+            p->owner = CONTEXT_OWNED;
+        } else {
+            p->cctx = context_pool_acquire_cctx(mrb);
+            p->owner = CONTEXT_POOLED;
+        }
+    } else {
+        p->dctx = context_pool_acquire_dctx(mrb);
+        p->owner = CONTEXT_POOLED;
+    }
+
+#ifndef _WIN32
+    size_t head;
+    if (p->srcfd >= 0 && aux_fd_map(p->srcfd, &p->map, &p->mapsize, &head)) {
+        input.src = (p->map ? (const char *)p->map + head : "");
+        input.size = p->mapsize - head;
+        eof = TRUE;
+
+        /* 大きさが分かっている場合は、フレームヘッダに記録する */
+        if (p->encode && p->pledgedsize < 0 && input.size <= (size_t)MRB_INT_MAX) {
+            p->pledgedsize = (mrb_int)input.size;
+        }
+    }
+#endif
+
+    if (!eof) {
+        p->inbufsize = CLAMP_MIN(p->encode ? ZSTD_CStreamInSize() : ZSTD_DStreamInSize(),
+                                 MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE);
+        if (p->srcfd >= 0) {
+            p->inbuf = (char *)mrb_malloc(mrb, p->inbufsize);
+        }
+    }
+
+    p->outbufsize = CLAMP_MIN(p->encode ? ZSTD_CStreamOutSize() : ZSTD_DStreamOutSize(),
+                              MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE);
+    p->outbuf = (char *)mrb_malloc(mrb, p->outbufsize);
+
+    if (p->encode) {
+        p->cdict = aux_init_cstream(mrb, p->cctx, p->dict, &p->params, p->pledgedsize);
+    } else {
+        aux_init_dstream(mrb, p->dctx, p->dict);
+    }
+
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_bool inframe = FALSE;
+
+    for (;;) {
+        if (input.pos >= input.size && !eof) {
+            mrb_gc_arena_restore(mrb, ai);
+            eof = !pump_read(mrb, p, &input);
+        }
 
-    if (!p->zstd.context) {
-        mrb_raise(mrb,
-                  E_RUNTIME_ERROR,
-                  "ZSTD_createCStream_advanced failed");
+        ZSTD_outBuffer output = { .dst = p->outbuf, .size = p->outbufsize, .pos = 0 };
+
+        if (p->encode) {
+            size_t s = ZSTD_compressStream2(p->cctx, &output, &input, (eof ? ZSTD_e_end : ZSTD_e_continue));
+            aux_check_error(mrb, s, "ZSTD_compressStream2");
+            pump_write(mrb, p, (const char *)output.dst, output.pos);
+            if (eof && s == 0) { break; }
+        } else {
+            size_t pos = input.pos;
+            size_t s = ZSTD_decompressStream(p->dctx, &output, &input);
+            aux_check_error(mrb, s, "ZSTD_decompressStream");
+            pump_write(mrb, p, (const char *)output.dst, output.pos);
+            if (s == 0) {
+                inframe = FALSE;
+            } else if (input.pos > pos) {
+                inframe = TRUE;
+            }
+
+            if (eof && input.pos >= input.size && output.pos < output.size) {
+                if (inframe) {
+                    /* フレームの途中で入力が尽きた */
+                    aux_zstd_error(mrb, AUX_ZSTD_ERROR(srcSize_wrong), "ZSTD_decompressStream");
+                }
+                break;
+            }
+        }
     }
 
-    VALUE obj = mrb_obj_value(rd);
-    mrb_int argc;
-    mrb_value *argv;
-    mrb_get_args(mrb, "*", &argv, &argc);
-    mrb_funcall_argv(mrb, obj, mrb_intern_lit(mrb, "initialize"), argc, argv);
+    p->done = TRUE;
 
-    return obj;
+    return Qnil;
 }
 
-static void
-enc_initialize_args(MRB, VALUE *outport, ZSTD_parameters *params, mrb_int *pledgedsize, VALUE *dict)
+static VALUE
+pump_main_cleanup(MRB, VALUE args)
 {
-    mrb_int argc;
-    VALUE *argv;
-    mrb_get_args(mrb, "*", &argv, &argc);
-    VALUE opts;
+    struct pump *p = (struct pump *)mrb_cptr(args);
 
-    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-        opts = argv[argc - 1];
-        argc --;
-    } else {
-        opts = Qnil;
+#ifndef _WIN32
+    if (p->map) {
+        munmap(p->map, p->mapsize);
+    }
+#endif
+
+    mrb_free(mrb, p->inbuf);
+    mrb_free(mrb, p->outbuf);
+
+    if (p->cctx) {
+        ZSTD_CCtx_reset(p->cctx, ZSTD_reset_session_only);
+        ZSTD_CCtx_refCDict(p->cctx, NULL);
+        dictionary_cdict_replace(mrb, &p->cdict, NULL);
+        if (p->owner == CONTEXT_OWNED) {
+            ZSTD_freeCCtx(p->cctx);
+        } else {
+            context_pool_release_cctx(mrb, p->cctx);
+        }
     }
 
-    switch (argc) {
-    case 1:
-        break;
-    default:
-        mrb_raisef(mrb,
-                   E_ARGUMENT_ERROR,
-                   "wrong arguments (given %S, expect ``initialize(outport, opts = {})'')",
-                   mrb_fixnum_value(argc));
+    if (p->dctx) {
+        ZSTD_DCtx_reset(p->dctx, ZSTD_reset_session_only);
+        ZSTD_DCtx_refDDict(p->dctx, NULL);
+        context_pool_release_dctx(mrb, p->dctx);
     }
 
-    *outport = argv[0];
+    if (p->closesrc && p->srcfd >= 0) { aux_close(p->srcfd); }
+    if (p->closedest && p->destfd >= 0) { aux_close(p->destfd); }
 
-    encode_kwargs(mrb, opts, Qnil, params, pledgedsize, dict);
+    /* 中途半端な出力ファイルを残さない */
+    if (!p->done && p->destpath) { aux_unlink(p->destpath); }
+
+    return Qnil;
 }
 
 /*
- * call-seq:
- *  initialize(outport, level = nil, opts = {})
+ * 入出力先を開いた後で呼ぶこと (失敗した場合も閉じられる)。
  */
 static VALUE
-enc_initialize(MRB, VALUE self)
+pump_main(MRB, struct pump *p)
 {
-    ZSTD_parameters params;
-    mrb_int pledgedsize;
-    VALUE dict;
-    VALUE port;
-    enc_initialize_args(mrb, &port, &params, &pledgedsize, &dict);
-    struct encoder *p = getencoder(mrb, self);
+    VALUE argsp = mrb_cptr_value(mrb, p);
+    mrb_ensure(mrb, pump_main_body, argsp, pump_main_cleanup, argsp);
 
-    size_t s = ZSTD_initCStream_advanced(p->zstd.context,
-                                         (NIL_P(dict) ? NULL : RSTRING_PTR(dict)),
-                                         (NIL_P(dict) ? 0 : RSTRING_LEN(dict)),
-                                         params, pledgedsize);
-    aux_check_error(mrb, s, "ZSTD_initCStream_advanced");
-
-    encoder_set_outport(mrb, self, p, port);
-    encoder_set_outbuf(mrb, self, p, Qnil);
-
-    return self;
+    return aux_size_value(mrb, p->total);
 }
 
 /*
- * call-seq:
- *  write(str) -> self
+ * mode (:encode, :compress, :decode, :decompress OR :uncompress) を真偽値にする。
  */
+static mrb_bool
+aux_pump_mode(MRB, VALUE mode)
+{
+    if (mrb_symbol_p(mode)) {
+        mrb_sym sym = mrb_symbol(mode);
+        if (sym == mrb_intern_lit(mrb, "encode") || sym == mrb_intern_lit(mrb, "compress")) {
+            return TRUE;
+        }
+        if (sym == mrb_intern_lit(mrb, "decode") || sym == mrb_intern_lit(mrb, "decompress") ||
+            sym == mrb_intern_lit(mrb, "uncompress")) {
+            return FALSE;
+        }
+    }
+
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "wrong mode (given %S, expect :encode or :decode)",
+               mode);
+    return FALSE; /* not reached */
+}
+
+static void
+pump_kwargs(MRB, struct pump *p, VALUE opts)
+{
+    if (p->encode) {
+        encode_kwargs(mrb, opts, Qnil, &p->params, &p->pledgedsize, &p->dict);
+    } else if (NIL_P(opts)) {
+        p->dict = Qnil;
+    } else {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("dict", &p->dict, Qnil));
+        aux_check_dict(mrb, p->dict);
+    }
+}
+
 static VALUE
-enc_write(MRB, VALUE self)
+pump_file(MRB, mrb_bool encode)
 {
-    const char *inbuf;
-    mrb_int insize;
-    mrb_get_args(mrb, "s", &inbuf, &insize);
-    struct encoder *p = getencoder(mrb, self);
-    ZSTD_inBuffer input = { .src = inbuf, .size = insize, .pos = 0 };
+    const char *srcpath, *destpath;
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "zz|H", &srcpath, &destpath, &opts);
+
+    struct pump p;
+    memset(&p, 0, sizeof(p));
+    p.encode = encode;
+    p.src = p.dest = Qnil;
+    p.srcfd = p.destfd = -1;
+    p.closesrc = p.closedest = TRUE;
+    pump_kwargs(mrb, &p, opts);
+
+    p.srcfd = aux_open(srcpath, AUX_OPEN_READ);
+    if (p.srcfd < 0) { mrb_sys_fail(mrb, srcpath); }
+
+    p.destfd = aux_open(destpath, AUX_OPEN_WRITE, 0666);
+    if (p.destfd < 0) {
+        int err = errno;
+        aux_close(p.srcfd);
+        errno = err;
+        mrb_sys_fail(mrb, destpath);
+    }
 
-    while (input.pos < input.size) {
-        mrb_gc_arena_restore(mrb, 0);
+#ifndef _WIN32
+    {
+        /* 切り詰める前に、入力と同じファイルでないことを確認する */
+        struct stat sst, dst;
+        if (fstat(p.srcfd, &sst) == 0 && fstat(p.destfd, &dst) == 0 &&
+            sst.st_dev == dst.st_dev && sst.st_ino == dst.st_ino) {
+            aux_close(p.srcfd);
+            aux_close(p.destfd);
+            mrb_raise(mrb, E_ARGUMENT_ERROR, "source and destination are the same file");
+        }
 
-        if (NIL_P(p->outbuf) || MRB_FROZEN_P(RSTRING(p->outbuf))) {
-            encoder_set_outbuf(mrb, self, p, mrb_str_buf_new(mrb, p->outbufsize));
-        } else {
-            mrb_str_modify(mrb, RSTRING(p->outbuf));
+        if (ftruncate(p.destfd, 0) != 0) {
+            int err = errno;
+            aux_close(p.srcfd);
+            aux_close(p.destfd);
+            errno = err;
+            mrb_sys_fail(mrb, destpath);
         }
-        mrb_str_resize(mrb, p->outbuf, p->outbufsize);
-        ZSTD_outBuffer output = { .dst = RSTRING_PTR(p->outbuf), .size = RSTRING_CAPA(p->outbuf), .pos = 0 };
-        size_t s = ZSTD_compressStream(p->zstd.context, &output, &input);
-        aux_check_error(mrb, s, "ZSTD_compressStream");
-        RSTR_SET_LEN(RSTRING(p->outbuf), output.pos);
-        FUNCALL(mrb, p->io, ID_op_lshift, p->outbuf);
     }
+#else
+    if (_chsize(p.destfd, 0) != 0) {
+        int err = errno;
+        aux_close(p.srcfd);
+        aux_close(p.destfd);
+        errno = err;
+        mrb_sys_fail(mrb, destpath);
+    }
+#endif
 
-    return self;
+    p.destpath = destpath;
+
+    return pump_main(mrb, &p);
 }
 
 /*
  * call-seq:
- *  flush -> self
+ *  compress_file(src_path, dest_path, opts = {}) -> compressed size
+ *
+ * Compress the file +src_path+ into +dest_path+.
+ * The options are the same as Zstd.encode (+workers+ for multithreaded compression).
+ * The content size is recorded when +src_path+ is a regular file.
+ * +dest_path+ is removed on failure.
  */
 static VALUE
-enc_flush(MRB, VALUE self)
+pump_s_compress_file(MRB, VALUE self)
 {
-    struct encoder *p = getencoder(mrb, self);
-    ZSTD_outBuffer output = { 0 };
-
-    do {
-        mrb_gc_arena_restore(mrb, 0);
-
-        if (NIL_P(p->outbuf) || MRB_FROZEN_P(RSTRING(p->outbuf))) {
-            encoder_set_outbuf(mrb, self, p, mrb_str_buf_new(mrb, p->outbufsize));
-        } else {
-            mrb_str_modify(mrb, RSTRING(p->outbuf));
-        }
-        mrb_str_resize(mrb, p->outbuf, p->outbufsize);
-        output.dst = RSTRING_PTR(p->outbuf);
-        output.size = RSTRING_CAPA(p->outbuf);
-        output.pos = 0;
-        size_t s = ZSTD_flushStream(p->zstd.context, &output);
-        aux_check_error(mrb, s, "ZSTD_flushStream");
-        RSTR_SET_LEN(RSTRING(p->outbuf), output.pos);
-        FUNCALL(mrb, p->io, ID_op_lshift, p->outbuf);
-    } while (output.pos == output.size);
-
-    return self;
+    return pump_file(mrb, TRUE);
 }
 
 /*
  * call-seq:
- *  close -> nil
+ *  decompress_file(src_path, dest_path, dict: nil) -> decompressed size
+ *
+ * Decompress the file +src_path+ (all concatenated frames) into +dest_path+.
+ * +dest_path+ is removed on failure.
  */
 static VALUE
-enc_close(MRB, VALUE self)
+pump_s_decompress_file(MRB, VALUE self)
 {
-    struct encoder *p = getencoder(mrb, self);
-    ZSTD_outBuffer output = { 0 };
-
-    do {
-        mrb_gc_arena_restore(mrb, 0);
-
-        if (NIL_P(p->outbuf) || MRB_FROZEN_P(RSTRING(p->outbuf))) {
-            encoder_set_outbuf(mrb, self, p, mrb_str_buf_new(mrb, p->outbufsize));
-        } else {
-            mrb_str_modify(mrb, RSTRING(p->outbuf));
-        }
-        mrb_str_resize(mrb, p->outbuf, p->outbufsize);
-        output.dst = RSTRING_PTR(p->outbuf);
-        output.size = RSTRING_CAPA(p->outbuf);
-        output.pos = 0;
-        size_t s = ZSTD_endStream(p->zstd.context, &output);
-        aux_check_error(mrb, s, "ZSTD_endStream");
-        RSTR_SET_LEN(RSTRING(p->outbuf), output.pos);
-        FUNCALL(mrb, p->io, ID_op_lshift, p->outbuf);
-    } while (output.pos == output.size);
+    return pump_file(mrb, FALSE);
+}
 
-    return Qnil;
+/*
+ * port が整数であればファイル記述子として、そうでなければ fileno を調べる。
+ * mruby-io の IO は読み込んだデータを内部に溜めていることがあるため、
+ * 入力元 (input が真) は整数を与えた場合に限って直接読み込む。
+ */
+static int
+aux_pump_port_fd(MRB, VALUE port, mrb_bool input)
+{
+    if (mrb_fixnum_p(port)) { return aux_port_fd(mrb, port, port); }
+    if (input) { return -1; }
+    return aux_port_fd(mrb, port, Qnil);
 }
 
 /*
  * call-seq:
- *  get_port -> self
+ *  copy_stream(src, dest, mode, opts = {}) -> written size
+ *
+ * Compress (+mode+ is :encode) or decompress (+mode+ is :decode) from +src+ into +dest+
+ * until the end of +src+.
+ *
+ * +src+ is a file descriptor (integer) or an object that has +read+
+ * (a File is read by +read+ so that the data it has buffered is not skipped).
+ * +dest+ is a file descriptor, an object that has +fileno+, or an object that has +<<+.
+ * The options are the same as Zstd.encode or Zstd.decode.
  */
 static VALUE
-enc_get_port(MRB, VALUE self)
+pump_s_copy_stream(MRB, VALUE self)
 {
-    return getencoder(mrb, self)->io;
+    VALUE src, dest, mode, opts = Qnil;
+    mrb_get_args(mrb, "ooo|H", &src, &dest, &mode, &opts);
+
+    struct pump p;
+    memset(&p, 0, sizeof(p));
+    p.encode = aux_pump_mode(mrb, mode);
+    pump_kwargs(mrb, &p, opts);
+
+    p.srcfd = aux_pump_port_fd(mrb, src, TRUE);
+    p.destfd = aux_pump_port_fd(mrb, dest, FALSE);
+    p.src = (p.srcfd < 0 ? src : Qnil);
+    p.dest = (p.destfd < 0 ? dest : Qnil);
+
+    return pump_main(mrb, &p);
 }
 
 static void
-init_encoder(MRB, struct RClass *mZstd)
+init_pump(MRB, struct RClass *mZstd)
 {
-    struct RClass *cEncoder = mrb_define_class_under(mrb, mZstd, "Encoder", mrb_cObject);
-    mrb_define_class_method(mrb, cEncoder, "encode", enc_s_encode, MRB_ARGS_ANY());
-    mrb_define_class_method(mrb, cEncoder, "new", enc_s_new, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cEncoder, "initialize", enc_initialize, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cEncoder, "write", enc_write, MRB_ARGS_REQ(1));
-    mrb_define_method(mrb, cEncoder, "flush", enc_flush, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cEncoder, "close", enc_close, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cEncoder, "get_port", enc_get_port, MRB_ARGS_NONE());
-
-    mrb_define_alias(mrb, cEncoder, "<<", "write");
-    mrb_define_alias(mrb, cEncoder, "finish", "close");
-
-    mrb_define_const(mrb, cEncoder, "LEVEL_MIN", mrb_fixnum_value(1));
-#ifdef ZSTD_CLEVEL_DEFAULT
-    mrb_define_const(mrb, cEncoder, "LEVEL_DEFAULT", mrb_fixnum_value(ZSTD_CLEVEL_DEFAULT));
-#else
-    mrb_define_const(mrb, cEncoder, "LEVEL_DEFAULT", mrb_fixnum_value(3));
-#endif
-    mrb_define_const(mrb, cEncoder, "LEVEL_MAX", mrb_fixnum_value(ZSTD_maxCLevel()));
+    mrb_define_class_method(mrb, mZstd, "compress_file", pump_s_compress_file, MRB_ARGS_ARG(2, 1));
+    mrb_define_class_method(mrb, mZstd, "decompress_file", pump_s_decompress_file, MRB_ARGS_ARG(2, 1));
+    mrb_define_class_method(mrb, mZstd, "copy_stream", pump_s_copy_stream, MRB_ARGS_ARG(3, 1));
 }
 
 /*
- * class Zstd::Decoder
+ * class Zstd::StreamCompressor
+ * class Zstd::StreamDecompressor
+ *
+ * Push style (Zlib like) interface without port objects.
+ * Outputs are appended to the given destination string (or a new string),
+ * so nothing is buffered by self except zstd's own window.
  */
 
-static void
-dec_s_decode_args(MRB, VALUE *src, VALUE *dest, mrb_int *maxsize, VALUE *dict)
+struct stream_compressor
 {
-    VALUE *argv;
-    mrb_int argc;
-    mrb_get_args(mrb, "S*", src, &argv, &argc);
+    ZSTD_CCtx *cctx;
+    struct dictionary_cdict *cdict;
+};
 
-    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-        MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
-                MRBX_SCANHASH_ARGS("dict", dict, Qnil));
-        if (!NIL_P(*dict)) { mrb_check_type(mrb, *dict, MRB_TT_STRING); }
-        argc --;
-    } else {
-        *dict = Qnil;
+static void
+stream_compressor_free(MRB, struct stream_compressor *p)
+{
+    if (p->cctx) {
+        ZSTD_freeCCtx(p->cctx);
     }
 
-    switch (argc) {
-    case 0:
-        *maxsize = -1;
-        *dest = Qnil;
-        break;
-    case 1:
-        if (mrb_string_p(argv[0])) {
-            *maxsize = -1;
-            *dest = argv[0];
-        } else {
-            *maxsize = mrb_int(mrb, argv[0]);
-            *dest = mrb_str_buf_new(mrb, *maxsize);
-        }
-        break;
-    case 2:
-        *maxsize = mrb_int(mrb, argv[0]);
-        *dest = argv[1];
-        break;
-    default:
-        mrb_raisef(mrb,
-                   E_ARGUMENT_ERROR,
-                   "wrong number of arguments (given %S, expect 1..3)",
-                   mrb_fixnum_value(argc + 1));
-        break;
-    }
+    dictionary_cdict_release(mrb, p->cdict);
 
-    size_t allocsize;
-    if (*maxsize < 0) {
-        allocsize = MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE;
-    } else {
-        allocsize = *maxsize;
-    }
+    mrb_free(mrb, p);
+}
 
-    if (NIL_P(*dest)) {
-        *dest = mrb_str_buf_new(mrb, allocsize);
-    } else {
-        mrb_check_type(mrb, *dest, MRB_TT_STRING);
-        mrb_str_resize(mrb, *dest, allocsize);
-    }
+static const mrb_data_type stream_compressor_type = {
+    .struct_name = "mruby_zstd.stream_compressor",
+    .dfree = (void (*)(mrb_state *, void *))stream_compressor_free,
+};
+
+static struct stream_compressor *
+getstreamcompressor(MRB, VALUE self)
+{
+    struct stream_compressor *p;
+    Data_Get_Struct(mrb, self, &stream_compressor_type, p);
+    return p;
 }
 
 static VALUE
-decode_main_body(MRB, VALUE args)
+scomp_s_new(MRB, VALUE self)
 {
-    struct args {
-        ZSTD_DStream *zstd;
-        VALUE src, dest;
-        mrb_int maxsize;
-        mrb_int pos;
-    } *p = (struct args *)mrb_cptr(args);
+    struct RClass *klass = mrb_class_ptr(self);
+    struct RData *rd;
+    struct stream_compressor *p;
+    Data_Make_Struct(mrb, klass, struct stream_compressor, &stream_compressor_type, p, rd);
 
-    ZSTD_inBuffer bufin = { .src = RSTRING_PTR(p->src), .size = RSTRING_LEN(p->src), .pos = 0, };
-    ZSTD_outBuffer bufout = { .dst = RSTRING_PTR(p->dest), .size = (p->maxsize < 0 ? RSTRING_CAPA(p->dest) : p->maxsize), .pos = 0, };
+    VALUE obj = mrb_obj_value(rd);
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    mrb_funcall_argv(mrb, obj, mrb_intern_lit(mrb, "initialize"), argc, argv);
 
-    for (;;) {
-        size_t s = ZSTD_decompressStream(p->zstd, &bufout, &bufin);
-        p->pos = bufout.pos;
-        aux_check_error(mrb, s, "ZSTD_decompressStream");
+    return obj;
+}
 
-        if (s == 0) { break; }
-        if (p->maxsize >= 0) { break; }
-        if (bufout.pos >= AUX_MALLOC_MAX) { break; }
+/*
+ * call-seq:
+ *  initialize(opts = {}) -> self
+ *
+ * The options are the same as Zstd.encode for streaming compression.
+ */
+static VALUE
+scomp_initialize(MRB, VALUE self)
+{
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "|H", &opts);
+    struct stream_compressor *p = getstreamcompressor(mrb, self);
 
-        /* dest を拡張する */
+    struct encode_params params;
+    mrb_int pledgedsize;
+    VALUE dict;
+    encode_kwargs(mrb, opts, Qnil, &params, &pledgedsize, &dict);
+
+    if (p->cctx) {
+        ZSTD_freeCCtx(p->cctx);
+        p->cctx = NULL;
+    }
+    dictionary_cdict_replace(mrb, &p->cdict, NULL);
 
-        s = RSTRING_CAPA(p->dest);
-        if (s >= AUX_MALLOC_MAX) { aux_zstd_error(mrb, ZSTD_error_dstSize_tooSmall, "ZSTD_decompressStream"); }
-        s += MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE;
-        s = CLAMP_MAX(s, AUX_MALLOC_MAX);
-        mrb_str_resize(mrb, p->dest, s);
-        bufout.dst = RSTRING_PTR(p->dest);
-        bufout.size = RSTRING_CAPA(p->dest);
+    if (params.workers > 0) {
+        p->cctx = aux_create_mt_cctx(mrb);
+    } else {
+        p->cctx = ZSTD_createCCtx_advanced(aux_zstd_allocator(mrb));
+        if (!p->cctx) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createCCtx_advanced failed"); }
     }
 
-    return Qnil;
+    p->cdict = aux_init_cstream(mrb, p->cctx, dict, &params, pledgedsize);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.dictionary"), dict);
+
+    return self;
 }
 
 static VALUE
-decode_main_ensure(MRB, VALUE args)
+scomp_main(MRB, VALUE self, VALUE src, VALUE dest, ZSTD_EndDirective end)
 {
-    struct args {
-        ZSTD_DStream *zstd;
-        VALUE src, dest;
-        mrb_int maxsize;
-        mrb_int pos;
-    } *p = (struct args *)mrb_cptr(args);
+    struct stream_compressor *p = getstreamcompressor(mrb, self);
 
-    RSTR_SET_LEN(RSTRING(p->dest), p->pos);
-    ZSTD_freeDStream(p->zstd);
+    if (NIL_P(dest)) {
+        dest = mrb_str_buf_new(mrb, (NIL_P(src) ? ZSTD_CStreamOutSize() : ZSTD_compressBound(RSTRING_LEN(src))));
+    } else if (!NIL_P(src) && mrb_obj_eq(mrb, src, dest)) {
+        /* 出力先を拡張すると入力が移動してしまうため */
+        src = mrb_str_dup(mrb, src);
+    }
 
-    return Qnil;
+    ZSTD_inBuffer input = { "", 0, 0 };
+    if (!NIL_P(src)) {
+        input.src = RSTRING_PTR(src);
+        input.size = RSTRING_LEN(src);
+    }
+
+    for (;;) {
+        aux_str_reserve_tail(mrb, RSTRING(dest), ZSTD_CStreamOutSize(), "ZSTD_compressStream2");
+        size_t len = RSTRING_LEN(dest);
+        ZSTD_outBuffer output = { RSTRING_PTR(dest) + len, RSTRING_CAPA(dest) - len, 0 };
+        size_t s = ZSTD_compressStream2(p->cctx, &output, &input, end);
+        aux_check_error(mrb, s, "ZSTD_compressStream2");
+        aux_str_set_len(RSTRING(dest), len + output.pos);
+
+        if (end == ZSTD_e_continue ? input.pos >= input.size : s == 0) { break; }
+    }
+
+    return dest;
 }
 
-static void
-decode_main(MRB, ZSTD_DStream *zstd, VALUE src, VALUE dest, mrb_int maxsize)
+/*
+ * call-seq:
+ *  compress(src, dest = nil) -> dest OR new string
+ *
+ * Compressed data (may be empty) is appended to +dest+.
+ */
+static VALUE
+scomp_compress(MRB, VALUE self)
 {
-    struct args {
-        ZSTD_DStream *zstd;
-        VALUE src, dest;
-        mrb_int maxsize;
-        mrb_int pos;
-    } args = { zstd, src, dest, maxsize, 0 };
+    VALUE src, dest = Qnil;
+    mrb_get_args(mrb, "S|S!", &src, &dest);
 
-    VALUE argsp = mrb_cptr_value(mrb, &args);
-    mrb_ensure(mrb, decode_main_body, argsp, decode_main_ensure, argsp);
+    return scomp_main(mrb, self, src, dest, ZSTD_e_continue);
 }
 
 /*
  * call-seq:
- *  decode(zstd_sequence, buffer = "", opts = {}) -> buffer
- *  decode(zstd_sequence, maxsize, buffer = "", opts = {}) -> buffer
+ *  flush(dest = nil) -> dest OR new string
  *
- * [opts (hash)]
- *  dict (nil OR string):: decompression with dictionary
+ * Flush the compressed data of all inputs.
  */
 static VALUE
-dec_s_decode(MRB, VALUE self)
+scomp_flush(MRB, VALUE self)
 {
-    VALUE src, dest, dict;
-    mrb_int maxsize;
-    dec_s_decode_args(mrb, &src, &dest, &maxsize, &dict);
-
-    ZSTD_customMem allocator = aux_zstd_allocator(mrb);
-    ZSTD_DStream *zstd = ZSTD_createDStream_advanced(allocator);
+    VALUE dest = Qnil;
+    mrb_get_args(mrb, "|S!", &dest);
 
-    if (NIL_P(dict)) {
-        size_t s = ZSTD_initDStream(zstd);
-        aux_check_error(mrb, s, "ZSTD_initDStream");
-    } else {
-        size_t s = ZSTD_initDStream_usingDict(zstd, RSTRING_PTR(dict), RSTRING_LEN(dict));
-        aux_check_error(mrb, s, "ZSTD_initDStream_usingDict");
-    }
+    return scomp_main(mrb, self, Qnil, dest, ZSTD_e_flush);
+}
 
-    decode_main(mrb, zstd, src, dest, maxsize);
+/*
+ * call-seq:
+ *  finish(dest = nil) -> dest OR new string
+ *
+ * End the current frame. The next +compress+ starts a new frame.
+ */
+static VALUE
+scomp_finish(MRB, VALUE self)
+{
+    VALUE dest = Qnil;
+    mrb_get_args(mrb, "|S!", &dest);
 
-    return dest;
+    return scomp_main(mrb, self, Qnil, dest, ZSTD_e_end);
 }
 
-struct decoder
+struct stream_decompressor
 {
-    struct {
-        ZSTD_DStream *context;
-        ZSTD_customMem allocator;
-        ZSTD_inBuffer bufin;
-    } zstd;
-
-    VALUE io;
-    VALUE dict;
-    VALUE inbuf;
+    ZSTD_DCtx *dctx;
+    mrb_bool finished;
+    VALUE remaining;
 };
 
 static void
-decoder_free(MRB, struct decoder *p)
+stream_decompressor_free(MRB, struct stream_decompressor *p)
 {
-    if (p->zstd.context) {
-        ZSTD_freeDStream(p->zstd.context);
+    if (p->dctx) {
+        ZSTD_freeDCtx(p->dctx);
     }
 
     mrb_free(mrb, p);
 }
 
-static const mrb_data_type decoder_type = {
-    .struct_name = "mruby_zstd.decoder",
-    .dfree = (void (*)(mrb_state *, void *))decoder_free,
+static const mrb_data_type stream_decompressor_type = {
+    .struct_name = "mruby_zstd.stream_decompressor",
+    .dfree = (void (*)(mrb_state *, void *))stream_decompressor_free,
 };
 
-static struct decoder *
-getdecoder(MRB, VALUE self)
+static struct stream_decompressor *
+getstreamdecompressor(MRB, VALUE self)
 {
-    struct decoder *p;
-    Data_Get_Struct(mrb, self, &decoder_type, p);
+    struct stream_decompressor *p;
+    Data_Get_Struct(mrb, self, &stream_decompressor_type, p);
     return p;
 }
 
 static VALUE
-decoder_set_inport(MRB, VALUE self, struct decoder *p, VALUE port)
-{
-    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.inport"), port);
-    p->io = port;
-    return port;
-}
-
-static VALUE
-decoder_set_dict(MRB, VALUE self, struct decoder *p, VALUE dict)
-{
-    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.dictionary"), dict);
-    p->dict = dict;
-    return dict;
-}
-
-static VALUE
-decoder_set_inbuf(MRB, VALUE obj, struct decoder *p, VALUE buf)
+stream_decompressor_set_remaining(MRB, VALUE self, struct stream_decompressor *p, VALUE str)
 {
-    mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-zstd.outbuf"), buf);
-    p->inbuf = buf;
-    return buf;
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.remaining"), str);
+    p->remaining = str;
+    return str;
 }
 
 static VALUE
-dec_s_new(MRB, VALUE self)
+sdecomp_s_new(MRB, VALUE self)
 {
     struct RClass *klass = mrb_class_ptr(self);
     struct RData *rd;
-    struct decoder *p;
-    Data_Make_Struct(mrb, klass, struct decoder, &decoder_type, p, rd);
-    p->zstd.allocator = aux_zstd_allocator(mrb);
-    p->zstd.context = ZSTD_createDStream_advanced(p->zstd.allocator);
+    struct stream_decompressor *p;
+    Data_Make_Struct(mrb, klass, struct stream_decompressor, &stream_decompressor_type, p, rd);
+    p->remaining = Qnil;
 
-    if (!p->zstd.context) {
-        mrb_raise(mrb,
-                  E_RUNTIME_ERROR,
-                  "ZSTD_createDStream_advanced failed");
-    }
+    p->dctx = ZSTD_createDCtx_advanced(aux_zstd_allocator(mrb));
+    if (!p->dctx) { mrb_raise(mrb, E_RUNTIME_ERROR, "ZSTD_createDCtx_advanced failed"); }
 
     VALUE obj = mrb_obj_value(rd);
-    decoder_set_inport(mrb, obj, p, Qnil);
-    decoder_set_inbuf(mrb, obj, p, Qnil);
     mrb_int argc;
     mrb_value *argv;
     mrb_get_args(mrb, "*", &argv, &argc);
@@ -913,213 +7008,132 @@ dec_s_new(MRB, VALUE self)
     return obj;
 }
 
-static void
-dec_initialize_args(MRB, VALUE *inport, VALUE *dict)
-{
-    VALUE *argv;
-    mrb_int argc;
-    mrb_get_args(mrb, "*", &argv, &argc);
-
-    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-        MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
-                MRBX_SCANHASH_ARGS("dict", dict, Qnil));
-        if (!NIL_P(*dict)) {
-            mrb_check_type(mrb, *dict, MRB_TT_STRING);
-            *dict = mrb_str_dup(mrb, *dict);
-        }
-        argc --;
-    } else {
-        *dict = Qnil;
-    }
-
-    switch (argc) {
-    case 1:
-        *inport = argv[0];
-        break;
-    default:
-        mrb_raisef(mrb,
-                   E_ARGUMENT_ERROR,
-                   "wrong number of arguments (given %S, expect 1 with optional keywords)",
-                   mrb_fixnum_value(argc));
-        break;
-    }
-}
-
 /*
  * call-seq:
- *  initialize(input_stream, dict: nil) -> self
+ *  initialize(dict: nil) -> self
  */
 static VALUE
-dec_initialize(MRB, VALUE self)
+sdecomp_initialize(MRB, VALUE self)
 {
-    struct decoder *p = getdecoder(mrb, self);
-    VALUE dict;
-    dec_initialize_args(mrb, &p->io, &dict);
-    decoder_set_inport(mrb, self, p, p->io);
-    decoder_set_dict(mrb, self, p, dict);
+    VALUE opts = Qnil, dict = Qnil;
+    mrb_get_args(mrb, "|H", &opts);
 
-    if (mrb_string_p(p->io)) {
-        decoder_set_inbuf(mrb, self, p, Qnil);
-        p->zstd.bufin.src = RSTRING_PTR(p->io);
-        p->zstd.bufin.size = RSTRING_LEN(p->io);
-        p->zstd.bufin.pos = 0;
-    } else {
-#ifdef MRB_INT16
-        decoder_set_inbuf(mrb, self, p, mrb_str_buf_new(mrb, MRUBY_ZSTD_DEFAULT_PARTIAL_SIZE));
-#else
-        decoder_set_inbuf(mrb, self, p, mrb_str_buf_new(mrb, ZSTD_DStreamInSize()));
-#endif
-        p->zstd.bufin.src = RSTRING_PTR(p->inbuf);
-        p->zstd.bufin.size = RSTRING_LEN(p->inbuf);
-        p->zstd.bufin.pos = 0;
+    if (!NIL_P(opts)) {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("dict", &dict, Qnil));
+        aux_check_dict(mrb, dict);
     }
 
-    if (NIL_P(dict)) {
-        size_t s = ZSTD_initDStream(p->zstd.context);
-        aux_check_error(mrb, s, "ZSTD_initDStream");
-    } else {
-        size_t s = ZSTD_initDStream_usingDict(p->zstd.context, RSTRING_PTR(dict), RSTRING_LEN(dict));
-        aux_check_error(mrb, s, "ZSTD_initDStream_usingDict");
-    }
+    struct stream_decompressor *p = getstreamdecompressor(mrb, self);
+    aux_init_dstream(mrb, p->dctx, dict);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-zstd.dictionary"), dict);
+    stream_decompressor_set_remaining(mrb, self, p, Qnil);
+    p->finished = FALSE;
 
     return self;
 }
 
-static void
-dec_read_args(MRB, VALUE self, intptr_t *size, struct RString **dest)
-{
-    mrbx_get_read_args(mrb, size, dest);
-
-    size_t allocsize = *size;
-
-    if (allocsize == -1) {
-        allocsize = ZSTD_DStreamOutSize() * 2;
-    }
-
-    if (allocsize > AUX_MALLOC_MAX) {
-        *size = AUX_MALLOC_MAX;
-        allocsize = AUX_MALLOC_MAX;
-    }
-
-    mrbx_str_reserve(mrb, *dest, allocsize);
-}
-
 /*
  * call-seq:
- *  read -> string OR nil
- *  read(size) -> string OR nil
- *  read(size, buffer) -> buffer OR nil
+ *  decompress(src, dest = nil) -> dest OR new string
+ *
+ * Decompressed data (may be empty) is appended to +dest+.
+ *
+ * Decompression stops at the end of a frame, and the rest of +src+ is
+ * kept as +remaining_input+. The next call continues from the remaining
+ * input (as the next frame) followed by +src+.
  */
 static VALUE
-dec_read(MRB, VALUE self)
+sdecomp_decompress(MRB, VALUE self)
 {
-    intptr_t size;
-    struct RString *dest;
-    dec_read_args(mrb, self, &size, &dest);
-
-    struct decoder *p = getdecoder(mrb, self);
-
-    if (size == 0) { return mrb_obj_value(dest); }
-
-    ZSTD_outBuffer bufout = {
-        .dst = RSTR_PTR(dest),
-        .size = (size < 0 ? RSTR_CAPA(dest) : size),
-        .pos = 0,
-    };
-
-    while (size == -1 || bufout.pos < size) {
-        if (p->zstd.bufin.pos - p->zstd.bufin.size < 1) {
-            if (NIL_P(p->inbuf)) { break; }
-            size_t readsize = ZSTD_DStreamInSize();
-            if (readsize > AUX_MALLOC_MAX) { readsize = AUX_MALLOC_MAX; }
-            p->inbuf = FUNCALL(mrb, p->io, ID_read, mrb_fixnum_value(RSTRING_CAPA(p->inbuf)), p->inbuf);
-            if (NIL_P(p->inbuf)) {
-                decoder_set_inbuf(mrb, self, p, p->inbuf);
-                break;
-            }
+    VALUE src, dest = Qnil;
+    mrb_get_args(mrb, "S|S!", &src, &dest);
+    struct stream_decompressor *p = getstreamdecompressor(mrb, self);
+
+    if (!NIL_P(p->remaining)) {
+        src = mrb_str_plus(mrb, p->remaining, src);
+    } else if (!NIL_P(dest) && mrb_obj_eq(mrb, src, dest)) {
+        /* 出力先を拡張すると入力が移動してしまうため */
+        src = mrb_str_dup(mrb, src);
+    }
 
-            if (!mrb_string_p(p->inbuf)) {
-                decoder_set_inbuf(mrb, self, p, Qnil);
-                mrb_check_type(mrb, p->inbuf, MRB_TT_STRING);
-            }
+    if (NIL_P(dest)) {
+        dest = mrb_str_buf_new(mrb, ZSTD_DStreamOutSize());
+    }
 
-            decoder_set_inbuf(mrb, self, p, p->inbuf);
-        }
+    ZSTD_inBuffer input = { RSTRING_PTR(src), RSTRING_LEN(src), 0 };
 
-        if (bufout.pos - bufout.size < 1) {
-            size_t s = RSTR_CAPA(dest);
-            if (s == AUX_MALLOC_MAX) { aux_check_error(mrb, ZSTD_error_dstSize_tooSmall, "ZSTD_decompressStream"); }
-            s *= 2;
-            s = CLAMP_MAX(s, AUX_MALLOC_MAX);
-            mrbx_str_reserve(mrb, dest, s);
-            bufout.dst = RSTR_PTR(dest);
-            bufout.size = RSTR_CAPA(dest);
-        }
+    while (input.pos < input.size || !p->finished) {
+        aux_str_reserve_tail(mrb, RSTRING(dest), ZSTD_DStreamOutSize(), "ZSTD_decompressStream");
+        size_t len = RSTRING_LEN(dest);
+        ZSTD_outBuffer output = { RSTRING_PTR(dest) + len, RSTRING_CAPA(dest) - len, 0 };
+        size_t pos = input.pos;
+        size_t s = ZSTD_decompressStream(p->dctx, &output, &input);
+        aux_check_error(mrb, s, "ZSTD_decompressStream");
+        aux_str_set_len(RSTRING(dest), len + output.pos);
 
-        {
-            size_t s = ZSTD_decompressStream(p->zstd.context, &bufout, &p->zstd.bufin);
-            aux_check_error(mrb, s, "ZSTD_decompressStream");
-            if (s < 1) { break; }
+        if (input.pos > pos) { p->finished = FALSE; }
+        if (s == 0) {
+            /* フレームの終わりで止める */
+            p->finished = TRUE;
+            break;
         }
+        if (input.pos >= input.size && output.pos < output.size) { break; }
     }
 
-    RSTR_SET_LEN(dest, bufout.pos);
+    if (input.pos < input.size) {
+        stream_decompressor_set_remaining(mrb, self, p, mrb_str_new(mrb, (const char *)input.src + input.pos, input.size - input.pos));
+    } else {
+        stream_decompressor_set_remaining(mrb, self, p, Qnil);
+    }
 
-    return (bufout.pos == 0 ? Qnil : mrb_obj_value(dest));
+    return dest;
 }
 
 /*
  * call-seq:
- *  close -> nil
+ *  finished? -> true OR false
+ *
+ * Return true if the last frame has ended.
  */
 static VALUE
-dec_close(MRB, VALUE self)
+sdecomp_finished(MRB, VALUE self)
 {
-    return Qnil;
+    return mrb_bool_value(getstreamdecompressor(mrb, self)->finished);
 }
 
 /*
  * call-seq:
- *  eof -> true OR false
+ *  remaining_input -> string
+ *
+ * Input after the end of the last frame that has not been decompressed yet.
  */
 static VALUE
-dec_eof(MRB, VALUE self)
+sdecomp_remaining_input(MRB, VALUE self)
 {
-    mrb_raise(mrb, E_NOTIMP_ERROR, "implement me!");
-    return Qnil;
-}
+    struct stream_decompressor *p = getstreamdecompressor(mrb, self);
 
-/*
- * call-seq:
- *  get_port -> port
- */
-static VALUE
-dec_get_port(MRB, VALUE self)
-{
-    return getdecoder(mrb, self)->io;
+    return (NIL_P(p->remaining) ? mrb_str_new(mrb, NULL, 0) : mrb_str_dup(mrb, p->remaining));
 }
 
 static void
-init_decoder(MRB, struct RClass *mZstd)
+init_stream(MRB, struct RClass *mZstd)
 {
-    struct RClass *cDecoder = mrb_define_class_under(mrb, mZstd, "Decoder", mrb_cObject);
-    mrb_define_class_method(mrb, cDecoder, "decode", dec_s_decode, MRB_ARGS_ANY());
-    mrb_define_class_method(mrb, cDecoder, "new", dec_s_new, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cDecoder, "initialize", dec_initialize, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cDecoder, "read", dec_read, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cDecoder, "close", dec_close, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cDecoder, "eof", dec_eof, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cDecoder, "port", dec_get_port, MRB_ARGS_NONE());
-
-    mrb_define_alias(mrb, cDecoder, "finish", "close");
-    mrb_define_alias(mrb, cDecoder, "eof?", "eof");
+    struct RClass *cStreamCompressor = mrb_define_class_under(mrb, mZstd, "StreamCompressor", mrb_cObject);
+    mrb_define_class_method(mrb, cStreamCompressor, "new", scomp_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cStreamCompressor, "initialize", scomp_initialize, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cStreamCompressor, "compress", scomp_compress, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, cStreamCompressor, "flush", scomp_flush, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cStreamCompressor, "finish", scomp_finish, MRB_ARGS_OPT(1));
+
+    struct RClass *cStreamDecompressor = mrb_define_class_under(mrb, mZstd, "StreamDecompressor", mrb_cObject);
+    mrb_define_class_method(mrb, cStreamDecompressor, "new", sdecomp_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cStreamDecompressor, "initialize", sdecomp_initialize, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cStreamDecompressor, "decompress", sdecomp_decompress, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, cStreamDecompressor, "finished?", sdecomp_finished, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cStreamDecompressor, "remaining_input", sdecomp_remaining_input, MRB_ARGS_NONE());
 }
 
-/*
- * mruby_zstd initializer
- * module Zstd
- */
-
 void
 mrb_mruby_zstd_gem_init(MRB)
 {
@@ -1133,9 +7147,35 @@ mrb_mruby_zstd_gem_init(MRB)
     mrb_define_const(mrb, mZstd, "LEGACY_SUPPORTED", mrb_bool_value(FALSE));
 #endif
 
+#ifdef ZSTD_MULTITHREAD
+    mrb_define_const(mrb, mZstd, "MULTITHREAD_SUPPORTED", mrb_bool_value(TRUE));
+#else
+    mrb_define_const(mrb, mZstd, "MULTITHREAD_SUPPORTED", mrb_bool_value(FALSE));
+#endif
+
+    init_stats(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_context_pool(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_dictionary(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
     init_encoder(mrb, mZstd);
     mrb_gc_arena_restore(mrb, 0);
     init_decoder(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_context(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_frame(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_estimate(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_batch(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_seekable(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_pump(mrb, mZstd);
+    mrb_gc_arena_restore(mrb, 0);
+    init_stream(mrb, mZstd);
 }
 
 void
@@ -28,6 +28,330 @@ assert("Zstd:one step decoding") do
   assert_equal s.byteslice(0, 20), Zstd.decode(ss, 20, d)
 end
 
+assert("Zstd:one step decoding (multiple frames)") do
+  s = "123456789" * 111
+  ss = Zstd.encode(s)
+  assert_equal s * 2, Zstd.decode(ss + ss)
+
+  d = ""
+  Zstd::Encoder.wrap(d) { |z| z << s } # without content size
+  assert_equal s, Zstd.decode(d)
+  assert_equal s * 3, Zstd.decode(d + ss + d)
+  assert_raise(RuntimeError) { Zstd.decode(d.byteslice(0, d.bytesize - 4)) }
+  assert_raise(RuntimeError) { Zstd.decode(ss.byteslice(0, ss.bytesize - 4)) }
+end
+
+assert("Zstd::Context") do
+  s = "123456789" * 111
+
+  ctx = Zstd::Context.new
+  3.times do
+    assert_equal s, ctx.decode(ctx.encode(s, level: 5))
+  end
+  assert_equal s, Zstd.decode(ctx.encode(s))
+  assert_equal s, ctx.decode(Zstd.encode(s))
+
+  d = ""
+  assert_equal d.object_id, ctx.encode(s, d).object_id
+  assert_equal s.byteslice(0, 20), ctx.decode(d, 20)
+  assert_equal ctx, ctx.reset
+end
+
+assert("Zstd::Context - context pool") do
+  s = "123456789" * 111
+  limit = Zstd::Context.pool_limit
+
+  begin
+    Zstd::Context.pool_limit = 1
+    assert_equal s, Zstd.decode(Zstd.encode(s))
+    assert_equal 2, Zstd::Context.pool_size
+    Zstd::Context.trim
+    assert_equal 0, Zstd::Context.pool_size
+
+    Zstd::Context.pool_limit = 0
+    assert_equal s, Zstd.decode(Zstd.encode(s))
+    assert_equal 0, Zstd::Context.pool_size
+    assert_raise(ArgumentError) { Zstd::Context.pool_limit = -1 }
+  ensure
+    Zstd::Context.pool_limit = limit
+  end
+end
+
+assert("Zstd::Dictionary") do
+  d = (1..200).map { |i| "key#{i}:value#{i * 7}," }.join
+  dict = Zstd::Dictionary.new(d, level: 3)
+  assert_equal d, dict.to_s
+  assert_true dict.to_s.frozen?
+  assert_equal d.bytesize, dict.bytesize
+  assert_equal 0, dict.dict_id
+
+  s = "key20:value140,key21:value147,key22:value154," * 3
+  ss = Zstd.encode(s, dict: dict)
+  assert_equal s, Zstd.decode(ss, dict: dict)
+  assert_equal s, Zstd.decode(ss, dict: d)
+  assert_equal s, Zstd.decode(Zstd.encode(s, dict: d), dict: dict)
+  assert_equal s, Zstd.decode(Zstd.encode(s, level: 9, dict: dict), dict: dict)
+
+  dest = ""
+  Zstd::Encoder.wrap(dest, dict: dict) { |z| z << s }
+  assert_equal s, Zstd::Decoder.wrap(dest, dict: dict) { |z| z.read }
+
+  assert_raise(TypeError) { Zstd.encode(s, dict: 1) }
+  assert_raise(TypeError) { Zstd.decode(ss, dict: :dict) }
+end
+
+assert("Zstd::Dictionary - CDict referenced by a live encoder") do
+  d = (1..200).map { |i| "key#{i}:value#{i * 7}," }.join
+  dict = Zstd::Dictionary.new(d)
+  s = "key20:value140,key21:value147,key22:value154," * 30
+
+  dest = ""
+  z = Zstd::Encoder.new(dest, dict: dict, level: 1)
+  z << s
+  # キャッシュの上限を超えて ZSTD_CDict を作らせ、z が参照しているものを追い出す
+  (2..12).each do |level|
+    assert_equal s, Zstd.decode(Zstd.encode(s, dict: dict, level: level), dict: dict)
+    assert_equal s, Zstd.decode(Zstd.encode(s, dict: dict, level: level, srcsize_hint: 100 * level), dict: dict)
+  end
+  z2 = Zstd::StreamCompressor.new(dict: dict, level: 2)
+  d2 = z2.compress(s)
+  (13..19).each { |level| Zstd.encode(s, dict: dict, level: level) }
+  d2 << z2.finish
+  assert_equal s, Zstd.decode(d2, dict: dict)
+  z << s
+  z.close
+  assert_equal s * 2, Zstd.decode(dest, dict: dict)
+
+  z.reset
+  z << s
+  z.close
+  assert_equal s * 3, Zstd.decode(dest, dict: dict)
+end
+
+assert("Zstd::Dictionary.train") do
+  seed = 12345
+  samples = (0...2000).map do |i|
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff
+    %({"id":#{i},"name":"user#{seed % 1000}","status":"#{%w(active idle banned)[seed % 3]}","score":#{seed % 97}})
+  end
+
+  dict = Zstd.train_dictionary(samples, capacity: 4096)
+  assert_kind_of Zstd::Dictionary, dict
+  assert_true dict.bytesize <= 4096
+  assert_not_equal 0, dict.dict_id
+  assert_equal dict.dict_id, Zstd::Dictionary.dict_id(dict.to_s)
+
+  s = samples[77]
+  assert_equal s, Zstd.decode(Zstd.encode(s, dict: dict), dict: dict)
+  assert_true Zstd.encode(s, dict: dict).bytesize < Zstd.encode(s).bytesize
+
+  dict2 = Zstd::Dictionary.train(samples, capacity: 4096, algorithm: :cover, k: 64, d: 8, steps: 4, dict_id: 1234)
+  assert_equal 1234, dict2.dict_id
+  assert_equal s, Zstd.decode(Zstd.encode(s, dict: dict2), dict: dict2)
+
+  dict3 = Zstd::Dictionary.finalize(samples.first(50).join, samples, capacity: 8192, dict_id: 5678)
+  assert_equal 5678, dict3.dict_id
+  assert_equal s, Zstd.decode(Zstd.encode(s, dict: dict3), dict: dict3)
+
+  assert_raise(ArgumentError) { Zstd.train_dictionary(samples, algorithm: :unknown) }
+  assert_raise(TypeError) { Zstd.train_dictionary([1, 2, 3]) }
+end
+
+assert("Zstd:multithreaded encoding") do
+  s = "123456789" * 11111 + "ABCDEFG"
+
+  ss = Zstd.encode(s, level: 3, workers: 2, jobsize: 0, overlaplog: 0)
+  assert_equal s, Zstd.decode(ss)
+
+  d = ""
+  Zstd::Encoder.wrap(d, workers: 2) do |zstd|
+    10.times { zstd << s }
+    prog = zstd.progress
+    assert_kind_of Hash, prog
+    assert_equal s.bytesize * 10, prog[:ingested]
+    assert_kind_of Integer, zstd.flushable
+  end
+  assert_equal s * 10, Zstd.decode(d)
+end
+
+assert("Zstd:advanced parameters") do
+  s = ("123456789" * 1111 + "ABCDEFG") * 11
+
+  [
+    { windowlog: 20, chainlog: 16, hashlog: 17, searchlog: 3, minmatch: 5, targetlength: 16, strategy: :lazy2 },
+    { contentsize: false, checksum: true, nodictid: true },
+    { ldm: true, windowlog: 24 },
+    { ldm: true, ldm_hashlog: 20, ldm_minmatch: 64, ldm_bucketsizelog: 3, ldm_hashratelog: 4 },
+    { target_cblock_size: 1024 },
+  ].each do |opts|
+    assert_equal s, Zstd.decode(Zstd.encode(s, opts)), opts.inspect
+  end
+
+  d = ""
+  Zstd::Encoder.wrap(d, level: 5, srcsize_hint: s.bytesize, ldm: true) { |z| z << s }
+  assert_equal s, Zstd.decode(d)
+
+  d = ""
+  Zstd::Encoder.wrap(d, estimatedsize: 1000) { |z| z << s }
+  assert_equal s, Zstd.decode(d)
+
+  assert_raise(RuntimeError) { Zstd.encode(s, windowlog: 99) }
+  assert_raise(ArgumentError) { Zstd.encode(s, strategy: :unknown) }
+end
+
+assert("Zstd.frame_info / Zstd.each_frame") do
+  s = "123456789" * 1111
+  f1 = Zstd.encode(s, checksum: true)
+  skip = "\x53\x2a\x4d\x18\x05\x00\x00\x00hello"
+  f2 = ""
+  Zstd::Encoder.wrap(f2) { |z| z << s }
+  dict = Zstd::Dictionary.new("123456789" * 100, level: 1)
+  f3 = Zstd.encode(s, dict: dict)
+  d = f1 + skip + f2 + f3
+
+  info = Zstd.frame_info(d)
+  assert_equal 0, info[:offset]
+  assert_equal :frame, info[:type]
+  assert_equal f1.bytesize, info[:frame_size]
+  assert_equal s.bytesize, info[:content_size]
+  assert_true info[:checksum]
+  assert_equal 0, info[:dict_id]
+  assert_kind_of Integer, info[:window_size]
+
+  info = Zstd.frame_info(d, f1.bytesize)
+  assert_equal :skippable, info[:type]
+  assert_equal skip.bytesize, info[:frame_size]
+  assert_equal 5, info[:content_size]
+  assert_equal 3, info[:magic_variant]
+
+  frames = Zstd.each_frame(d)
+  assert_equal [:frame, :skippable, :frame, :frame], frames.map { |e| e[:type] }
+  assert_equal [f1, skip, f2, f3].map(&:bytesize), frames.map { |e| e[:frame_size] }
+  assert_nil frames[2][:content_size]
+  assert_equal dict.dict_id, frames[3][:dict_id]
+
+  offsets = []
+  assert_same d, Zstd.each_frame(d) { |e| offsets << e[:offset] }
+  assert_equal frames.map { |e| e[:offset] }, offsets
+
+  assert_raise(RuntimeError) { Zstd.frame_info(f1[0, 3]) }
+  assert_raise(RuntimeError) { Zstd.frame_info(f1[0, f1.bytesize - 1]) }
+  assert_raise(RuntimeError) { Zstd.frame_info("not zstd frame") }
+  assert_raise(ArgumentError) { Zstd.frame_info(d, d.bytesize + 1) }
+end
+
+assert("Zstd:multi-frame encoding and parallel decoding") do
+  s = (0...5000).map { |i| "#{i}:" + "123456789ABCDEFG"[i % 16, 16] }.join("\n")
+
+  [{ frames: 1 }, { frames: 7 }, { frame_size: 4096, threads: 3 }, { frame_size: s.bytesize * 2 }].each do |opts|
+    d = Zstd.encode(s, opts)
+    frames = Zstd.each_frame(d)
+    if opts[:frames]
+      assert_equal opts[:frames], frames.size, opts.inspect
+    else
+      assert_equal (s.bytesize + opts[:frame_size] - 1) / opts[:frame_size], frames.size, opts.inspect
+    end
+    assert_equal s.bytesize, frames.inject(0) { |a, e| a + e[:content_size] }
+    assert_equal s, Zstd.decode(d), opts.inspect
+    assert_equal s, Zstd.decode(d, threads: 4), opts.inspect
+  end
+
+  dict = Zstd::Dictionary.new("123456789ABCDEFG" * 64)
+  d = Zstd.encode(s, frames: 5, dict: dict, level: 7)
+  assert_equal s, Zstd.decode(d, dict: dict, threads: 3)
+  assert_equal s, Zstd::Context.new.decode(Zstd::Context.new.encode(s, frames: 3), threads: 2)
+
+  assert_equal 1, Zstd.each_frame(Zstd.encode("", frames: 4)).size
+  assert_raise(RuntimeError) { Zstd.encode(s, 10, frames: 3) }
+  assert_raise(ArgumentError) { Zstd.encode(s, frames: 0) }
+  assert_raise(ArgumentError) { Zstd.encode(s, frames: 2, frame_size: 100) }
+  broken = Zstd.encode(s, frames: 3, checksum: true)
+  broken.setbyte(-10, broken.getbyte(-10) ^ 0xff)
+  assert_raise(RuntimeError) { Zstd.decode(broken, threads: 3) }
+end
+
+assert("Zstd:batch processing") do
+  srcs = (0...20).map { |i| "#{i}:" + "123456789" * (i * 100) + "ABCDEFG" }
+  srcs << ""
+
+  [{}, { level: 9, threads: 4 }, { threads: 100 }].each do |opts|
+    dests = Zstd.encode_batch(srcs, opts)
+    assert_equal srcs.size, dests.size
+    dests.each_with_index { |d, i| assert_equal srcs[i], Zstd.decode(d), opts.inspect }
+    assert_equal srcs, Zstd.decode_batch(dests, threads: opts[:threads])
+  end
+
+  # 伸長後の大きさを持たないフレーム
+  streamed = srcs.map { |s| d = ""; Zstd::Encoder.wrap(d) { |z| z << s }; d }
+  assert_equal srcs, Zstd.decode_batch(streamed, threads: 3)
+
+  dict = Zstd::Dictionary.new("123456789" * 100)
+  [dict, dict.to_s].each do |di|
+    dests = Zstd.encode_batch(srcs, dict: di, threads: 2)
+    assert_equal srcs, Zstd.decode_batch(dests, dict: di, threads: 2)
+  end
+
+  assert_equal [], Zstd.encode_batch([])
+  assert_raise(TypeError) { Zstd.encode_batch(["a", 1]) }
+  assert_raise(ArgumentError) { Zstd.encode_batch(srcs, pledgedsize: 1) }
+  assert_raise(RuntimeError) { Zstd.decode_batch([Zstd.encode("abc"), "broken"], threads: 2) }
+  # 伸長後の大きさを 2 GiB 近くと偽るフレームを並べても、その分の領域を事前に確保しない
+  liar = "\x28\xb5\x2f\xfd\xa0\x00\x00\xff\x7f\x09\x00\x00a"
+  assert_raise(RuntimeError) { Zstd.decode_batch([liar] * 8, threads: 2) }
+end
+
+assert("Zstd::SeekableEncoder / Zstd::SeekableDecoder") do
+  s = (0...3000).map { |i| "#{i}:" + "123456789ABCDEFG"[i % 16, 16] }.join("\n")
+
+  d = ""
+  Zstd::SeekableEncoder.wrap(d, frame_size: 1000, level: 5) do |z|
+    z << s[0, 10]
+    z << s[10, 5000]
+    z.end_frame
+    z << s[5010 .. -1]
+  end
+
+  # 通常の伸長処理では seek table は読み飛ばされる
+  assert_equal s, Zstd.decode(d)
+
+  zs = Zstd::SeekableDecoder.new(d, cache: 2)
+  assert_equal s.bytesize, zs.size
+  assert_equal (5010 + 999) / 1000 + (s.bytesize - 5010 + 999) / 1000, zs.frame_count
+  assert_equal s, zs.pread(0, s.bytesize)
+  [[0, 1], [999, 2], [5005, 10], [12345, 3456], [s.bytesize - 5, 100]].each do |off, len|
+    assert_equal s[off, len], zs.pread(off, len), [off, len].inspect
+  end
+  assert_equal "", zs.pread(s.bytesize, 10)
+  buf = "xyz"
+  assert_same buf, zs.pread(100, 10, buf)
+  assert_equal s[100, 10], buf
+
+  d2 = ""
+  Zstd::SeekableEncoder.wrap(d2, frame_size: 512, table_checksum: false) { |z| z << s }
+  assert_equal s[2000, 3000], Zstd::SeekableDecoder.new(d2).pread(2000, 3000)
+
+  d3 = ""
+  Zstd::SeekableEncoder.wrap(d3) { |z| }
+  assert_equal 0, Zstd::SeekableDecoder.new(d3).size
+
+  broken = d.dup
+  broken.setbyte(-20, broken.getbyte(-20) ^ 0xff)
+  assert_raise(RuntimeError) { Zstd::SeekableDecoder.new(broken).pread(0, s.bytesize) }
+  assert_raise(RuntimeError) { Zstd::SeekableDecoder.new(s) }
+  assert_raise(ArgumentError) { Zstd::SeekableEncoder.new("", frame_size: 0) }
+
+  # seek table の伸長後の大きさを偽って、巨大な領域を確保させることは出来ない
+  d4 = ""
+  Zstd::SeekableEncoder.wrap(d4, table_checksum: false) { |z| z << "abc" * 10 }
+  liar = d4.dup
+  [0xff, 0xff, 0xff, 0x7f].each_with_index { |b, i| liar.setbyte(-13 + i, b) }
+  assert_raise(RuntimeError) { Zstd::SeekableDecoder.new(liar) }
+  liar = d4.dup
+  [0x20, 0xa1, 0x07, 0x00].each_with_index { |b, i| liar.setbyte(-13 + i, b) } # 500000
+  assert_raise(RuntimeError) { Zstd::SeekableDecoder.new(liar).pread(0, 30) }
+  assert_equal "abc" * 10, Zstd::SeekableDecoder.new(d4).pread(0, 30)
+end
+
 assert("Zstd:stream encoding") do
   s0 = "123456789"
   times = 111
@@ -41,6 +365,428 @@ assert("Zstd:stream encoding") do
   assert_equal s, Zstd.decode(d)
 end
 
+assert("Zstd:stream encoding into string") do
+  s = "123456789abcdefg" * 11111
+  d = "head"
+  Zstd::Encoder.wrap(d) do |z|
+    z << s
+    z.flush
+    z << d
+  end
+
+  assert_equal "head", d[0, 4]
+  z = Zstd::Decoder.new(d[4..-1])
+  assert_equal s, z.read(s.bytesize)
+  assert_equal "head", z.read(4)
+
+  assert_raise(RuntimeError) { Zstd::Encoder.wrap("".freeze) { |z| z << s } }
+end
+
+assert("Zstd:stream encoding with output buffer options") do
+  s = "123456789abcdefg" * 11111 + (0...5000).map { |i| (33 + i * 7 % 90).chr }.join
+
+  sink = Object.new
+  def sink.chunks; @chunks ||= []; end
+  def sink.ids; @ids ||= []; end
+  def sink.<<(d); chunks << d.dup; ids << d.object_id; self; end
+
+  Zstd::Encoder.wrap(sink, outbuf_size: 100, coalesce: true, level: 1) do |z|
+    i = 0
+    while i < s.bytesize
+      z << s[i, 997]
+      i += 997
+    end
+  end
+  assert_equal s, Zstd.decode(sink.chunks.join)
+  assert_true sink.chunks[0...-1].all? { |d| d.bytesize == 100 }
+  assert_equal 1, sink.ids.uniq.size
+
+  sink.chunks.clear; sink.ids.clear
+  Zstd::Encoder.wrap(sink, outbuf_size: 100, outbuf_mode: :double) { |z| z << s }
+  assert_equal s, Zstd.decode(sink.chunks.join)
+  assert_equal 2, sink.ids.uniq.size
+  assert_not_equal sink.ids[0], sink.ids[1]
+
+  donated = []
+  Zstd::Encoder.wrap(donated, outbuf_size: 100, outbuf_mode: :donate) { |z| z << s }
+  assert_equal s, Zstd.decode(donated.join)
+  assert_equal donated.size, donated.map(&:object_id).uniq.size
+
+  assert_raise(ArgumentError) { Zstd::Encoder.new("", outbuf_size: 0) }
+  assert_raise(ArgumentError) { Zstd::Encoder.new("", outbuf_mode: :foo) }
+end
+
+assert("Zstd::StreamCompressor / Zstd::StreamDecompressor") do
+  s = "123456789abcdefg" * 11111
+
+  c = Zstd::StreamCompressor.new(level: 1, checksum: true)
+  d = ""
+  c.compress(s[0, 1000], d)
+  c.compress(s[1000..-1], d)
+  c.flush(d)
+  assert_equal s, Zstd::StreamDecompressor.new.decompress(d)
+  c.finish(d)
+  assert_equal s, Zstd.decode(d)
+  f2 = c.compress("end") + c.finish
+  assert_equal "end", Zstd.decode(f2)
+
+  z = Zstd::StreamDecompressor.new
+  out = ""
+  i = 0
+  while i < d.bytesize
+    z.decompress(d[i, 333], out)
+    i += 333
+  end
+  assert_equal s, out
+  assert_true z.finished?
+
+  z = Zstd::StreamDecompressor.new
+  out = z.decompress(d + f2)
+  assert_equal s, out
+  assert_true z.finished?
+  assert_equal f2, z.remaining_input
+  assert_equal s + "end", z.decompress("", out)
+  assert_true z.finished?
+  assert_equal "", z.remaining_input
+
+  z = Zstd::StreamDecompressor.new
+  assert_equal "", z.decompress(d[0, 10])
+  assert_false z.finished?
+
+  dict = Zstd::Dictionary.new("123456789abcdefg" * 100, level: 1)
+  c = Zstd::StreamCompressor.new(dict: dict)
+  d = c.compress(s) << c.finish
+  assert_equal s, Zstd::StreamDecompressor.new(dict: dict).decompress(d)
+end
+
+assert("Zstd::Decoder#gets / #each_line / #each_chunk / #getc / #ungetc") do
+  lines = (1..3000).map { |i| "line #{i}\n" }
+  s = lines.join + "last"
+  d = Zstd.encode(s[0, 5000]) + Zstd.encode(s[5000..-1])
+
+  Zstd::Decoder.wrap(d) do |z|
+    assert_equal lines[0], z.gets
+    assert_equal "li", z.gets(2)
+    assert_equal "ne 2\n", z.gets
+    assert_equal "line 3\nline ", z.gets(" ")
+    assert_equal "4\nline 5\n", z.gets("5\n")
+    z.ungetc("xyz")
+    assert_equal "xyzline 6\n", z.gets
+    assert_equal "l".ord, z.getbyte
+    assert_equal "i", z.getc
+    z.ungetc("i".ord)
+    assert_equal "ine 7\n", z.gets
+    assert_equal "line 8\nline 9", z.read(13)
+    rest = []
+    z.each_line { |l| rest << l }
+    assert_equal "\n" + lines[9..-1].join + "last", rest.join
+    assert_equal "last", rest[-1]
+    assert_equal nil, z.gets
+    assert_equal nil, z.getc
+  end
+
+  Zstd::Decoder.wrap(d) do |z|
+    chunks = []
+    z.each_chunk(1000) { |c| chunks << c }
+    assert_equal s, chunks.join
+    assert_true chunks[0...-1].all? { |c| c.bytesize == 1000 }
+  end
+
+  Zstd::Decoder.wrap(d) do |z|
+    sum = 0
+    z.each_byte { |b| sum += b }
+    assert_equal s.bytes.inject(0) { |a, b| a + b }, sum
+  end
+
+  Zstd::Decoder.wrap(Zstd.encode("\n\npara 1\nline\n\n\npara 2")) do |z|
+    assert_equal "para 1\nline\n\n", z.gets("")
+    assert_equal "para 2", z.gets("")
+    assert_equal nil, z.gets("")
+  end
+
+  Zstd::Decoder.wrap(d) { |z| assert_equal s, z.gets(nil) }
+end
+
+assert("Zstd::Decoder#eof? / #pos / #skip / #seek / #close") do
+  s = (1..5000).map { |i| "record #{i}\n" }.join
+  d = Zstd.encode(s[0, 20000]) + Zstd.encode(s[20000..-1])
+
+  Zstd::Decoder.wrap(d) do |z|
+    assert_equal 0, z.pos
+    assert_equal 0, z.compressed_pos
+    assert_false z.eof?
+    assert_equal 0, z.pos
+    assert_equal s[0, 10], z.read(10)
+    assert_equal 10, z.tell
+    assert_equal 30000, z.skip(30000)
+    assert_equal 30010, z.pos
+    assert_equal s[30010, 5], z.read(5)
+    assert_equal 0, z.seek(50000)
+    assert_equal s[50000, 20], z.gets(20)
+    assert_equal 0, z.seek(10, IO::SEEK_CUR) if Object.const_defined?(:IO)
+    assert_equal 0, z.seek(10, :CUR)
+    assert_equal s[50040..-1], z.read
+    assert_equal s.bytesize, z.pos
+    assert_equal d.bytesize, z.compressed_pos
+    assert_true z.eof?
+    assert_equal 0, z.skip(100)
+    assert_raise(RuntimeError) { z.seek(0) }
+  end
+
+  Zstd::Decoder.wrap(d) do |z|
+    assert_equal 100, z.skip(100)
+    assert_raise(RuntimeError) { z.seek(s.bytesize + 1) }
+    assert_true z.eof?
+  end
+
+  Zstd::Decoder.wrap(d) do |z|
+    assert_equal s[0, 5], z.read(5)
+    z.close
+    assert_equal 5, z.pos
+    assert_raise(RuntimeError) { z.read }
+    assert_raise(RuntimeError) { z.gets }
+    assert_raise(RuntimeError) { z.eof? }
+    assert_nil z.close
+  end
+
+  z = Zstd::Decoder.new(d)
+  z.close
+  z.send(:initialize, d)
+  assert_equal s, z.read
+end
+
+assert("Zstd::Encoder#reset / Zstd::Decoder#reset") do
+  dict = Zstd::Dictionary.new((1..100).map { |i| "message #{i}: payload payload," }.join)
+  msgs = (1..20).map { |i| "message #{i}: " + "payload " * (i % 5 + 1) }
+
+  z = Zstd::Encoder.new(nil, level: 5, dict: dict)
+  frames = msgs.map do |m|
+    out = ""
+    z.reset(out, pledgedsize: m.bytesize)
+    z << m
+    z.close
+    out
+  end
+
+  frames.each_with_index do |f, i|
+    assert_equal msgs[i].bytesize, Zstd.frame_info(f)[:content_size]
+  end
+
+  d = Zstd::Decoder.new(frames[0], dict: dict)
+  frames.each_with_index do |f, i|
+    d.reset(f)
+    assert_equal 0, d.pos
+    assert_equal msgs[i], d.read
+  end
+
+  # 読みかけのデータは捨てる
+  d.reset(frames[0])
+  assert_equal msgs[0][0, 3], d.read(3)
+  d.reset(frames[1] + frames[2])
+  assert_equal msgs[1] + msgs[2], d.gets(nil)
+
+  d.close
+  d.reset(frames[3])
+  assert_equal msgs[3], d.read
+
+  # 書きかけのデータは捨てる
+  z.reset("")
+  z << "garbage"
+  out = ""
+  z.reset(out)
+  z << msgs[0]
+  z.close
+  assert_equal msgs[0], Zstd.decode(out, dict: dict)
+
+  assert_raise(ArgumentError) { z.reset(out, pledgedsize: -1) }
+  assert_raise(ArgumentError) { z.reset(out, out) }
+end
+
+assert("Zstd max_window_log / max_output / memory estimation") do
+  s = "0123456789abcdef" * 4096
+  big = Zstd.encode(s, windowlog: 20)
+  streamed = ""
+  Zstd::Encoder.wrap(streamed, windowlog: 20) { |z| z << s }
+
+  assert_equal s, Zstd.decode(big, max_output: s.bytesize)
+  assert_raise(RuntimeError) { Zstd.decode(big, max_output: s.bytesize - 1) }
+  assert_equal s, Zstd.decode(streamed, max_output: s.bytesize)
+  assert_raise(RuntimeError) { Zstd.decode(streamed, max_output: 1000) }
+  assert_raise(RuntimeError) { Zstd.decode(streamed, max_window_log: 12) }
+  assert_equal s, Zstd.decode(streamed, max_window_log: 20)
+  assert_raise(ArgumentError) { Zstd.decode(streamed, max_window_log: 1) }
+  # プールされたコンテキストに max_window_log が残らない
+  assert_equal s, Zstd.decode(streamed)
+  # 伸長後の大きさを持つフレームでも max_window_log が効く
+  assert_raise(RuntimeError) { Zstd.decode(big, max_window_log: 12) }
+  assert_equal s, Zstd.decode(big, max_window_log: 20)
+
+  # 伸長後の大きさを 2 GiB 近くと偽る 13 バイトのフレームで、それだけの領域を確保しない
+  liar = "\x28\xb5\x2f\xfd\xa0\x00\x00\xff\x7f\x09\x00\x00a"
+  assert_raise(RuntimeError) { Zstd.decode(liar) }
+
+  assert_raise(RuntimeError) { Zstd::Decoder.wrap(streamed, max_window_log: 12) { |z| z.read } }
+  assert_equal s, Zstd::Decoder.wrap(streamed, max_window_log: 20) { |z| z.read }
+  Zstd::Decoder.wrap(streamed, max_output: 10000) do |z|
+    assert_raise(RuntimeError) { z.read }
+  end
+  Zstd::Decoder.wrap(streamed, max_output: s.bytesize) do |z|
+    assert_equal s, z.read
+    z.reset(streamed)
+    assert_equal s.bytesize, z.skip(s.bytesize + 1)
+  end
+
+  e1 = Zstd.estimate_encoder_memory(level: 1)
+  e19 = Zstd.estimate_encoder_memory(level: 19)
+  assert_true e1 > 0
+  assert_true e19 > e1
+  assert_true Zstd.estimate_encoder_memory(level: 19, windowlog: 16) < e19
+  assert_true Zstd.estimate_encoder_memory(level: 19, srcsize_hint: 1000) < e19
+
+  d = Zstd.estimate_decoder_memory(streamed)
+  assert_true d > 1 << 20
+  assert_equal Zstd.estimate_decoder_memory(windowlog: 20), d
+  assert_true Zstd.estimate_decoder_memory(windowlog: 10) < d
+  assert_raise(ArgumentError) { Zstd.estimate_decoder_memory(windowlog: 1) }
+
+  enc = Zstd::Encoder.new("", level: 3)
+  assert_true enc.memsize > 0
+  enc << s
+  enc.close
+  dec = Zstd::Decoder.new(streamed)
+  dec.read(10)
+  assert_true dec.memsize > 1 << 20
+  dec.close
+  assert_equal 0, dec.memsize
+end
+
+assert("Zstd::Encoder / Zstd::Decoder with workspace") do
+  s = "0123456789abcdef" * 4096 + "end"
+  need = Zstd.estimate_encoder_memory(level: 3, windowlog: 17)
+
+  ws = "\0" * (need + 1024)
+  d = ""
+  Zstd::Encoder.wrap(d, level: 3, windowlog: 17, workspace: ws) { |z| z << s }
+  assert_true ws.frozen?
+  assert_equal s, Zstd.decode(d)
+
+  d2 = ""
+  Zstd::Encoder.wrap(d2, level: 3, windowlog: 17, workspace: true) { |z| z << s }
+  assert_equal s, Zstd.decode(d2)
+
+  assert_raise(ArgumentError) { Zstd::Encoder.new("", level: 3, windowlog: 17, workspace: 1000) }
+  assert_raise(ArgumentError) { Zstd::Encoder.new("", level: 3, windowlog: 17, workspace: "\0" * 1000) }
+  assert_raise(ArgumentError) { Zstd::Encoder.new("", level: 3, windowlog: 17, ldm: true, workspace: true) }
+
+  dict = (1..100).map { |i| "0123456789abcdef#{i}," }.join
+  d3 = ""
+  z = Zstd::Encoder.new(d3, level: 3, windowlog: 17, dict: dict, workspace: true)
+  z << s
+  z.close
+  assert_equal s, Zstd.decode(d3, dict: dict)
+  z.reset(d3 = "")
+  z << s
+  z.close
+  assert_equal s, Zstd.decode(d3, dict: dict)
+
+  Zstd::Decoder.wrap(d, max_window_log: 17, workspace: true) do |z|
+    assert_equal "0123", z.gets("3")
+    assert_equal s[4..-1], z.read
+  end
+  Zstd::Decoder.wrap(d3, dict: dict, max_window_log: 17, workspace: true) { |z| assert_equal s, z.read }
+
+  z = Zstd::Decoder.new(d, max_window_log: 17, workspace: true)
+  z.close
+  z.reset(d2)
+  assert_equal s, z.read
+
+  # 作業領域に収まらないウィンドウのフレーム
+  big = ""
+  Zstd::Encoder.wrap(big, windowlog: 20) { |z| z << s }
+  assert_raise(RuntimeError) { Zstd::Decoder.wrap(big, max_window_log: 17, workspace: true) { |z| z.read } }
+end
+
+assert("Zstd::Encoder with adapt: true") do
+  sink = Object.new
+  def sink.<<(buf)
+    (@out ||= "") << buf
+    self
+  end
+  def sink.out
+    @out
+  end
+
+  # フレームの途中でレベルを変更できるのはマルチスレッド圧縮に限られる
+  assert_raise(ArgumentError) { Zstd::Encoder.new(sink, adapt: true) }
+  assert_raise(ArgumentError) { Zstd::Encoder.new(sink, min_level: 1) }
+
+  skip "(without ZSTD_MULTITHREAD)" unless Zstd::MULTITHREAD_SUPPORTED
+
+  words = %w(alpha bravo charlie delta echo foxtrot golf hotel india juliet 0 1 2 3 4 5 6 7 8 9)
+  x = 1
+  s = ""
+  while s.bytesize < 4 << 20
+    x = (x * 75 + 74) % 65537
+    s << words[x % words.size] << " "
+  end
+
+  # レベルの推移は実行環境の速さに依存するため、範囲に収まることだけを確認する
+  z = Zstd::Encoder.new(sink, level: 5, workers: 2, adapt: true, min_level: 2, max_level: 6)
+  assert_equal 5, z.level
+  0.step(s.bytesize - 1, 65536) { |i| z << s.byteslice(i, 65536) }
+  z.close
+  assert_true (2..6).include?(z.level)
+  assert_equal s, Zstd.decode(sink.out)
+
+  # 単一のフレームのままなので、一度の read で全て読める
+  assert_equal s, Zstd::Decoder.wrap(sink.out) { |y| y.read }
+
+  slowport = Object.new
+  def slowport.<<(buf)
+    2000.times { }
+    self
+  end
+  z = Zstd::Encoder.new(slowport, level: 1, workers: 2, adapt: true, max_level: 4, outbuf_size: 256)
+  0.step(s.bytesize - 1, 65536) { |i| z << s.byteslice(i, 65536) }
+  z.close
+  assert_true (1..4).include?(z.level)
+
+  assert_raise(ArgumentError) { Zstd::Encoder.new(sink, workers: 2, adapt: true, min_level: 5, max_level: 3) }
+  assert_raise(ArgumentError) { Zstd::Encoder.new(sink, workers: 2, adapt: true, dict: Zstd::Dictionary.new("123456789" * 100)) }
+  assert_raise(ArgumentError) { Zstd::Encoder.new(sink, workers: 2, adapt: true, workspace: true) }
+  assert_raise(ArgumentError) { Zstd::Encoder.new("", workers: 2, adapt: true) }
+  assert_raise(ArgumentError) { Zstd::Encoder.new(sink, workers: 2, adapt: true).reset("") }
+end
+
+assert("Zstd::Encoder#stats / Zstd::Decoder#stats / Zstd.stats") do
+  next unless Zstd::STATS_SUPPORTED
+
+  Zstd.reset_stats
+  src = "abcdefghijklmnopqrstuvwxyz" * 1000
+
+  enc = Zstd::Encoder.new("")
+  enc << src
+  enc.close
+  est = enc.stats
+  assert_equal src.bytesize, est[:bytes_in]
+  assert_equal enc.port.bytesize, est[:bytes_out]
+  assert_true est[:zstd_calls] > 0
+  assert_true est[:alloc_bytes_total] > 0
+
+  dec = Zstd::Decoder.new(enc.port)
+  assert_equal src, dec.read
+  dst = dec.stats
+  assert_equal enc.port.bytesize, dst[:bytes_in]
+  assert_equal src.bytesize, dst[:bytes_out]
+
+  g = Zstd.stats
+  assert_true g[:bytes_in] >= est[:bytes_in] + dst[:bytes_in]
+  assert_true g[:zstd_calls] >= est[:zstd_calls] + dst[:zstd_calls]
+
+  Zstd.reset_stats
+  assert_equal 0, Zstd.stats[:zstd_calls]
+end
+
 assert("Zstd:stream decoding1") do
   s = "123456789" * 111
   ss = Zstd.encode(s)
@@ -147,6 +893,146 @@ assert("Zstd:large stream encoding with IO") do
   end
 end
 
+assert("Zstd:stream encoding into file descriptor") do
+  skip "(without mruby-io)" unless Object.const_defined?(:File)
+
+  s = "123456789abcdefg" * 11111
+  File.open("#SAMPLE.fd.zst", "wb") do |dest|
+    Zstd.encode(dest) { |z| 10.times { z << s }; z.flush; z << "end" }
+  end
+  File.open("#SAMPLE.fd2.zst", "wb") do |dest|
+    Zstd.encode(nil, fd: dest.fileno) { |z| z << s }
+  end
+  File.open("#SAMPLE.nofd.zst", "wb") do |dest|
+    Zstd.encode(dest, fd: false) { |z| z << s }
+  end
+
+  assert_equal s * 10 + "end", Zstd.decode(File.open("#SAMPLE.fd.zst", "rb") { |f| f.read })
+  assert_equal s, Zstd.decode(File.open("#SAMPLE.fd2.zst", "rb") { |f| f.read })
+  assert_equal s, Zstd.decode(File.open("#SAMPLE.nofd.zst", "rb") { |f| f.read })
+end
+
+assert("Zstd:stream decoding from file descriptor") do
+  skip "(without mruby-io)" unless Object.const_defined?(:File)
+
+  s = "123456789abcdefg" * 11111
+  File.open("#SAMPLE.fd.zst", "wb") { |f| f << Zstd.encode(s) << Zstd.encode("end") }
+  File.open("#SAMPLE.empty.zst", "wb") { |f| }
+
+  File.open("#SAMPLE.fd.zst", "rb") do |f|
+    Zstd.decode(f, fd: true) do |z|
+      assert_equal s[0, 100], z.read(100)
+      assert_equal s[100..-1], z.read
+      assert_equal "end", z.read
+      assert_equal nil, z.read
+    end
+  end
+  File.open("#SAMPLE.fd.zst", "rb") do |f|
+    assert_equal s + "end", Zstd.decode(nil, fd: f.fileno) { |z| z.read + z.read }
+  end
+  File.open("#SAMPLE.fd.zst", "rb") do |f|
+    assert_equal s + "end", Zstd.decode(f) { |z| z.read + z.read }
+  end
+  # fd: を与えなければ、入力元が先に読み込んで溜めているデータも伸長する
+  File.open("#SAMPLE.fd.zst", "wb") { |f| f << "head" << Zstd.encode(s) }
+  File.open("#SAMPLE.fd.zst", "rb") do |f|
+    assert_equal "head", f.read(4)
+    assert_equal s, Zstd.decode(f) { |z| z.read }
+  end
+  File.open("#SAMPLE.empty.zst", "rb") do |f|
+    assert_equal nil, Zstd.decode(f, fd: true) { |z| z.read }
+  end
+end
+
+assert("Zstd.copy_stream") do
+  src = Object.new
+  def src.data=(s); @data = s; end
+  def src.read(size); @data.slice!(0, size); end
+
+  s = "123456789abcdefg" * 111111
+  src.data = s.dup
+  size = Zstd.copy_stream(src, d = "", :encode, level: 1)
+  assert_equal d.bytesize, size
+  assert_equal s, Zstd.decode(d)
+
+  src.data = d + Zstd.encode("end")
+  assert_equal s.bytesize + 3, Zstd.copy_stream(src, d2 = "", :decode)
+  assert_equal s + "end", d2
+
+  src.data = d[0, d.bytesize - 1]
+  assert_raise(RuntimeError) { Zstd.copy_stream(src, "", :decode) }
+  assert_raise(ArgumentError) { Zstd.copy_stream(src, "", :foo) }
+end
+
+assert("Zstd.compress_file / Zstd.decompress_file") do
+  skip "(without mruby-io)" unless Object.const_defined?(:File)
+
+  s = "123456789abcdefg" * 111111
+  File.open("#SAMPLE.src", "wb") { |f| f << s }
+
+  size = Zstd.compress_file("#SAMPLE.src", "#SAMPLE.src.zst", level: 3, checksum: true)
+  d = File.open("#SAMPLE.src.zst", "rb") { |f| f.read }
+  assert_equal d.bytesize, size
+  assert_equal s.bytesize, Zstd.frame_info(d)[:content_size]
+  assert_equal s.bytesize, Zstd.decompress_file("#SAMPLE.src.zst", "#SAMPLE.src.out")
+  assert_equal s, File.open("#SAMPLE.src.out", "rb") { |f| f.read }
+
+  File.open("#SAMPLE.src.zst", "rb") do |src|
+    File.open("#SAMPLE.src.out", "wb") do |dest|
+      assert_equal s.bytesize, Zstd.copy_stream(src, dest, :decode)
+    end
+  end
+  assert_equal s, File.open("#SAMPLE.src.out", "rb") { |f| f.read }
+  File.open("#SAMPLE.src.zst", "rb") do |src|
+    File.open("#SAMPLE.src.out", "wb") do |dest|
+      assert_equal s.bytesize, Zstd.copy_stream(src.fileno, dest.fileno, :decode)
+    end
+  end
+  assert_equal s, File.open("#SAMPLE.src.out", "rb") { |f| f.read }
+
+  # 入力元が先に読み込んで溜めているデータも伸長する
+  File.open("#SAMPLE.src.zst", "wb") { |f| f << "head" << d }
+  File.open("#SAMPLE.src.zst", "rb") do |src|
+    assert_equal "head", src.read(4)
+    assert_equal s.bytesize, Zstd.copy_stream(src, d2 = "", :decode)
+    assert_equal s, d2
+  end
+
+  Zstd.write("#SAMPLE.src.zst", s)
+  assert_equal s, Zstd.read("#SAMPLE.src.zst")
+
+  assert_raise(ArgumentError) { Zstd.compress_file("#SAMPLE.src", "#SAMPLE.src") }
+  assert_equal s, File.open("#SAMPLE.src", "rb") { |f| f.read }
+end
+
+assert("Zstd:stream decoding with readsize and readahead") do
+  s = "123456789abcdefg" * 11111
+  d = Zstd.encode(s)
+
+  src = Object.new
+  def src.data=(s); @data = s; end
+  def src.sizes; @sizes ||= []; end
+  def src.read(size, buf = ""); sizes << size; buf.replace(@data.slice!(0, size)); buf.empty? ? nil : buf; end
+
+  src.data = d.dup
+  assert_equal s, Zstd.decode(src, readsize: 100, readahead: 3) { |z| z.read }
+  assert_equal [300], src.sizes.uniq
+
+  assert_raise(ArgumentError) { Zstd::Decoder.new(src, readsize: 0) }
+  assert_raise(ArgumentError) { Zstd::Decoder.new(src, readahead: -1) }
+
+  skip "(without mruby-io)" unless Object.const_defined?(:File)
+
+  File.open("#SAMPLE.ra.zst", "wb") { |f| f << d }
+  File.open("#SAMPLE.ra.zst", "rb") do |f|
+    # 通常ファイルは mmap されるため read_thread は無視される
+    assert_equal s, Zstd.decode(f, fd: true, read_thread: true, readsize: 1000) { |z| z.read }
+  end
+  File.open("#SAMPLE.ra.zst", "rb") do |f|
+    assert_equal s, Zstd.decode(nil, fd: f.fileno, readsize: 777, readahead: 2) { |z| z.read }
+  end
+end
+
 assert("Zstd:large stream decoding with IO") do
   skip "(without mruby-io)" unless Object.const_defined?(:File)
 
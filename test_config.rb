@@ -45,6 +45,23 @@ MRuby::Build.new("host32-with-zstdlegacy") do |conf|
   gem "."
 end
 
+MRuby::Build.new("host32-with-zstdmt") do |conf|
+  toolchain :clang
+
+  conf.build_dir = conf.name
+
+  cc.defines << "ZSTD_MULTITHREAD"
+  cc.defines << "MRUBY_ZSTD_STATS=1"
+
+  enable_debug
+  enable_test
+
+  gem core: "mruby-print"
+  gem core: "mruby-bin-mrbc"
+  gem core: "mruby-bin-mruby"
+  gem "."
+end
+
 MRuby::Build.new("host64") do |conf|
   toolchain :clang
 